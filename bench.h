@@ -0,0 +1,1265 @@
+#pragma once
+#include <stdbool.h>
+
+// headless micro benchmarks for the color pipeline, run them with
+// --bench, results are printed to stdout
+void run_benchmarks(void);
+
+// correctness checks run with --selftest, false if any of them fails
+bool run_self_tests(void);
+
+#ifdef BENCH_LIB_IMPLEMENTATION
+#include "colors.h"
+#include "colorspace.h"
+#include "extract.h"
+#include "pixels.h"
+#include "remap.h"
+#include "timer.h"
+#include <raylib.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_IMAGE_SIZE 2048
+
+// deterministic noise so every run benchmarks the same pixels
+static uint32_t bench_rand(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static Image bench_noise_image(int width, int height, int format) {
+  Image image = GenImageColor(width, height, BLACK);
+  uint32_t state = 0x9E3779B9;
+  uint8_t *data = image.data;
+  for (size_t i = 0; i < (size_t)width * height * 4; i++) {
+    data[i] = bench_rand(&state) >> 24;
+  }
+  if (format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+    ImageFormat(&image, format);
+  }
+  return image;
+}
+
+// smooth gradients with a little noise and two small flat logos, the
+// logos are what sparse uniform samples tend to miss
+static Image bench_photo_image(int width, int height) {
+  Image image = GenImageColor(width, height, BLACK);
+  Color *pixels = image.data;
+  uint32_t state = 0x2545F491;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int noise = (bench_rand(&state) >> 28) - 8;
+      int r = x * 255 / width + noise;
+      int g = y * 255 / height + noise;
+      int b = 96 + (x + y) * 64 / (width + height) + noise;
+      pixels[y * width + x] = (Color){r < 0 ? 0 : r > 255 ? 255 : r,
+                                      g < 0 ? 0 : g > 255 ? 255 : g,
+                                      b < 0 ? 0 : b > 255 ? 255 : b, 255};
+    }
+  }
+  int logo = width / 32;
+  for (int y = 0; y < logo; y++) {
+    for (int x = 0; x < logo; x++) {
+      pixels[(height / 5 + y) * width + width / 7 + x] = (Color){255, 0, 255};
+      pixels[(height * 3 / 4 + y) * width + width * 2 / 3 + x] =
+          (Color){0, 255, 64};
+    }
+  }
+  return image;
+}
+
+// the exact unique colors of an image and their counts, the bitmap is
+// cleared after every scan so one fixture can scan image after image
+typedef struct {
+  uint64_t *bitmap;
+  uint32_t *hist;
+  Color *colors;
+  uint32_t *counts;
+  size_t count;
+  size_t capacity;
+} bench_colors;
+
+static size_t bench_scan_colors(bench_colors *scan, Image image) {
+  if (!scan->bitmap) {
+    scan->bitmap = calloc(1, COLOR_BITMAP_BYTES);
+    scan->hist = calloc(COLOR_HIST_ENTRIES, sizeof(uint32_t));
+    if (!scan->bitmap || !scan->hist) {
+      printf("unable to allocate the color scan\n");
+      exit(1);
+    }
+  }
+  scan->count = scan_unique_colors(image, scan->bitmap, scan->hist,
+                                   &scan->colors, &scan->counts,
+                                   &scan->capacity);
+  clear_color_bitmap(scan->bitmap, scan->colors, scan->count);
+  return scan->count;
+}
+
+static void bench_colors_free(bench_colors *scan) {
+  free(scan->colors);
+  free(scan->counts);
+  free(scan->hist);
+  free(scan->bitmap);
+  *scan = (bench_colors){0};
+}
+
+static uint32_t bench_color_checksum(uint32_t sum, Color c) {
+  return sum * 31 + (c.r | (c.g << 8) | (c.b << 16) | ((uint32_t)c.a << 24));
+}
+
+static void bench_pixel_readers(void) {
+  struct {
+    int format;
+    const char *name;
+  } formats[] = {
+      {PIXELFORMAT_UNCOMPRESSED_GRAYSCALE, "GRAYSCALE"},
+      {PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA, "GRAY_ALPHA"},
+      {PIXELFORMAT_UNCOMPRESSED_R5G6B5, "R5G6B5"},
+      {PIXELFORMAT_UNCOMPRESSED_R8G8B8, "R8G8B8"},
+      {PIXELFORMAT_UNCOMPRESSED_R5G5B5A1, "R5G5B5A1"},
+      {PIXELFORMAT_UNCOMPRESSED_R4G4B4A4, "R4G4B4A4"},
+      {PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, "R8G8B8A8"},
+      {PIXELFORMAT_UNCOMPRESSED_R32, "R32"},
+      {PIXELFORMAT_UNCOMPRESSED_R32G32B32, "R32G32B32"},
+      {PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, "R32G32B32A32"},
+#if RAYLIB_VERSION_MAJOR >= 5
+      {PIXELFORMAT_UNCOMPRESSED_R16, "R16"},
+      {PIXELFORMAT_UNCOMPRESSED_R16G16B16, "R16G16B16"},
+      {PIXELFORMAT_UNCOMPRESSED_R16G16B16A16, "R16G16B16A16"},
+#endif
+  };
+
+  printf("\npixel readers, %dx%d image\n", BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE);
+  printf("%-14s %14s %14s %8s\n", "format", "GetImageColor", "reader",
+         "speedup");
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+    Image image =
+        bench_noise_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE, formats[f].format);
+    size_t pixel_cnt = (size_t)image.width * image.height;
+
+    double start = timer_now_ms();
+    uint32_t expected = 0;
+    for (int y = 0; y < image.height; y++) {
+      for (int x = 0; x < image.width; x++) {
+        expected = bench_color_checksum(expected, GetImageColor(image, x, y));
+      }
+    }
+    double generic_ms = timer_now_ms() - start;
+
+    start = timer_now_ms();
+    pixel_reader reader = get_pixel_reader(image.format);
+    Color scratch[256];
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < pixel_cnt; i += 256) {
+      size_t count = pixel_cnt - i < 256 ? pixel_cnt - i : 256;
+      const Color *pixels = read_pixels(&image, reader, i, count, scratch);
+      for (size_t j = 0; j < count; j++) {
+        checksum = bench_color_checksum(checksum, pixels[j]);
+      }
+    }
+    double reader_ms = timer_now_ms() - start;
+
+    printf("%-14s %11.2fns %11.2fns %7.1fx%s\n", formats[f].name,
+           generic_ms * 1e6 / pixel_cnt, reader_ms * 1e6 / pixel_cnt,
+           generic_ms / reader_ms, checksum == expected ? "" : " MISMATCH");
+    UnloadImage(image);
+  }
+}
+
+static void bench_key_kernels(void) {
+  key_kernel_entry kernels[8];
+  size_t kernel_cnt = get_key_kernels(kernels, 8);
+  uint64_t *bitmap = malloc(COLOR_BITMAP_BYTES);
+  uint32_t keys[256];
+  uint32_t starts[256];
+
+  // noise has no runs at all, blocks repeat each color 32 times
+  // like flat graphics do
+  Image noise = bench_noise_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE,
+                                  PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  Image blocks = ImageCopy(noise);
+  Color *block_pixels = blocks.data;
+  size_t pixel_cnt = (size_t)noise.width * noise.height;
+  for (size_t i = 0; i < pixel_cnt; i++) {
+    block_pixels[i] = block_pixels[i & ~(size_t)31];
+  }
+  Image images[2] = {noise, blocks};
+  const char *image_names[2] = {"noise", "blocks"};
+
+  printf("\nkey kernels + bitmap scatter, %dx%d RGBA8, one thread\n",
+         BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE);
+  printf("%-8s %-8s %10s %10s\n", "image", "kernel", "GB/s", "colors");
+  for (size_t img = 0; img < 2; img++) {
+    const Color *pixels = images[img].data;
+    for (size_t k = 0; k < kernel_cnt; k++) {
+      memset(bitmap, 0, COLOR_BITMAP_BYTES);
+      double start = timer_now_ms();
+      for (size_t i = 0; i < pixel_cnt; i += 256) {
+        size_t count = pixel_cnt - i < 256 ? pixel_cnt - i : 256;
+        size_t key_cnt = kernels[k].kernel(pixels + i, count, keys, starts);
+        for (size_t j = 0; j < key_cnt; j++) {
+          bitmap_mark_atomic(bitmap, keys[j]);
+        }
+      }
+      double elapsed_ms = timer_now_ms() - start;
+      size_t color_cnt = 0;
+      for (size_t i = 0; i < COLOR_BITMAP_WORDS; i++) {
+        color_cnt += __builtin_popcountll(bitmap[i]);
+      }
+      printf("%-8s %-8s %10.2f %10zu\n", image_names[img], kernels[k].name,
+             pixel_cnt * sizeof(Color) / (elapsed_ms * 1e6), color_cnt);
+    }
+  }
+  UnloadImage(noise);
+  UnloadImage(blocks);
+  free(bitmap);
+}
+
+static void bench_bitmap_clearing(void) {
+  struct {
+    int width, height;
+  } sizes[] = {{16, 16},     {64, 64},     {256, 256},
+               {1024, 1024}, {4096, 4096}, {7680, 4320}};
+  bench_colors scan = {0};
+
+  printf("\nexact scan per image, full memset vs clearing found colors\n");
+  printf("%-10s %10s %12s %12s\n", "size", "colors", "memset", "incremental");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    Image image = bench_noise_image(sizes[s].width, sizes[s].height,
+                                    PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    size_t pixel_cnt = (size_t)image.width * image.height;
+    // enough repeats that the small images aren't lost in timer noise
+    size_t repeats = pixel_cnt < (1 << 20) ? (1 << 20) / pixel_cnt : 1;
+    if (repeats > 1000) {
+      repeats = 1000;
+    }
+    size_t color_cnt = bench_scan_colors(&scan, image);
+
+    // both loops time the raw scan, the fixture only sets them up
+    double start = timer_now_ms();
+    for (size_t r = 0; r < repeats; r++) {
+      memset(scan.bitmap, 0, COLOR_BITMAP_BYTES);
+      color_cnt = scan_unique_colors(image, scan.bitmap, scan.hist,
+                                     &scan.colors, &scan.counts,
+                                     &scan.capacity);
+    }
+    double memset_ms = (timer_now_ms() - start) / repeats;
+
+    start = timer_now_ms();
+    for (size_t r = 0; r < repeats; r++) {
+      clear_color_bitmap(scan.bitmap, scan.colors, color_cnt);
+      color_cnt = scan_unique_colors(image, scan.bitmap, scan.hist,
+                                     &scan.colors, &scan.counts,
+                                     &scan.capacity);
+    }
+    double incremental_ms = (timer_now_ms() - start) / repeats;
+    clear_color_bitmap(scan.bitmap, scan.colors, color_cnt);
+
+    char size_name[32];
+    snprintf(size_name, sizeof(size_name), "%dx%d", image.width, image.height);
+    printf("%-10s %10zu %10.3fms %10.3fms\n", size_name, color_cnt, memset_ms,
+           incremental_ms);
+    UnloadImage(image);
+  }
+  bench_colors_free(&scan);
+}
+
+static int bench_key_compare(const void *a, const void *b) {
+  uint32_t key1 = *(const uint32_t *)a;
+  uint32_t key2 = *(const uint32_t *)b;
+  return (key1 > key2) - (key1 < key2);
+}
+
+// mean distance from each color of one palette to the closest color
+// of the other, taken both ways
+static float bench_palette_error(const ColorStruct *a, size_t a_len,
+                                 const ColorStruct *b, size_t b_len) {
+  float total = 0;
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < a_len; i++) {
+      float nearest = INFINITY;
+      for (size_t j = 0; j < b_len; j++) {
+        float dr = a[i].r - b[j].r;
+        float dg = a[i].g - b[j].g;
+        float db = a[i].b - b[j].b;
+        float distance = sqrtf(dr * dr + dg * dg + db * db);
+        nearest = distance < nearest ? distance : nearest;
+      }
+      total += nearest / (2 * a_len);
+    }
+    const ColorStruct *swap = a;
+    a = b;
+    b = swap;
+    size_t swap_len = a_len;
+    a_len = b_len;
+    b_len = swap_len;
+  }
+  return total;
+}
+
+// pixel weighted mean squared rgb distance from each color to the
+// closest palette color, what the palette costs an image remapped to it
+static double bench_palette_mse(const Color *colors, const uint32_t *weights,
+                                size_t color_cnt, const ColorStruct *palette,
+                                size_t palette_len) {
+  double total = 0;
+  uint64_t total_weight = 0;
+  for (size_t i = 0; i < color_cnt; i++) {
+    int nearest = INT32_MAX;
+    for (size_t j = 0; j < palette_len; j++) {
+      int dr = colors[i].r - palette[j].r;
+      int dg = colors[i].g - palette[j].g;
+      int db = colors[i].b - palette[j].b;
+      int distance = dr * dr + dg * dg + db * db;
+      nearest = distance < nearest ? distance : nearest;
+    }
+    total += (double)nearest * weights[i];
+    total_weight += weights[i];
+  }
+  return total_weight ? total / total_weight : 0;
+}
+
+static void bench_sampling_patterns(void) {
+  const size_t palette_size = 16;
+  const size_t seeds = 8;
+  const size_t sample_counts[] = {256, 1024, 4096, 16384, 65536};
+  Image image = bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4);
+
+  // reference palette from every pixel
+  bench_colors scan = {0};
+  size_t color_cnt = bench_scan_colors(&scan, image);
+  ColorStruct exact_palette[16];
+  size_t exact_len = gen_weighted_median_palette(
+      exact_palette, palette_size, (ColorStruct *)scan.colors, scan.counts,
+      color_cnt);
+
+  const size_t count_cnt = sizeof(sample_counts) / sizeof(sample_counts[0]);
+  float errors[sizeof(sample_counts) / sizeof(sample_counts[0])]
+              [SAMPLE_BLUE_NOISE + 1] = {0};
+  Color *samples = malloc(sample_counts[4] * sizeof(Color));
+  uint32_t *keys = malloc(sample_counts[4] * sizeof(uint32_t));
+  ColorStruct *unique = malloc(sample_counts[4] * sizeof(ColorStruct));
+  uint32_t *unique_counts = malloc(sample_counts[4] * sizeof(uint32_t));
+  for (size_t n = 0; n < count_cnt; n++) {
+    size_t sample_cnt = sample_counts[n];
+    for (int p = SAMPLE_UNIFORM; p <= SAMPLE_BLUE_NOISE; p++) {
+      for (size_t seed = 1; seed <= seeds; seed++) {
+        sample_options options = {
+            .max_samples = sample_cnt, .seed = seed, .pattern = p};
+        sample_sequence sequence =
+            sample_sequence_init(&options, image.width, image.height);
+        read_samples(image, &sequence, 0, sample_cnt, samples);
+
+        // unique colors with sample counts
+        for (size_t i = 0; i < sample_cnt; i++) {
+          keys[i] = color_key(samples[i]);
+        }
+        qsort(keys, sample_cnt, sizeof(uint32_t), bench_key_compare);
+        size_t unique_cnt = 0;
+        for (size_t i = 0; i < sample_cnt; i++) {
+          if (i == 0 || keys[i] != keys[i - 1]) {
+            Color c = color_from_key(keys[i]);
+            unique[unique_cnt] = (ColorStruct){c.r, c.g, c.b, 255};
+            unique_counts[unique_cnt++] = 0;
+          }
+          unique_counts[unique_cnt - 1]++;
+        }
+
+        ColorStruct palette[16];
+        size_t palette_len = gen_weighted_median_palette(
+            palette, palette_size, unique, unique_counts, unique_cnt);
+        errors[n][p] += bench_palette_error(exact_palette, exact_len,
+                                            palette, palette_len) /
+                        seeds;
+      }
+    }
+  }
+
+  printf("\npalette error against the full scan palette, mean of %zu seeds\n",
+         seeds);
+  printf("%-8s", "samples");
+  for (int p = SAMPLE_UNIFORM; p <= SAMPLE_BLUE_NOISE; p++) {
+    printf(" %12s", sample_pattern_name(p));
+  }
+  printf("\n");
+  for (size_t n = 0; n < count_cnt; n++) {
+    printf("%-8zu", sample_counts[n]);
+    for (int p = SAMPLE_UNIFORM; p <= SAMPLE_BLUE_NOISE; p++) {
+      printf(" %12.2f", errors[n][p]);
+    }
+    printf("\n");
+  }
+
+  free(samples);
+  free(keys);
+  free(unique);
+  free(unique_counts);
+  bench_colors_free(&scan);
+  UnloadImage(image);
+}
+
+static void bench_quantization(void) {
+  const size_t palette_size = 16;
+  Image image = bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4);
+  bench_colors scan = {0};
+  size_t color_cnt = bench_scan_colors(&scan, image);
+  Color *voxels = malloc(color_cnt * sizeof(Color));
+  uint32_t *voxel_counts = malloc(color_cnt * sizeof(uint32_t));
+
+  size_t voxel_cnts[QUANT_MAX_BITS + 1];
+  double quantize_ms[QUANT_MAX_BITS + 1];
+  double palette_ms[QUANT_MAX_BITS + 1];
+  float errors[QUANT_MAX_BITS + 1];
+  ColorStruct exact_palette[16];
+  size_t exact_len = 0;
+  for (uint32_t bits = QUANT_MAX_BITS; bits >= QUANT_MIN_BITS; bits--) {
+    memcpy(voxels, scan.colors, color_cnt * sizeof(Color));
+    memcpy(voxel_counts, scan.counts, color_cnt * sizeof(uint32_t));
+    double start = timer_now_ms();
+    voxel_cnts[bits] =
+        quantize_color_list(voxels, voxel_counts, color_cnt, bits, scan.hist);
+    quantize_ms[bits] = timer_now_ms() - start;
+
+    ColorStruct palette[16];
+    start = timer_now_ms();
+    size_t palette_len =
+        gen_weighted_median_palette(palette, palette_size, (ColorStruct *)voxels,
+                                    voxel_counts, voxel_cnts[bits]);
+    palette_ms[bits] = timer_now_ms() - start;
+    if (bits == QUANT_MAX_BITS) {
+      memcpy(exact_palette, palette, sizeof(palette));
+      exact_len = palette_len;
+    }
+    errors[bits] =
+        bench_palette_error(exact_palette, exact_len, palette, palette_len);
+  }
+
+  printf("\nquantization grid on a %dx%d photo, %zu unique colors\n",
+         image.width, image.height, color_cnt);
+  printf("%-5s %10s %12s %12s %8s\n", "bits", "voxels", "quantize", "palette",
+         "error");
+  for (uint32_t bits = QUANT_MAX_BITS; bits >= QUANT_MIN_BITS; bits--) {
+    printf("%-5u %10zu %10.2fms %10.2fms %8.2f\n", bits, voxel_cnts[bits],
+           quantize_ms[bits], palette_ms[bits], errors[bits]);
+  }
+
+  free(voxels);
+  free(voxel_counts);
+  bench_colors_free(&scan);
+  UnloadImage(image);
+}
+
+static void bench_cardinality(void) {
+  const size_t pixel_budgets[] = {1 << 14, 1 << 18, SIZE_MAX};
+  Image images[] = {
+      bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4),
+      bench_noise_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE,
+                        PIXELFORMAT_UNCOMPRESSED_R8G8B8A8),
+      bench_noise_image(256, 256, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8)};
+  const char *image_names[] = {"photo", "noise", "small"};
+  bench_colors scan = {0};
+
+  printf("\nunique colors estimated among the hashed pixels against the "
+         "exact count of the image\n");
+  printf("%-6s %10s %10s %10s %10s %10s %10s\n", "image", "exact", "hashed",
+         "estimate", "low", "high", "time");
+  for (size_t img = 0; img < sizeof(images) / sizeof(images[0]); img++) {
+    double start = timer_now_ms();
+    size_t color_cnt = bench_scan_colors(&scan, images[img]);
+    double exact_ms = timer_now_ms() - start;
+    printf("%-6s %10zu %10s %10s %10s %10s %8.2fms\n", image_names[img],
+           color_cnt, "all", "", "", "", exact_ms);
+    for (size_t b = 0; b < sizeof(pixel_budgets) / sizeof(pixel_budgets[0]);
+         b++) {
+      start = timer_now_ms();
+      color_estimate estimate =
+          estimate_unique_colors(images[img], pixel_budgets[b]);
+      double estimate_ms = timer_now_ms() - start;
+      printf("%-6s %10s %10zu %10.0f %10.0f %10.0f %8.2fms\n", "", "",
+             estimate.pixels, estimate.hashed[QUANT_MAX_BITS],
+             estimate.hashed_low[QUANT_MAX_BITS],
+             estimate.hashed_high[QUANT_MAX_BITS],
+             estimate_ms);
+    }
+    UnloadImage(images[img]);
+  }
+  bench_colors_free(&scan);
+}
+
+static void bench_median_split(void) {
+  const size_t palette_size = 16;
+  const size_t color_cnts[] = {40000, 1000000, COLOR_HIST_ENTRIES};
+  const size_t list_cnt = sizeof(color_cnts) / sizeof(color_cnts[0]);
+  double sort_ms[sizeof(color_cnts) / sizeof(color_cnts[0])];
+  double select_ms[sizeof(color_cnts) / sizeof(color_cnts[0])];
+  bool same[sizeof(color_cnts) / sizeof(color_cnts[0])];
+
+  // unique colors in random order, drawn by shuffling every key and
+  // taking a prefix
+  uint32_t *keys = malloc(COLOR_HIST_ENTRIES * sizeof(uint32_t));
+  for (uint32_t i = 0; i < COLOR_HIST_ENTRIES; i++) {
+    keys[i] = i;
+  }
+  uint32_t state = 0x9E3779B9;
+  for (size_t i = COLOR_HIST_ENTRIES - 1; i > 0; i--) {
+    size_t j = ((uint64_t)bench_rand(&state) * (i + 1)) >> 32;
+    uint32_t t = keys[i];
+    keys[i] = keys[j];
+    keys[j] = t;
+  }
+  ColorStruct *colors = malloc(COLOR_HIST_ENTRIES * sizeof(ColorStruct));
+  uint32_t *weights = malloc(COLOR_HIST_ENTRIES * sizeof(uint32_t));
+  for (size_t i = 0; i < COLOR_HIST_ENTRIES; i++) {
+    Color c = color_from_key(keys[i]);
+    colors[i] = (ColorStruct){c.r, c.g, c.b, 255};
+    // mostly rare colors with a few common ones, like a photo
+    weights[i] = 1 + (bench_rand(&state) >> 26) * (bench_rand(&state) >> 26);
+  }
+
+  for (size_t n = 0; n < list_cnt; n++) {
+    ColorStruct sorted[16], selected[16];
+    set_median_split(MEDIAN_SPLIT_SORT);
+    double start = timer_now_ms();
+    size_t sorted_len = gen_weighted_median_palette(
+        sorted, palette_size, colors, weights, color_cnts[n]);
+    sort_ms[n] = timer_now_ms() - start;
+    set_median_split(MEDIAN_SPLIT_SELECT);
+    start = timer_now_ms();
+    size_t selected_len = gen_weighted_median_palette(
+        selected, palette_size, colors, weights, color_cnts[n]);
+    select_ms[n] = timer_now_ms() - start;
+    same[n] = sorted_len == selected_len &&
+              memcmp(sorted, selected, sorted_len * sizeof(ColorStruct)) == 0;
+  }
+
+  printf("\nweighted median cut, qsort against radix selection\n");
+  printf("%-10s %12s %12s %8s\n", "colors", "qsort", "select", "same");
+  for (size_t n = 0; n < list_cnt; n++) {
+    printf("%-10zu %10.2fms %10.2fms %8s\n", color_cnts[n], sort_ms[n],
+           select_ms[n], same[n] ? "yes" : "NO");
+  }
+  free(keys);
+  free(colors);
+  free(weights);
+}
+
+static void bench_palette_backends(void) {
+  const size_t palette_size = 16;
+  Image images[] = {
+      bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4),
+      bench_noise_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE,
+                        PIXELFORMAT_UNCOMPRESSED_R8G8B8A8)};
+  const char *image_names[] = {"photo", "noise"};
+  const size_t image_cnt = sizeof(images) / sizeof(images[0]);
+  bench_colors scan = {0};
+
+  size_t color_cnts[sizeof(images) / sizeof(images[0])];
+  double elapsed_ms[sizeof(images) / sizeof(images[0])][PALETTE_BACKEND_COUNT];
+  double mse[sizeof(images) / sizeof(images[0])][PALETTE_BACKEND_COUNT];
+  double stream_ms[sizeof(images) / sizeof(images[0])];
+  double stream_mse[sizeof(images) / sizeof(images[0])];
+  for (size_t img = 0; img < image_cnt; img++) {
+    // the octree straight from the pixels, no color list at all
+    const ColorStruct *pixels = images[img].data;
+    size_t pixel_cnt = (size_t)images[img].width * images[img].height;
+    ColorStruct stream_palette[16];
+    double start = timer_now_ms();
+    OctreeQuantizer *tree =
+        octree_create(OCTREE_MAX_DEPTH, palette_size * OCTREE_LEAF_HEADROOM);
+    for (size_t i = 0; i < pixel_cnt; i++) {
+      octree_add_color(tree, pixels[i], 1);
+    }
+    octree_reduce_to(tree, palette_size);
+    size_t stream_len = octree_palette(tree, stream_palette);
+    octree_destroy(tree);
+    stream_ms[img] = timer_now_ms() - start;
+
+    color_cnts[img] = bench_scan_colors(&scan, images[img]);
+    for (int backend = 0; backend < PALETTE_BACKEND_COUNT; backend++) {
+      ColorStruct palette[16];
+      set_palette_backend(backend);
+      double start = timer_now_ms();
+      size_t palette_len = gen_weighted_median_palette(
+          palette, palette_size, (ColorStruct *)scan.colors, scan.counts,
+          color_cnts[img]);
+      elapsed_ms[img][backend] = timer_now_ms() - start;
+      mse[img][backend] = bench_palette_mse(scan.colors, scan.counts,
+                                            color_cnts[img], palette,
+                                            palette_len);
+    }
+    stream_mse[img] = bench_palette_mse(scan.colors, scan.counts,
+                                        color_cnts[img], stream_palette,
+                                        stream_len);
+    UnloadImage(images[img]);
+  }
+  set_palette_backend(PALETTE_MEDIAN_CUT);
+
+  printf("\npalette backends, %zu colors\n", palette_size);
+  printf("%-6s %10s %-10s %12s %10s\n", "image", "colors", "backend", "time",
+         "mse");
+  for (size_t img = 0; img < image_cnt; img++) {
+    for (int backend = 0; backend < PALETTE_BACKEND_COUNT; backend++) {
+      printf("%-6s %10zu %-10s %10.2fms %10.1f\n", image_names[img],
+             color_cnts[img], palette_backend_name(backend),
+             elapsed_ms[img][backend], mse[img][backend]);
+    }
+    printf("%-6s %10zu %-10s %10.2fms %10.1f\n", image_names[img],
+           color_cnts[img], "stream", stream_ms[img], stream_mse[img]);
+  }
+  bench_colors_free(&scan);
+}
+
+static void bench_kmeans(void) {
+  const size_t palette_sizes[] = {16, 64};
+  const size_t size_cnt = sizeof(palette_sizes) / sizeof(palette_sizes[0]);
+  const uint32_t max_iterations = 20;
+  Image image = bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4);
+  bench_colors scan = {0};
+  size_t color_cnt = bench_scan_colors(&scan, image);
+
+  double seed_mse[sizeof(palette_sizes) / sizeof(palette_sizes[0])];
+  double refined_mse[sizeof(palette_sizes) / sizeof(palette_sizes[0])];
+  kmeans_report reports[sizeof(palette_sizes) / sizeof(palette_sizes[0])];
+  for (size_t n = 0; n < size_cnt; n++) {
+    ColorStruct palette[64];
+    size_t palette_len = gen_weighted_median_palette(
+        palette, palette_sizes[n], (ColorStruct *)scan.colors, scan.counts,
+        color_cnt);
+    seed_mse[n] = bench_palette_mse(scan.colors, scan.counts, color_cnt,
+                                    palette, palette_len);
+    reports[n] = refine_palette_kmeans(palette, palette_len,
+                                       (ColorStruct *)scan.colors, scan.counts,
+                                       color_cnt, max_iterations, 0.5f);
+    refined_mse[n] = bench_palette_mse(scan.colors, scan.counts, color_cnt,
+                                       palette, palette_len);
+  }
+
+  printf("\nk-means refinement of the median cut palette, %zu colors on %zu "
+         "threads\n",
+         color_cnt, parallel_thread_count());
+  printf("%-8s %10s %10s %11s %12s\n", "palette", "seed mse", "mse",
+         "iterations", "time");
+  for (size_t n = 0; n < size_cnt; n++) {
+    printf("%-8zu %10.1f %10.1f %11u %10.2fms\n", palette_sizes[n],
+           seed_mse[n], refined_mse[n], reports[n].iterations,
+           reports[n].elapsed_ms);
+  }
+  bench_colors_free(&scan);
+  UnloadImage(image);
+}
+
+static void bench_color_spaces(void) {
+  // every 24 bit color once
+  const size_t color_cnt = (size_t)1 << 24;
+  ColorStruct *colors = malloc(color_cnt * sizeof(ColorStruct));
+  for (size_t i = 0; i < color_cnt; i++) {
+    colors[i] = (ColorStruct){i & 0xFF, (i >> 8) & 0xFF, i >> 16, 255};
+  }
+  LabColor *reference = malloc(color_cnt * sizeof(LabColor));
+  LabColor *lab = malloc(color_cnt * sizeof(LabColor));
+  lab_kernel_entry kernels[8];
+  size_t kernel_cnt = get_lab_kernels(kernels, 8);
+
+  printf("\nsrgb to lab conversion, %zu colors, one thread\n", color_cnt);
+  printf("%-7s %-8s %12s %12s %12s\n", "space", "kernel", "Mcolors/s",
+         "max error", "round trip");
+  for (int space = COLOR_SPACE_OKLAB; space < COLOR_SPACE_COUNT; space++) {
+    // the scalar kernel is the reference the others are checked against
+    kernels[kernel_cnt - 1].kernel(colors, color_cnt, space, reference);
+    for (size_t k = 0; k < kernel_cnt; k++) {
+      double start = timer_now_ms();
+      for (size_t i = 0; i < color_cnt; i += 256) {
+        kernels[k].kernel(colors + i, 256, space, lab + i);
+      }
+      double elapsed_ms = timer_now_ms() - start;
+      float max_error = 0;
+      for (size_t i = 0; i < color_cnt; i++) {
+        float error = fmaxf(fmaxf(fabsf(lab[i].l - reference[i].l),
+                                  fabsf(lab[i].a - reference[i].a)),
+                            fabsf(lab[i].b - reference[i].b));
+        max_error = fmaxf(max_error, error);
+      }
+      printf("%-7s %-8s %12.1f %12.2g %12s\n", color_space_name(space),
+             kernels[k].name, color_cnt / (elapsed_ms * 1e3), max_error, "");
+    }
+    // srgb colors that do not come back from lab unchanged
+    size_t mismatched = 0;
+    for (size_t i = 0; i < color_cnt; i++) {
+      ColorStruct back = lab_to_srgb(reference[i], space);
+      mismatched += back.r != colors[i].r || back.g != colors[i].g ||
+                    back.b != colors[i].b;
+    }
+    printf("%-7s %-8s %12s %12s %12zu\n", color_space_name(space), "inverse",
+           "", "", mismatched);
+  }
+
+  ColorStruct *encoded = malloc(color_cnt * sizeof(ColorStruct));
+  printf("%-7s %-8s %12s\n", "space", "encode", "Mcolors/s");
+  for (int space = COLOR_SPACE_OKLAB; space < COLOR_SPACE_COUNT; space++) {
+    double start = timer_now_ms();
+    encode_colors(colors, color_cnt, space, encoded);
+    double elapsed_ms = timer_now_ms() - start;
+    printf("%-7s %zu %-6s %12.1f\n", color_space_name(space),
+           parallel_thread_count(), "thread", color_cnt / (elapsed_ms * 1e3));
+  }
+  free(encoded);
+  free(lab);
+  free(reference);
+  free(colors);
+}
+
+// palettes built in every working space, judged by rgb error and by
+// the mean OKLab distance (x100) the eye is closer to
+static void bench_palette_spaces(void) {
+  const size_t palette_size = 16;
+  Image image = bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4);
+  bench_colors scan = {0};
+  size_t color_cnt = bench_scan_colors(&scan, image);
+  LabColor *color_lab = malloc(color_cnt * sizeof(LabColor));
+  get_lab_kernel()((ColorStruct *)scan.colors, color_cnt, COLOR_SPACE_OKLAB,
+                   color_lab);
+
+  double elapsed_ms[PALETTE_BACKEND_COUNT][COLOR_SPACE_COUNT];
+  double mse[PALETTE_BACKEND_COUNT][COLOR_SPACE_COUNT];
+  double delta[PALETTE_BACKEND_COUNT][COLOR_SPACE_COUNT];
+  for (int backend = 0; backend < PALETTE_BACKEND_COUNT; backend++) {
+    set_palette_backend(backend);
+    for (int space = 0; space < COLOR_SPACE_COUNT; space++) {
+      ColorStruct palette[16];
+      LabColor palette_lab[16];
+      set_palette_space(space);
+      double start = timer_now_ms();
+      size_t palette_len = gen_weighted_median_palette(
+          palette, palette_size, (ColorStruct *)scan.colors, scan.counts,
+          color_cnt);
+      elapsed_ms[backend][space] = timer_now_ms() - start;
+      mse[backend][space] = bench_palette_mse(scan.colors, scan.counts,
+                                              color_cnt, palette, palette_len);
+      get_lab_kernel()(palette, palette_len, COLOR_SPACE_OKLAB, palette_lab);
+      double sum = 0, weight = 0;
+      for (size_t i = 0; i < color_cnt; i++) {
+        float best = INFINITY;
+        for (size_t p = 0; p < palette_len; p++) {
+          float dl = color_lab[i].l - palette_lab[p].l;
+          float da = color_lab[i].a - palette_lab[p].a;
+          float db = color_lab[i].b - palette_lab[p].b;
+          best = fminf(best, dl * dl + da * da + db * db);
+        }
+        sum += sqrtf(best) * scan.counts[i];
+        weight += scan.counts[i];
+      }
+      delta[backend][space] = sum / weight * 100;
+    }
+  }
+  set_palette_backend(PALETTE_MEDIAN_CUT);
+  set_palette_space(COLOR_SPACE_SRGB);
+
+  printf("\npalette working spaces, %zu colors from %zu\n", palette_size,
+         color_cnt);
+  printf("%-10s %-7s %12s %10s %10s\n", "backend", "space", "time", "rgb mse",
+         "mean dOK");
+  for (int backend = 0; backend < PALETTE_BACKEND_COUNT; backend++) {
+    for (int space = 0; space < COLOR_SPACE_COUNT; space++) {
+      printf("%-10s %-7s %10.2fms %10.1f %10.2f\n",
+             palette_backend_name(backend), color_space_name(space),
+             elapsed_ms[backend][space], mse[backend][space],
+             delta[backend][space]);
+    }
+  }
+  free(color_lab);
+  bench_colors_free(&scan);
+  UnloadImage(image);
+}
+
+// large palettes with both split priorities, the heap keeps the split
+// loop from rescanning every bucket so 256 colors cost little more
+// than 16
+static void bench_palette_sizes(void) {
+  const size_t palette_sizes[] = {16, 64, 256};
+  const size_t size_cnt = sizeof(palette_sizes) / sizeof(palette_sizes[0]);
+  const palette_backend backends[] = {PALETTE_MEDIAN_CUT, PALETTE_HISTOGRAM,
+                                      PALETTE_WU};
+  const size_t backend_cnt = sizeof(backends) / sizeof(backends[0]);
+  Image image = bench_photo_image(BENCH_IMAGE_SIZE, BENCH_IMAGE_SIZE * 3 / 4);
+  bench_colors scan = {0};
+  size_t color_cnt = bench_scan_colors(&scan, image);
+
+  double elapsed_ms[3][3][2];
+  double mse[3][3][2];
+  size_t lens[3][3][2];
+  for (size_t n = 0; n < size_cnt; n++) {
+    for (size_t b = 0; b < backend_cnt; b++) {
+      set_palette_backend(backends[b]);
+      for (int priority = SPLIT_BY_RANGE; priority <= SPLIT_BY_VARIANCE;
+           priority++) {
+        ColorStruct palette[256];
+        set_split_priority(priority);
+        double start = timer_now_ms();
+        lens[n][b][priority] = gen_weighted_median_palette(
+            palette, palette_sizes[n], (ColorStruct *)scan.colors,
+            scan.counts, color_cnt);
+        elapsed_ms[n][b][priority] = timer_now_ms() - start;
+        mse[n][b][priority] =
+            bench_palette_mse(scan.colors, scan.counts, color_cnt, palette,
+                              lens[n][b][priority]);
+      }
+    }
+  }
+  set_palette_backend(PALETTE_MEDIAN_CUT);
+  set_split_priority(SPLIT_BY_RANGE);
+
+  printf("\npalette sizes, %zu colors\n", color_cnt);
+  printf("%-8s %-10s %-9s %8s %12s %10s\n", "palette", "backend", "split",
+         "colors", "time", "mse");
+  for (size_t n = 0; n < size_cnt; n++) {
+    for (size_t b = 0; b < backend_cnt; b++) {
+      for (int priority = SPLIT_BY_RANGE; priority <= SPLIT_BY_VARIANCE;
+           priority++) {
+        printf("%-8zu %-10s %-9s %8zu %10.2fms %10.1f\n", palette_sizes[n],
+               palette_backend_name(backends[b]),
+               priority == SPLIT_BY_RANGE ? "range" : "variance",
+               lens[n][b][priority], elapsed_ms[n][b][priority],
+               mse[n][b][priority]);
+      }
+    }
+  }
+  bench_colors_free(&scan);
+  UnloadImage(image);
+}
+
+// remapping a 24 megapixel image to the palette with every dither
+// method and measuring the result. error diffusion is checked against
+// a one thread run since the wavefront has to give the same image
+static void bench_remap(void) {
+  const size_t palette_sizes[] = {16, 256};
+  const size_t size_cnt = sizeof(palette_sizes) / sizeof(palette_sizes[0]);
+  const int width = 6000, height = 4000;
+  Image image = bench_photo_image(width, height);
+  const ColorStruct *pixels = image.data;
+  size_t pixel_cnt = (size_t)width * height;
+  bench_colors scan = {0};
+  size_t color_cnt = bench_scan_colors(&scan, image);
+  uint8_t *indices = malloc(pixel_cnt);
+  uint8_t *reference = malloc(pixel_cnt);
+
+  ColorStruct palettes[2][256];
+  size_t palette_lens[2];
+  for (size_t n = 0; n < size_cnt; n++) {
+    palette_lens[n] = gen_weighted_median_palette(
+        palettes[n], palette_sizes[n], (ColorStruct *)scan.colors, scan.counts,
+        color_cnt);
+  }
+
+  size_t threads = parallel_thread_count();
+  printf("\nremapping %dx%d to the palette on %zu threads\n", width, height,
+         threads);
+  printf("%-8s %-7s %12s %12s %6s %10s %8s %8s %8s %10s\n", "palette",
+         "dither", "time", "Mpixels/s", "same", "metrics", "mse", "psnr",
+         "mean dE", "noticeable");
+  for (size_t n = 0; n < size_cnt; n++) {
+    const ColorStruct *palette = palettes[n];
+    double start = timer_now_ms();
+    uint8_t *table = build_inverse_palette(palette, palette_lens[n]);
+    printf("%-8zu %-7s %10.2fms\n", palette_lens[n], "table",
+           timer_now_ms() - start);
+    free(table);
+    for (int method = 0; method < DITHER_METHOD_COUNT; method++) {
+      start = timer_now_ms();
+      remap_image(pixels, width, height, palette, palette_lens[n], method,
+                  indices);
+      double elapsed_ms = timer_now_ms() - start;
+      start = timer_now_ms();
+      remap_metrics metrics = measure_remap(pixels, pixel_cnt, indices,
+                                            palette, palette_lens[n]);
+      double metrics_ms = timer_now_ms() - start;
+      const char *same = "";
+      if (method == DITHER_FLOYD_STEINBERG) {
+        parallel_set_thread_count(1);
+        remap_image(pixels, width, height, palette, palette_lens[n], method,
+                    reference);
+        parallel_set_thread_count(threads);
+        same = memcmp(indices, reference, pixel_cnt) == 0 ? "yes" : "NO";
+      }
+      printf("%-8zu %-7s %10.2fms %12.1f %6s %8.2fms %8.1f %8.2f %8.2f "
+             "%9.1f%%\n",
+             palette_lens[n], dither_method_name(method), elapsed_ms,
+             pixel_cnt / (elapsed_ms * 1e3), same, metrics_ms, metrics.mse,
+             metrics.psnr, metrics.mean_delta_e, 100 * metrics.noticeable);
+    }
+  }
+  free(reference);
+  free(indices);
+  bench_colors_free(&scan);
+  UnloadImage(image);
+}
+
+static void bench_color_names(void) {
+  const ColorNameIndex *index = get_color_name_index();
+  if (!index) {
+    printf("\nnamed color index could not be built\n");
+    return;
+  }
+  printf("\nnamed color index over a %d^3 grid\n", NAME_GRID_SIDE);
+  printf("built in %.2fms, %zu candidates (%.1f per cell, %zu at most), "
+         "%.1fKB\n",
+         index->build_ms, index->candidate_cnt,
+         (double)index->candidate_cnt / NAME_GRID_CELLS, index->max_cell_cnt,
+         color_name_index_bytes(index) / 1024.0);
+
+  // every third level of each channel, cell edges included
+  size_t checked = 0, mismatches = 0;
+  for (int r = 0; r < 256; r += 3) {
+    for (int g = 0; g < 256; g += 3) {
+      for (int b = 0; b < 256; b += 3) {
+        checked++;
+        mismatches += find_closest_color(r, g, b) !=
+                      find_closest_color_linear(r, g, b);
+      }
+    }
+  }
+  printf("%zu colors checked against the linear scan, %zu differ\n",
+         checked, mismatches);
+
+  const ColorNameTree *tree = get_color_name_tree();
+  if (tree) {
+    printf("k-d tree of depth %zu with %zu leaves built in %.2fms\n",
+           tree->depth, tree->leaf_cnt, tree->build_ms);
+  }
+
+  const size_t lookups = 1 << 19;
+  ColorStruct *queries = malloc(lookups * sizeof(ColorStruct));
+  uint32_t state = 1;
+  for (size_t i = 0; i < lookups; i++) {
+    uint32_t bits = bench_rand(&state);
+    queries[i] = (ColorStruct){bits, bits >> 8, bits >> 16, 255};
+  }
+  const char **reference = malloc(lookups * sizeof(char *));
+  const char **results = malloc(lookups * sizeof(char *));
+  for (size_t i = 0; i < lookups; i++) {
+    reference[i] =
+        find_closest_color_linear(queries[i].r, queries[i].g, queries[i].b);
+  }
+  printf("%-8s %12s %12s %12s %12s %6s\n", "search", "single",
+         "Mlookups/s", "batched", "Mlookups/s", "same");
+  for (int search = 0; search < NAME_SEARCH_COUNT; search++) {
+    set_name_search(search);
+    double start = timer_now_ms();
+    for (size_t i = 0; i < lookups; i++) {
+      results[i] = find_closest_color(queries[i].r, queries[i].g, queries[i].b);
+    }
+    double single_ms = timer_now_ms() - start;
+    bool same = memcmp(results, reference, lookups * sizeof(char *)) == 0;
+    memset(results, 0, lookups * sizeof(char *));
+    start = timer_now_ms();
+    find_closest_colors(queries, lookups, results);
+    double batched_ms = timer_now_ms() - start;
+    same = same && memcmp(results, reference, lookups * sizeof(char *)) == 0;
+    printf("%-8s %10.2fms %12.2f %10.2fms %12.2f %6s\n",
+           name_search_name(search), single_ms, lookups / (single_ms * 1e3),
+           batched_ms, lookups / (batched_ms * 1e3), same ? "yes" : "NO");
+  }
+  set_name_search(NAME_SEARCH_GRID);
+  free(results);
+  free(reference);
+  free(queries);
+}
+
+// names colors with each perceptual metric through its k-d tree and
+// checks every one against the exhaustive scan
+// colors to name, an even grid over the cube followed by random_cnt
+// random colors drawn from seed. NULL if they can't be allocated
+static ColorStruct *bench_name_queries(size_t random_cnt, uint32_t seed,
+                                       size_t *count) {
+  const int stride = 17; // 16 levels per channel, 0 and 255 included
+  size_t query_cnt = random_cnt + 16 * 16 * 16;
+  ColorStruct *queries = malloc(query_cnt * sizeof(ColorStruct));
+  if (!queries) {
+    return NULL;
+  }
+  size_t n = 0;
+  for (int r = 0; r < 256; r += stride) {
+    for (int g = 0; g < 256; g += stride) {
+      for (int b = 0; b < 256; b += stride) {
+        queries[n++] = (ColorStruct){r, g, b, 255};
+      }
+    }
+  }
+  uint32_t state = seed;
+  while (n < query_cnt) {
+    uint32_t bits = bench_rand(&state);
+    queries[n++] = (ColorStruct){bits, bits >> 8, bits >> 16, 255};
+  }
+  *count = query_cnt;
+  return queries;
+}
+
+static void bench_name_metrics(void) {
+  size_t query_cnt = 0;
+  ColorStruct *queries = bench_name_queries(16384, 7, &query_cnt);
+  const char **reference = malloc(query_cnt * sizeof(char *));
+  const char **results = malloc(query_cnt * sizeof(char *));
+
+  printf("\nnaming %zu colors by perceptual distance\n", query_cnt);
+  printf("%-8s %-8s %12s %12s %10s %8s %10s\n", "metric", "search", "time",
+         "us/lookup", "distances", "max", "differ");
+  const name_search searches[2] = {NAME_SEARCH_LINEAR, NAME_SEARCH_KDTREE};
+  for (int metric = NAME_METRIC_CIEDE2000; metric < NAME_METRIC_COUNT;
+       metric++) {
+    set_name_metric(metric);
+    for (int s = 0; s < 2; s++) {
+      set_name_search(searches[s]);
+      const char **out = s == 0 ? reference : results;
+      size_t total = 0, most = 0;
+      // the first lookup builds the tree, keep that out of the timing
+      find_closest_color(0, 0, 0);
+      double start = timer_now_ms();
+      for (size_t i = 0; i < query_cnt; i++) {
+        size_t evaluations;
+        out[i] = find_closest_color_counted(queries[i].r, queries[i].g,
+                                            queries[i].b, &evaluations);
+        total += evaluations;
+        most = evaluations > most ? evaluations : most;
+      }
+      double elapsed_ms = timer_now_ms() - start;
+      size_t differ = 0;
+      for (size_t i = 0; i < query_cnt; i++) {
+        differ += out[i] != reference[i];
+      }
+      printf("%-8s %-8s %10.2fms %12.2f %10.1f %8zu %10zu\n",
+             name_metric_name(metric), searches[s] == NAME_SEARCH_LINEAR
+                                           ? "scan"
+                                           : "kdtree",
+             elapsed_ms, elapsed_ms * 1e3 / query_cnt,
+             (double)total / query_cnt, most, differ);
+    }
+  }
+  set_name_metric(NAME_METRIC_RGB);
+  set_name_search(NAME_SEARCH_GRID);
+  free(results);
+  free(reference);
+  free(queries);
+}
+
+// round trips the built-in names through a dictionary file and times
+// mapping it against building the names and their index from scratch
+static void bench_color_dictionaries(void) {
+  const char *path = "bench_colors.dict";
+  ColorDictionary *builtin = get_color_dictionary();
+  printf("\ncolor dictionaries\n");
+  if (!save_color_dictionary(builtin, path)) {
+    printf("could not write %s\n", path);
+    return;
+  }
+  ColorDictionary *loaded = NULL;
+  double best_ms = INFINITY;
+  for (int repeat = 0; repeat < 16; repeat++) {
+    if (loaded) {
+      unload_color_dictionary(loaded);
+    }
+    loaded = load_color_dictionary(path);
+    if (loaded && loaded->load_ms < best_ms) {
+      best_ms = loaded->load_ms;
+    }
+  }
+  remove(path);
+  if (!loaded) {
+    printf("could not load %s back\n", path);
+    return;
+  }
+  printf("%s: %zu names in %.1fKB, built in %.2fms, %s in %.3fms\n",
+         loaded->label, loaded->count, loaded->block_bytes / 1024.0,
+         builtin->load_ms, loaded->mapped ? "mapped" : "read", best_ms);
+
+  // the loaded names live in its block, so compare the text against
+  // its own linear scan and against the built-in names
+  size_t checked = 0, mismatches = 0;
+  for (int r = 0; r < 256; r += 5) {
+    for (int g = 0; g < 256; g += 5) {
+      for (int b = 0; b < 256; b += 5) {
+        set_color_dictionary(loaded);
+        const char *name = find_closest_color(r, g, b);
+        const char *linear = find_closest_color_linear(r, g, b);
+        set_color_dictionary(NULL);
+        checked++;
+        mismatches += strcmp(name, linear) != 0 ||
+                      strcmp(name, find_closest_color(r, g, b)) != 0;
+      }
+    }
+  }
+  printf("%zu colors named from the loaded copy, %zu differ\n", checked,
+         mismatches);
+  unload_color_dictionary(loaded);
+}
+
+// CIEDE2000 test data from Sharma, Wu and Dalal, "The CIEDE2000
+// color-difference formula: implementation notes, supplementary test
+// data, and mathematical observations" (2005). two CIELAB colors and
+// their difference per row
+static const float sharma_pairs[][7] = {
+    {50.0000f, 2.6772f, -79.7751f, 50.0000f, 0.0000f, -82.7485f, 2.0425f},
+    {50.0000f, 3.1571f, -77.2803f, 50.0000f, 0.0000f, -82.7485f, 2.8615f},
+    {50.0000f, 2.8361f, -74.0200f, 50.0000f, 0.0000f, -82.7485f, 3.4412f},
+    {50.0000f, -1.3802f, -84.2814f, 50.0000f, 0.0000f, -82.7485f, 1.0000f},
+    {50.0000f, -1.1848f, -84.8006f, 50.0000f, 0.0000f, -82.7485f, 1.0000f},
+    {50.0000f, -0.9009f, -85.5211f, 50.0000f, 0.0000f, -82.7485f, 1.0000f},
+    {50.0000f, 0.0000f, 0.0000f, 50.0000f, -1.0000f, 2.0000f, 2.3669f},
+    {50.0000f, -1.0000f, 2.0000f, 50.0000f, 0.0000f, 0.0000f, 2.3669f},
+    {50.0000f, 2.4900f, -0.0010f, 50.0000f, -2.4900f, 0.0009f, 7.1792f},
+    {50.0000f, 2.4900f, -0.0010f, 50.0000f, -2.4900f, 0.0010f, 7.1792f},
+    {50.0000f, 2.4900f, -0.0010f, 50.0000f, -2.4900f, 0.0011f, 7.2195f},
+    {50.0000f, 2.4900f, -0.0010f, 50.0000f, -2.4900f, 0.0012f, 7.2195f},
+    {50.0000f, -0.0010f, 2.4900f, 50.0000f, 0.0009f, -2.4900f, 4.8045f},
+    {50.0000f, -0.0010f, 2.4900f, 50.0000f, 0.0010f, -2.4900f, 4.8045f},
+    {50.0000f, -0.0010f, 2.4900f, 50.0000f, 0.0011f, -2.4900f, 4.7461f},
+    {50.0000f, 2.5000f, 0.0000f, 50.0000f, 0.0000f, -2.5000f, 4.3065f},
+    {50.0000f, 2.5000f, 0.0000f, 73.0000f, 25.0000f, -18.0000f, 27.1492f},
+    {50.0000f, 2.5000f, 0.0000f, 61.0000f, -5.0000f, 29.0000f, 22.8977f},
+    {50.0000f, 2.5000f, 0.0000f, 56.0000f, -27.0000f, -3.0000f, 31.9030f},
+    {50.0000f, 2.5000f, 0.0000f, 58.0000f, 24.0000f, 15.0000f, 19.4535f},
+    {50.0000f, 2.5000f, 0.0000f, 50.0000f, 3.1736f, 0.5854f, 1.0000f},
+    {50.0000f, 2.5000f, 0.0000f, 50.0000f, 3.2972f, 0.0000f, 1.0000f},
+    {50.0000f, 2.5000f, 0.0000f, 50.0000f, 1.8634f, 0.5757f, 1.0000f},
+    {50.0000f, 2.5000f, 0.0000f, 50.0000f, 3.2592f, 0.3350f, 1.0000f},
+    {60.2574f, -34.0099f, 36.2677f, 60.4626f, -34.1751f, 39.4387f, 1.2644f},
+    {63.0109f, -31.0961f, -5.8663f, 62.8187f, -29.7946f, -4.0864f, 1.2630f},
+    {61.2901f, 3.7196f, -5.3901f, 61.4292f, 2.2480f, -4.9620f, 1.8731f},
+    {35.0831f, -44.1164f, 3.7933f, 35.0232f, -40.0716f, 1.5901f, 1.8645f},
+    {22.7233f, 20.0904f, -46.6940f, 23.0331f, 14.9730f, -42.5619f, 2.0373f},
+    {36.4612f, 47.8580f, 18.3852f, 36.2715f, 50.5065f, 21.2231f, 1.4146f},
+    {90.8027f, -2.0831f, 1.4410f, 91.1528f, -1.6435f, 0.0447f, 1.4441f},
+    {90.9257f, -0.5406f, -0.9208f, 88.6381f, -0.8985f, -0.7239f, 1.5381f},
+    {6.7747f, -0.2908f, -2.4247f, 5.8714f, -0.0985f, -2.2286f, 0.6377f},
+    {2.0776f, 0.0795f, -1.1350f, 0.9033f, -0.0636f, -0.5514f, 0.9082f},
+};
+
+#define SHARMA_PAIR_COUNT (sizeof(sharma_pairs) / sizeof(sharma_pairs[0]))
+// the published differences are rounded to 4 decimals
+#define SHARMA_TOLERANCE 1e-4f
+
+static bool test_delta_e_2000(void) {
+  size_t failed = 0;
+  for (size_t i = 0; i < SHARMA_PAIR_COUNT; i++) {
+    const float *pair = sharma_pairs[i];
+    LabColor x = {pair[0], pair[1], pair[2]};
+    LabColor y = {pair[3], pair[4], pair[5]};
+    // the difference is symmetric, check both orders
+    float forward = delta_e_2000(x, y), backward = delta_e_2000(y, x);
+    if (fabsf(forward - pair[6]) > SHARMA_TOLERANCE ||
+        fabsf(backward - pair[6]) > SHARMA_TOLERANCE) {
+      printf("sharma pair %zu: %.4f and %.4f, expected %.4f\n", i + 1,
+             forward, backward, pair[6]);
+      failed++;
+    }
+  }
+  printf("delta e 2000 on %zu sharma pairs, %zu failed\n", SHARMA_PAIR_COUNT,
+         failed);
+  return failed == 0;
+}
+
+// every search has to name colors exactly like the exhaustive scan
+static bool test_name_searches(void) {
+  size_t query_cnt = 0;
+  ColorStruct *queries = bench_name_queries(1024, 11, &query_cnt);
+  if (!queries) {
+    printf("name searches: out of memory\n");
+    return false;
+  }
+
+  bool ok = true;
+  const name_search searches[2] = {NAME_SEARCH_GRID, NAME_SEARCH_KDTREE};
+  for (int metric = 0; metric < NAME_METRIC_COUNT; metric++) {
+    set_name_metric(metric);
+    // the perceptual metrics have no grid, they search their k-d tree
+    for (int s = metric == NAME_METRIC_RGB ? 0 : 1; s < 2; s++) {
+      size_t differ = 0;
+      for (size_t i = 0; i < query_cnt; i++) {
+        set_name_search(NAME_SEARCH_LINEAR);
+        const char *reference =
+            find_closest_color(queries[i].r, queries[i].g, queries[i].b);
+        set_name_search(searches[s]);
+        differ += find_closest_color(queries[i].r, queries[i].g,
+                                     queries[i].b) != reference;
+      }
+      printf("%s names by %s on %zu colors, %zu differ from the scan\n",
+             name_metric_name(metric), name_search_name(searches[s]),
+             query_cnt, differ);
+      ok = ok && differ == 0;
+    }
+  }
+  set_name_metric(NAME_METRIC_RGB);
+  set_name_search(NAME_SEARCH_GRID);
+  free(queries);
+  return ok;
+}
+
+// every rgb search against the plain scan of the built-in names in the
+// order they are listed, the answer from before the dictionary sorted
+// them. equally close names are common on a lattice
+static bool test_listed_order(void) {
+  const int stride = 5;
+  size_t name_cnt = 0;
+  const ColorName *names = get_builtin_color_names(&name_cnt);
+  set_color_dictionary(NULL);
+  set_name_metric(NAME_METRIC_RGB);
+  bool ok = true;
+  for (int s = 0; s < NAME_SEARCH_COUNT; s++) {
+    set_name_search(s);
+    size_t query_cnt = 0, differ = 0;
+    for (int r = 0; r < 256; r += stride) {
+      for (int g = 0; g < 256; g += stride) {
+        for (int b = 0; b < 256; b += stride) {
+          int min_distance = INT32_MAX;
+          const char *reference = "Unknown";
+          for (size_t i = 0; i < name_cnt; i++) {
+            int dr = names[i].r - r, dg = names[i].g - g, db = names[i].b - b;
+            int distance = dr * dr + dg * dg + db * db;
+            if (distance < min_distance) {
+              min_distance = distance;
+              reference = names[i].name;
+            }
+          }
+          differ += strcmp(find_closest_color(r, g, b), reference) != 0;
+          query_cnt++;
+        }
+      }
+    }
+    printf("rgb names by %s on %zu colors, %zu differ from the listed order\n",
+           name_search_name(s), query_cnt, differ);
+    ok = ok && differ == 0;
+  }
+  set_name_search(NAME_SEARCH_GRID);
+  return ok;
+}
+
+bool run_self_tests(void) {
+  bool ok = test_delta_e_2000();
+  ok = test_name_searches() && ok;
+  ok = test_listed_order() && ok;
+  printf(ok ? "all self tests passed\n" : "self tests failed\n");
+  return ok;
+}
+
+void run_benchmarks(void) {
+  bench_pixel_readers();
+  bench_key_kernels();
+  bench_bitmap_clearing();
+  bench_sampling_patterns();
+  bench_quantization();
+  bench_cardinality();
+  bench_median_split();
+  bench_palette_backends();
+  bench_palette_sizes();
+  bench_kmeans();
+  bench_color_spaces();
+  bench_palette_spaces();
+  bench_remap();
+  bench_color_names();
+  bench_name_metrics();
+  bench_color_dictionaries();
+}
+#endif
@@ -1 +1 @@
-gcc main.c -O3 -g3 -Wall -lraylib -lm -fsanitize=address
+gcc main.c -O3 -g3 -Wall -lraylib -lm -pthread -fsanitize=address
@@ -1,3 +1,16 @@
+import argparse
+import struct
+
+# must match colors.h
+DICTIONARY_MAGIC = b"COLRDICT"
+DICTIONARY_VERSION = 2
+GRID_BITS = 5
+GRID_SIDE = 1 << GRID_BITS
+GRID_CELLS = GRID_SIDE ** 3
+CELL_WIDTH = 256 // GRID_SIDE
+HEADER_FORMAT = "<8s12I"
+
+
 def parse_color_file(filename):
     colors = []
     with open(filename, 'r') as file:
@@ -16,6 +29,131 @@ def parse_color_file(filename):
 
     return colors
 
+
+def parse_line(line):
+    # xkcd "name<tab>#rrggbb", css "name #rrggbb" or x11 "r g b<tab><tab>name"
+    line = line.strip()
+    if not line or line[0] in "#!":
+        return None
+    if '#' in line:
+        name, color = line.rsplit('#', 1)
+        value = int(color.split()[0], 16)
+        return (name.strip(), value >> 16 & 0xFF, value >> 8 & 0xFF,
+                value & 0xFF)
+    fields = line.split(None, 3)
+    if len(fields) < 4:
+        return None
+    r, g, b = (int(c) for c in fields[:3])
+    return (fields[3].strip(), r, g, b)
+
+
+def read_names(filename):
+    names = []
+    with open(filename, 'r', encoding='utf-8') as file:
+        for line in file:
+            name = parse_line(line)
+            if name:
+                names.append(name)
+    return names
+
+
+def slab_distances(value, lo, hi):
+    near = lo - value if value < lo else value - hi if value > hi else 0
+    far = max(value - lo, hi - value)
+    return near * near, far * far
+
+
+def index_box(names, survivors, lo, size, cell_cnt, candidates):
+    # a name nearer to no color in the box than the farthest point of
+    # some other name can't be a candidate in any cell of the box, the
+    # same test colors.h runs per cell, so pruning here gives its sets
+    hi = [(c + size) * CELL_WIDTH - 1 for c in lo]
+    near = []
+    threshold = None
+    for i in survivors:
+        n = f = 0
+        for channel in range(3):
+            dn, df = slab_distances(names[i][channel + 1],
+                                    lo[channel] * CELL_WIDTH, hi[channel])
+            n += dn
+            f += df
+        near.append(n)
+        threshold = f if threshold is None or f < threshold else threshold
+    kept = [i for i, n in zip(survivors, near) if n <= threshold]
+    if size == 1:
+        cell = ((lo[0] * GRID_SIDE) + lo[1]) * GRID_SIDE + lo[2]
+        cell_cnt[cell] = len(kept)
+        candidates[cell] = kept
+        return
+    half = size // 2
+    for dr in (0, half):
+        for dg in (0, half):
+            for db in (0, half):
+                index_box(names, kept, [lo[0] + dr, lo[1] + dg, lo[2] + db],
+                          half, cell_cnt, candidates)
+
+
+def build_name_index(names):
+    cell_cnt = [0] * GRID_CELLS
+    candidates = [None] * GRID_CELLS
+    if names:
+        index_box(names, list(range(len(names))), [0, 0, 0], GRID_SIDE,
+                  cell_cnt, candidates)
+    cell_start = [0]
+    for cnt in cell_cnt:
+        cell_start.append(cell_start[-1] + cnt)
+    flat = [i for cell in candidates if cell for i in cell]
+    return cell_start, flat, max(cell_cnt)
+
+
+def align(offset):
+    return (offset + 7) & ~7
+
+
+def generate_dictionary(names, label):
+    # sorted by color, the first name listed for a color is kept. each
+    # keeps its place in the list as its rank, equally close names go to
+    # the lowest rank
+    order = sorted(range(len(names)),
+                   key=lambda i: names[i][1] << 16 | names[i][2] << 8 |
+                   names[i][3])
+    unique = []
+    ranks = []
+    for i in order:
+        if not unique or unique[-1][1:] != names[i][1:]:
+            unique.append(names[i])
+            ranks.append(i)
+    if len(unique) >= 0xFFFF:
+        raise ValueError("too many colors for a dictionary")
+
+    strings = bytearray(label.encode('utf-8') + b'\0')
+    entries = bytearray()
+    for (name, r, g, b), rank in zip(unique, ranks):
+        entries += struct.pack("<I4BI", len(strings), r, g, b, 0, rank)
+        strings += name.encode('utf-8') + b'\0'
+    cell_start, candidates, max_cell_cnt = build_name_index(unique)
+
+    entries_offset = align(struct.calcsize(HEADER_FORMAT))
+    cell_start_offset = align(entries_offset + len(entries))
+    candidates_offset = align(cell_start_offset + 4 * len(cell_start))
+    strings_offset = align(candidates_offset + 2 * len(candidates))
+    total_bytes = align(strings_offset + len(strings))
+
+    block = bytearray(total_bytes)
+    struct.pack_into(HEADER_FORMAT, block, 0, DICTIONARY_MAGIC,
+                     DICTIONARY_VERSION, GRID_BITS, len(unique),
+                     len(candidates), max_cell_cnt, 0, entries_offset,
+                     cell_start_offset, candidates_offset, strings_offset,
+                     len(strings), total_bytes)
+    block[entries_offset:entries_offset + len(entries)] = entries
+    struct.pack_into("<%dI" % len(cell_start), block, cell_start_offset,
+                     *cell_start)
+    struct.pack_into("<%dH" % len(candidates), block, candidates_offset,
+                     *candidates)
+    block[strings_offset:strings_offset + len(strings)] = strings
+    return bytes(block)
+
+
 def generate_c_array(colors):
     c_code = "typedef struct { const char* name; unsigned char r, g, b; } Color;\n\n"
     c_code += "Color colors[] = {\n"
@@ -42,29 +180,46 @@ def generate_c_array(colors):
     return c_code
 
 if __name__ == "__main__":
-    input_file = "rgb.txt"  # Change this to your file name
-    colors = []
-    with open(input_file, 'r') as file:
-        for line in file:
-            parts = line.split('\t')
-            name = parts[0]
-            color = parts[1][1:]
+    parser = argparse.ArgumentParser(
+        description="turn a list of color names into C or a dictionary "
+        "file for --dictionary")
+    parser.add_argument("input", nargs="?", default="rgb.txt",
+                        help="xkcd, css or x11 style color list")
+    parser.add_argument("--binary", metavar="OUT",
+                        help="write a dictionary file instead of colors.c")
+    parser.add_argument("--label",
+                        help="name of the dictionary, defaults to the "
+                        "input file name")
+    args = parser.parse_args()
 
-            print(color)
-            r = int(color,16) >> 16 & 0xFF
-            g = int(color,16) >> 8 & 0xFF
-            b = int(color,16) & 0xFF
-            print(r,g,b)
+    if args.binary:
+        label = args.label or args.input.rsplit('/', 1)[-1].split('.')[0]
+        block = generate_dictionary(read_names(args.input), label)
+        with open(args.binary, "wb") as output_file:
+            output_file.write(block)
+        print(f"dictionary saved to {args.binary}, {len(block)} bytes")
+    else:
+        colors = []
+        with open(args.input, 'r') as file:
+            for line in file:
+                parts = line.split('\t')
+                name = parts[0]
+                color = parts[1][1:]
 
+                print(color)
+                r = int(color,16) >> 16 & 0xFF
+                g = int(color,16) >> 8 & 0xFF
+                b = int(color,16) & 0xFF
+                print(r,g,b)
 
-            print(parts)
-            colors.append((name,r,g,b))
 
-    #colors = parse_color_file(input_file)
-    c_code = generate_c_array(colors)
-    
-    with open("colors.c", "w") as output_file:
-        output_file.write(c_code)
-    
-    print("C array saved to colors.c")
+                print(parts)
+                colors.append((name,r,g,b))
+
+        #colors = parse_color_file(input_file)
+        c_code = generate_c_array(colors)
+
+        with open("colors.c", "w") as output_file:
+            output_file.write(c_code)
 
+        print("C array saved to colors.c")
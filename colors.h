@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -11,14 +12,294 @@ typedef struct {
   unsigned char r, g, b, a;
 } ColorStruct;
 
+// color plus the number of pixels it stands for, the color comes first
+// so the ColorStruct comparators work on it unchanged
+typedef struct {
+  ColorStruct color;
+  uint32_t weight;
+} WeightedColor;
+
+// nearest entry of the current color dictionary by rgb distance, ties
+// go to the name listed first in the source list. answered from the
+// index below
 const char *find_closest_color(unsigned char r, unsigned char g,
                                unsigned char b);
 
+// the same answer from a scan of every name, kept as a reference
+const char *find_closest_color_linear(unsigned char r, unsigned char g,
+                                      unsigned char b);
+
+// the built-in names in the order they are listed, which is the order
+// ties are broken in
+const ColorName *get_builtin_color_names(size_t *count);
+
+// the rgb cube cut into NAME_GRID_SIDE^3 cells, each listing every
+// name that is nearest to at least one color inside it. a lookup only
+// scans its cell's short list. offsets and table indices rather than
+// pointers so the arrays can be saved and loaded as they are
+#define NAME_GRID_BITS 5
+#define NAME_GRID_SIDE (1 << NAME_GRID_BITS)
+#define NAME_GRID_CELLS (NAME_GRID_SIDE * NAME_GRID_SIDE * NAME_GRID_SIDE)
+
+typedef struct {
+  const uint32_t *cell_start; // NAME_GRID_CELLS + 1 offsets into candidates
+  const uint16_t *candidates; // name table indices, ascending in a cell
+  size_t candidate_cnt;
+  size_t max_cell_cnt; // longest list a lookup can scan
+  double build_ms;     // 0 when it was loaded with its dictionary
+} ColorNameIndex;
+
+// the current dictionary's index
+const ColorNameIndex *get_color_name_index(void);
+size_t color_name_index_bytes(const ColorNameIndex *index);
+
+// a table of named colors, either the built-in xkcd names or a file
+// compiled offline by color_script.py. both are one block laid out as
+// a header, the entries sorted by color, the grid index and the string
+// pool, and a file is mapped and used in place without any parsing.
+// little endian, like every target this builds for
+#define COLOR_DICTIONARY_MAGIC "COLRDICT"
+#define COLOR_DICTIONARY_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t grid_bits; // NAME_GRID_BITS the index was built for
+  uint32_t count;
+  uint32_t candidate_cnt;
+  uint32_t max_cell_cnt;
+  uint32_t label; // offset of the dictionary's own name in the pool
+  // sections from the start of the block, each 8 byte aligned
+  uint32_t entries_offset;
+  uint32_t cell_start_offset;
+  uint32_t candidates_offset;
+  uint32_t strings_offset;
+  uint32_t strings_bytes;
+  uint32_t total_bytes;
+} ColorDictionaryHeader;
+
+typedef struct {
+  uint32_t name; // offset of the name in the string pool
+  uint8_t r, g, b, pad;
+  uint32_t rank; // position in the source list, equally close names
+                 // go to the lowest rank
+} ColorDictionaryEntry;
+
+struct ColorNameTree;
+struct ColorLabTree;
+
+typedef struct {
+  const char *label;
+  const ColorDictionaryEntry *entries;
+  size_t count;
+  const char *strings;
+  ColorNameIndex index;
+  const void *block; // the whole dictionary, mapped or allocated
+  size_t block_bytes;
+  bool mapped;
+  double load_ms;
+  // searches other than the grid are built the first time they're used
+  struct ColorNameTree *tree;
+  bool tree_built;
+  struct ColorLabTree *lab_trees[3]; // per color_space
+  bool lab_trees_built[3];
+} ColorDictionary;
+
+// maps a dictionary file, NULL if it can't be read or isn't one
+ColorDictionary *load_color_dictionary(const char *path);
+// writes a dictionary out in the file format, the built-in one included
+bool save_color_dictionary(const ColorDictionary *dict, const char *path);
+void unload_color_dictionary(ColorDictionary *dict);
+
+// names come from dict from now on, NULL goes back to the built-in names.
+// switching is free, the dictionary carries its index
+void set_color_dictionary(ColorDictionary *dict);
+ColorDictionary *get_color_dictionary(void);
+
+// k-d tree over the names, split at the median of the widest channel
+// down to leaves of NAME_LEAF_SIZE names. stored implicitly, node n has
+// children 2n+1 and 2n+2, and the leaves hold their names as separate
+// channel arrays padded to the full leaf so each is scanned as one
+// vector
+#define NAME_LEAF_SIZE 16
+
+typedef struct ColorNameTree {
+  uint8_t *split_channel; // per inner node, 0 to 2 for r, g, b
+  uint8_t *split_value;   // left holds names <= this, right >= this
+  int32_t *r, *g, *b;     // leaf_cnt * NAME_LEAF_SIZE, padding far away
+  uint16_t *name;         // name table index of every leaf slot
+  size_t depth;           // levels of inner nodes
+  size_t leaf_cnt;
+  double build_ms;
+} ColorNameTree;
+
+// the current dictionary's tree
+const ColorNameTree *get_color_name_tree(void);
+
+typedef enum {
+  NAME_SEARCH_LINEAR, // scan every name
+  NAME_SEARCH_GRID,   // scan the names listed for the color's grid cell
+  NAME_SEARCH_KDTREE  // walk the k-d tree
+} name_search;
+
+#define NAME_SEARCH_COUNT (NAME_SEARCH_KDTREE + 1)
+
+// how find_closest_color and find_closest_colors search, all of them
+// return the same names
+void set_name_search(name_search search);
+const char *name_search_name(name_search search);
+
+// names n colors at once, spread over the worker threads
+void find_closest_colors(const ColorStruct *queries, size_t n,
+                         const char **out);
+
+// what "closest" means when naming a color. rgb is the squared channel
+// distance the searches above work with. the perceptual metrics walk a
+// k-d tree built in their lab space instead, pruning with bounds that
+// never exceed the true distance so they name colors exactly like an
+// exhaustive scan, which NAME_SEARCH_LINEAR still runs
+typedef enum {
+  NAME_METRIC_RGB,
+  NAME_METRIC_CIEDE2000, // CIEDE2000 between CIELAB colors
+  NAME_METRIC_OKLAB      // euclidean distance in OKLab
+} name_metric;
+
+#define NAME_METRIC_COUNT (NAME_METRIC_OKLAB + 1)
+
+void set_name_metric(name_metric metric);
+const char *name_metric_name(name_metric metric);
+
+// find_closest_color that also counts the names whose full distance
+// it computed, for the benchmarks
+const char *find_closest_color_counted(unsigned char r, unsigned char g,
+                                       unsigned char b, size_t *evaluations);
+
 size_t gen_median_palette_from_color_list(ColorStruct *palette,
-                                          uint8_t palette_size,
+                                          size_t palette_size,
                                           ColorStruct *color_list,
                                           size_t color_count);
 
+// weights[i] is how many pixels had color_list[i] so buckets split at
+// the weighted median and average to the weighted mean. NULL weights
+// every color the same. color_list is left untouched. the palette is
+// built by the backend picked with set_palette_backend
+size_t gen_weighted_median_palette(ColorStruct *palette, size_t palette_size,
+                                   const ColorStruct *color_list,
+                                   const uint32_t *weights, size_t color_count);
+
+typedef enum {
+  PALETTE_MEDIAN_CUT, // median cut on the color list itself
+  PALETTE_HISTOGRAM,  // median cut on boxes of a weighted 3d histogram
+  PALETTE_WU,         // Wu's variance minimizing cuts on the same histogram
+  PALETTE_OCTREE      // octree with its leaves merged down to the palette
+} palette_backend;
+
+#define PALETTE_BACKEND_COUNT (PALETTE_OCTREE + 1)
+
+void set_palette_backend(palette_backend backend);
+const char *palette_backend_name(palette_backend backend);
+
+// space the palette backends and k-means measure distances in. lab
+// spaces are perceptual, so colors the eye tells apart get their own
+// palette entries instead of being merged by raw rgb distance. the
+// palette is always returned as srgb
+typedef enum {
+  COLOR_SPACE_SRGB,
+  COLOR_SPACE_OKLAB,
+  COLOR_SPACE_CIELAB
+} color_space;
+
+#define COLOR_SPACE_COUNT (COLOR_SPACE_CIELAB + 1)
+
+void set_palette_space(color_space space);
+const char *color_space_name(color_space space);
+
+// which bucket median cut and the histogram backend split next. range
+// is the classic rule, variance splits where the most error is so
+// large palettes spend their colors on busy regions. Wu always uses
+// variance
+typedef enum {
+  SPLIT_BY_RANGE,   // widest channel extent
+  SPLIT_BY_VARIANCE // weighted squared distance to the mean
+} split_priority;
+
+void set_split_priority(split_priority priority);
+
+// cells per channel of the histogram and Wu backends are 2^bits, the
+// color list is only read once to fill it so splitting costs the same
+// for any number of colors
+#define HISTOGRAM_MIN_BITS 3
+#define HISTOGRAM_MAX_BITS 6
+void set_histogram_bits(uint32_t bits);
+
+// octree quantizer that takes colors one at a time, so a palette can be
+// built while an image is decoded without keeping a color list. when
+// a color adds a leaf past max_leaves the deepest, lightest node with
+// children absorbs them, so nodes come from a fixed pool sized by
+// max_leaves and depth. depth (1 to 8) is how many bits per channel
+// the tree resolves
+#define OCTREE_MAX_DEPTH 8
+// the backend keeps this many times the palette size in leaves while
+// colors come in and merges down at the end, so early merges see more
+// of the image
+#define OCTREE_LEAF_HEADROOM 8
+typedef struct OctreeQuantizer OctreeQuantizer;
+
+OctreeQuantizer *octree_create(uint32_t depth, size_t max_leaves);
+void octree_add_color(OctreeQuantizer *tree, ColorStruct color,
+                      uint32_t weight);
+// merges leaves until at most max_leaves are left, lowering the budget
+// for the colors still to come as well
+void octree_reduce_to(OctreeQuantizer *tree, size_t max_leaves);
+// writes the mean color of every leaf, palette needs room for
+// max_leaves colors. returns how many were written
+size_t octree_palette(const OctreeQuantizer *tree, ColorStruct *palette);
+void octree_destroy(OctreeQuantizer *tree);
+
+// depth of the tree the octree backend builds
+void set_octree_depth(uint32_t depth);
+
+typedef struct {
+  uint32_t iterations;
+  float last_shift; // furthest a palette color moved in the last iteration
+  double elapsed_ms;
+} kmeans_report;
+
+// weighted Lloyd iterations over the color list starting from palette,
+// which is updated in place. stops after max_iterations or once no
+// palette color moves more than tolerance
+kmeans_report refine_palette_kmeans(ColorStruct *palette, size_t palette_len,
+                                    const ColorStruct *color_list,
+                                    const uint32_t *weights,
+                                    size_t color_count,
+                                    uint32_t max_iterations, float tolerance);
+
+// refine_palette_kmeans on an srgb palette, measured in the space set
+// with set_palette_space like the palettes gen_weighted_median_palette
+// builds. the palette comes back as srgb
+kmeans_report refine_palette_in_space(ColorStruct *palette, size_t palette_len,
+                                      const ColorStruct *color_list,
+                                      const uint32_t *weights,
+                                      size_t color_count,
+                                      uint32_t max_iterations,
+                                      float tolerance);
+
+// iterations of k-means run on every generated palette, 0 turns it off
+void set_kmeans_iterations(uint32_t max_iterations);
+// what the k-means pass of the last generated palette did, all zero
+// when it was off
+kmeans_report get_last_kmeans_report(void);
+
+// how median cut finds the colors below a bucket's median. both order
+// colors by the widest channel and break ties with the other channels,
+// so they always make the same palette
+typedef enum {
+  MEDIAN_SPLIT_SELECT, // radix selection, linear in the bucket size
+  MEDIAN_SPLIT_SORT    // qsort the whole bucket, kept as a reference
+} median_split;
+
+void set_median_split(median_split split);
+
 int red_greater(const void *a, const void *b);
 int green_greater(const void *a, const void *b);
 int blue_greater(const void *a, const void *b);
@@ -27,8 +308,17 @@ ColorStruct fetch_average_color(ColorStruct *color_list, size_t len);
 void sort_palette_by_luminance(ColorStruct *palette, size_t palette_size);
 
 #ifdef COLOR_LIB_IMPLEMENTATION
+#include "colorspace.h"
+#include "parallel.h"
+#include "timer.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__) || defined(__EMSCRIPTEN__)
+#include <sys/mman.h>
+#define COLORS_HAVE_MMAP 1
+#endif
 typedef enum {
   RED_WIDEST,
   GREEN_WIDEST,
@@ -75,6 +365,152 @@ int blue_greater(const void *a, const void *b) {
   return 0;
 }
 
+// total orders on the widest channel then the other two, so which
+// colors end up below the median doesn't depend on how ties are sorted
+static inline uint32_t median_cut_key(ColorStruct c, Color_Wideness channel) {
+  switch (channel) {
+  case GREEN_WIDEST:
+    return ((uint32_t)c.g << 16) | ((uint32_t)c.r << 8) | c.b;
+  case BLUE_WIDEST:
+    return ((uint32_t)c.b << 16) | ((uint32_t)c.r << 8) | c.g;
+  default:
+    return ((uint32_t)c.r << 16) | ((uint32_t)c.g << 8) | c.b;
+  }
+}
+
+static int median_cut_compare(const void *a, const void *b,
+                              Color_Wideness channel) {
+  uint32_t key1 = median_cut_key(*(const ColorStruct *)a, channel);
+  uint32_t key2 = median_cut_key(*(const ColorStruct *)b, channel);
+  return (key1 > key2) - (key1 < key2);
+}
+
+static int red_order(const void *a, const void *b) {
+  return median_cut_compare(a, b, RED_WIDEST);
+}
+
+static int green_order(const void *a, const void *b) {
+  return median_cut_compare(a, b, GREEN_WIDEST);
+}
+
+static int blue_order(const void *a, const void *b) {
+  return median_cut_compare(a, b, BLUE_WIDEST);
+}
+
+static median_split median_cut_split = MEDIAN_SPLIT_SELECT;
+
+void set_median_split(median_split split) { median_cut_split = split; }
+
+static split_priority bucket_split_priority = SPLIT_BY_RANGE;
+
+void set_split_priority(split_priority priority) {
+  bucket_split_priority = priority;
+}
+
+// max heap of bucket indices ordered by priority[index], ties go to
+// the lower index so splits happen in the same order a scan for the
+// first largest bucket would pick them. holds at most one entry per
+// bucket so palette_size entries are enough
+typedef struct {
+  size_t *items;
+  size_t count;
+  double *priority;
+} BucketHeap;
+
+static inline bool bucket_heap_above(const BucketHeap *heap, size_t a,
+                                     size_t b) {
+  double pa = heap->priority[a], pb = heap->priority[b];
+  return pa > pb || (pa == pb && a < b);
+}
+
+static void bucket_heap_push(BucketHeap *heap, size_t bucket) {
+  size_t i = heap->count++;
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!bucket_heap_above(heap, bucket, heap->items[parent]))
+      break;
+    heap->items[i] = heap->items[parent];
+    i = parent;
+  }
+  heap->items[i] = bucket;
+}
+
+static size_t bucket_heap_pop(BucketHeap *heap) {
+  size_t top = heap->items[0];
+  size_t last = heap->items[--heap->count];
+  size_t i = 0;
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count &&
+        bucket_heap_above(heap, heap->items[child + 1], heap->items[child]))
+      child++;
+    if (!bucket_heap_above(heap, heap->items[child], last))
+      break;
+    heap->items[i] = heap->items[child];
+    i = child;
+  }
+  heap->items[i] = last;
+  return top;
+}
+
+static inline void swap_weighted(WeightedColor *a, WeightedColor *b) {
+  WeightedColor t = *a;
+  *a = *b;
+  *b = t;
+}
+
+// moves the longest prefix (in median_cut_key order) whose cost fits in
+// budget to the front and returns its length. a color costs twice its
+// weight with by_weight, which makes budget the bucket weight split at
+// the weighted median, and costs 1 otherwise so budget is a rank.
+// each key byte gets a 256 bin cost histogram and a three way
+// partition around the bin the prefix ends in, then only that bin is
+// looked at for the next byte, so it's linear in count
+static size_t select_split(WeightedColor *colors, size_t count,
+                           Color_Wideness channel, uint64_t budget,
+                           bool by_weight) {
+  size_t lo = 0, hi = count;
+  uint64_t spent = 0;
+  for (int shift = 16; shift >= 0; shift -= 8) {
+    uint64_t cost[256] = {0};
+    for (size_t i = lo; i < hi; i++) {
+      uint32_t byte = (median_cut_key(colors[i].color, channel) >> shift) & 0xFF;
+      cost[byte] += by_weight ? 2 * (uint64_t)colors[i].weight : 1;
+    }
+    uint32_t split = 0;
+    while (split < 256 && spent + cost[split] <= budget) {
+      spent += cost[split];
+      split++;
+    }
+    if (split == 256) {
+      // everything left fits
+      return hi;
+    }
+    size_t lt = lo, i = lo, gt = hi;
+    while (i < gt) {
+      uint32_t byte = (median_cut_key(colors[i].color, channel) >> shift) & 0xFF;
+      if (byte < split) {
+        swap_weighted(&colors[lt++], &colors[i++]);
+      } else if (byte > split) {
+        swap_weighted(&colors[i], &colors[--gt]);
+      } else {
+        i++;
+      }
+    }
+    lo = lt;
+    hi = gt;
+  }
+  // only duplicates of one color are left, take them while they fit
+  while (lo < hi &&
+         spent + (by_weight ? 2 * (uint64_t)colors[lo].weight : 1) <= budget) {
+    spent += by_weight ? 2 * (uint64_t)colors[lo].weight : 1;
+    lo++;
+  }
+  return lo;
+}
+
 ColorStruct fetch_average_color(ColorStruct *color_list, size_t len) {
   uint64_t color[3] = {0};
   for (int i = 0; i < len; i++) {
@@ -88,6 +524,22 @@ ColorStruct fetch_average_color(ColorStruct *color_list, size_t len) {
   return (ColorStruct){color[0], color[1], color[2]};
 }
 
+ColorStruct fetch_weighted_average_color(WeightedColor *color_list,
+                                         size_t len) {
+  uint64_t color[3] = {0};
+  uint64_t total = 0;
+  for (size_t i = 0; i < len; i++) {
+    color[0] += (uint64_t)color_list[i].color.r * color_list[i].weight;
+    color[1] += (uint64_t)color_list[i].color.g * color_list[i].weight;
+    color[2] += (uint64_t)color_list[i].color.b * color_list[i].weight;
+    total += color_list[i].weight;
+  }
+  if (total == 0) {
+    return (ColorStruct){0};
+  }
+  return (ColorStruct){color[0] / total, color[1] / total, color[2] / total};
+}
+
 // Calculate luminance value (perceived brightness)
 float calculate_luminance(ColorStruct c) {
   return 0.299f * c.r + 0.587f * c.g + 0.114f * c.b;
@@ -114,52 +566,894 @@ void sort_palette_by_luminance(ColorStruct *palette, size_t palette_size) {
 }
 
 size_t gen_median_palette_from_color_list(ColorStruct *palette,
-                                          uint8_t palette_size,
+                                          size_t palette_size,
                                           ColorStruct *color_list,
                                           size_t color_count) {
-  typedef struct {
-    ColorStruct *colors;
-    size_t count;
-    Color_Wideness widest_component;
-    uint8_t min_r, min_g, min_b;
-    uint8_t max_r, max_g, max_b;
-  } ColorBucket;
+  return gen_weighted_median_palette(palette, palette_size, color_list, NULL,
+                                     color_count);
+}
 
-  // Initial bucket containing all colors
-  ColorBucket *buckets = malloc(palette_size * sizeof(ColorBucket));
-  if (!buckets)
+static palette_backend palette_generator = PALETTE_MEDIAN_CUT;
+static uint32_t histogram_bits = 5;
+static color_space palette_space = COLOR_SPACE_SRGB;
+
+void set_palette_backend(palette_backend backend) {
+  palette_generator = backend;
+}
+
+const char *palette_backend_name(palette_backend backend) {
+  switch (backend) {
+  case PALETTE_MEDIAN_CUT:
+    return "median";
+  case PALETTE_HISTOGRAM:
+    return "histogram";
+  case PALETTE_WU:
+    return "wu";
+  case PALETTE_OCTREE:
+    return "octree";
+  }
+  return "unknown";
+}
+
+void set_palette_space(color_space space) { palette_space = space; }
+
+const char *color_space_name(color_space space) {
+  switch (space) {
+  case COLOR_SPACE_SRGB:
+    return "srgb";
+  case COLOR_SPACE_OKLAB:
+    return "oklab";
+  case COLOR_SPACE_CIELAB:
+    return "cielab";
+  }
+  return "unknown";
+}
+
+void set_histogram_bits(uint32_t bits) {
+  if (bits < HISTOGRAM_MIN_BITS)
+    bits = HISTOGRAM_MIN_BITS;
+  if (bits > HISTOGRAM_MAX_BITS)
+    bits = HISTOGRAM_MAX_BITS;
+  histogram_bits = bits;
+}
+
+// pixel count, channel sums and sum of squared channels of a block of
+// histogram cells. all integers so the cumulative sums are exact
+typedef struct {
+  uint64_t w, r, g, b, m2;
+} ColorMoment;
+
+// histogram colors per fill task, and a cap on the memory the per
+// task histograms may take
+#define MOMENT_TASK_COLORS 65536
+#define MOMENT_PARTIAL_BYTES (64 << 20)
+
+// cells (r0, r1] x (g0, g1] x (b0, b1] of a cumulative moment table,
+// the lower bounds are exclusive so a box is 8 table lookups
+typedef struct {
+  int r0, r1, g0, g1, b0, b1;
+} ColorBox;
+
+// tables are (side + 1)^3 with a zero plane at index 0 on every axis
+static inline size_t moment_index(int side, int r, int g, int b) {
+  return ((size_t)r * (side + 1) + g) * (side + 1) + b;
+}
+
+static inline void moment_add(ColorMoment *to, const ColorMoment *m,
+                              int sign) {
+  to->w += sign * m->w;
+  to->r += sign * m->r;
+  to->g += sign * m->g;
+  to->b += sign * m->b;
+  to->m2 += sign * m->m2;
+}
+
+static ColorMoment box_moment(const ColorMoment *table, int side,
+                              const ColorBox *box) {
+  // inclusion exclusion over the corners, unsigned wraparound cancels
+  ColorMoment m = {0};
+  moment_add(&m, &table[moment_index(side, box->r1, box->g1, box->b1)], 1);
+  moment_add(&m, &table[moment_index(side, box->r1, box->g1, box->b0)], -1);
+  moment_add(&m, &table[moment_index(side, box->r1, box->g0, box->b1)], -1);
+  moment_add(&m, &table[moment_index(side, box->r1, box->g0, box->b0)], 1);
+  moment_add(&m, &table[moment_index(side, box->r0, box->g1, box->b1)], -1);
+  moment_add(&m, &table[moment_index(side, box->r0, box->g1, box->b0)], 1);
+  moment_add(&m, &table[moment_index(side, box->r0, box->g0, box->b1)], 1);
+  moment_add(&m, &table[moment_index(side, box->r0, box->g0, box->b0)], -1);
+  return m;
+}
+
+typedef struct {
+  const ColorStruct *color_list;
+  const uint32_t *weights;
+  size_t color_count;
+  uint32_t bits;
+  int side;
+  size_t task_cnt;
+  ColorMoment **partial; // one histogram per fill task
+  ColorMoment *table;
+} moment_build_ctx;
+
+static void moment_fill_task(void *arg, size_t task, size_t thread) {
+  moment_build_ctx *ctx = arg;
+  ColorMoment *hist = ctx->partial[task];
+  int side = ctx->side;
+  uint32_t shift = 8 - ctx->bits;
+  size_t first = ctx->color_count * task / ctx->task_cnt;
+  size_t last = ctx->color_count * (task + 1) / ctx->task_cnt;
+  for (size_t i = first; i < last; i++) {
+    ColorStruct c = ctx->color_list[i];
+    uint64_t w = ctx->weights ? ctx->weights[i] : 1;
+    ColorMoment *cell = &hist[moment_index(side, (c.r >> shift) + 1,
+                                           (c.g >> shift) + 1,
+                                           (c.b >> shift) + 1)];
+    cell->w += w;
+    cell->r += w * c.r;
+    cell->g += w * c.g;
+    cell->b += w * c.b;
+    cell->m2 += w * ((uint32_t)c.r * c.r + (uint32_t)c.g * c.g +
+                     (uint32_t)c.b * c.b);
+  }
+}
+
+// merges the task histograms for one red plane and takes the 2d
+// cumulative sums over green and blue inside it
+static void moment_plane_task(void *arg, size_t plane, size_t thread) {
+  moment_build_ctx *ctx = arg;
+  int side = ctx->side;
+  int r = plane + 1;
+  ColorMoment *table = ctx->table;
+  for (int g = 1; g <= side; g++) {
+    for (int b = 1; b <= side; b++) {
+      size_t index = moment_index(side, r, g, b);
+      for (size_t t = 0; t < ctx->task_cnt; t++) {
+        if (ctx->partial[t] != table) {
+          moment_add(&table[index], &ctx->partial[t][index], 1);
+        }
+      }
+      moment_add(&table[index], &table[moment_index(side, r, g, b - 1)], 1);
+      moment_add(&table[index], &table[moment_index(side, r, g - 1, b)], 1);
+      moment_add(&table[index], &table[moment_index(side, r, g - 1, b - 1)],
+                 -1);
+    }
+  }
+}
+
+// finishes the cumulative sums along red for one green row
+static void moment_row_task(void *arg, size_t row, size_t thread) {
+  moment_build_ctx *ctx = arg;
+  int side = ctx->side;
+  int g = row + 1;
+  for (int r = 1; r <= side; r++) {
+    for (int b = 1; b <= side; b++) {
+      moment_add(&ctx->table[moment_index(side, r, g, b)],
+                 &ctx->table[moment_index(side, r - 1, g, b)], 1);
+    }
+  }
+}
+
+// fills a histogram of side^3 cells from the color list and turns it
+// into cumulative sums along all three axes. big lists are split over
+// per task histograms, then planes and rows are summed in parallel
+static ColorMoment *build_moment_table(const ColorStruct *color_list,
+                                       const uint32_t *weights,
+                                       size_t color_count, uint32_t bits) {
+  int side = 1 << bits;
+  size_t table_bytes =
+      (size_t)(side + 1) * (side + 1) * (side + 1) * sizeof(ColorMoment);
+  moment_build_ctx ctx = {.color_list = color_list,
+                          .weights = weights,
+                          .color_count = color_count,
+                          .bits = bits,
+                          .side = side};
+  ctx.table = calloc(1, table_bytes);
+  if (!ctx.table)
+    return NULL;
+
+  ctx.task_cnt = parallel_thread_count();
+  if (ctx.task_cnt > color_count / MOMENT_TASK_COLORS)
+    ctx.task_cnt = color_count / MOMENT_TASK_COLORS;
+  if (ctx.task_cnt > MOMENT_PARTIAL_BYTES / table_bytes)
+    ctx.task_cnt = MOMENT_PARTIAL_BYTES / table_bytes;
+  if (ctx.task_cnt < 1)
+    ctx.task_cnt = 1;
+  ColorMoment *partial[PARALLEL_MAX_THREADS] = {ctx.table};
+  ctx.partial = partial;
+  // the first task fills the table itself so one task merges nothing
+  for (size_t t = 1; t < ctx.task_cnt; t++) {
+    partial[t] = calloc(1, table_bytes);
+    if (!partial[t]) {
+      ctx.task_cnt = t;
+      break;
+    }
+  }
+
+  parallel_for(ctx.task_cnt, moment_fill_task, &ctx);
+  parallel_for(side, moment_plane_task, &ctx);
+  parallel_for(side, moment_row_task, &ctx);
+  for (size_t t = 1; t < ctx.task_cnt; t++) {
+    free(partial[t]);
+  }
+  return ctx.table;
+}
+
+static inline int *box_axis(ColorBox *box, Color_Wideness axis, bool upper) {
+  switch (axis) {
+  case GREEN_WIDEST:
+    return upper ? &box->g1 : &box->g0;
+  case BLUE_WIDEST:
+    return upper ? &box->b1 : &box->b0;
+  default:
+    return upper ? &box->r1 : &box->r0;
+  }
+}
+
+// pulls every face of the box in to the first slice holding pixels
+static void shrink_box(const ColorMoment *table, int side, ColorBox *box) {
+  for (Color_Wideness axis = RED_WIDEST; axis <= BLUE_WIDEST; axis++) {
+    int *lo = box_axis(box, axis, false);
+    int *hi = box_axis(box, axis, true);
+    for (;;) {
+      ColorBox slice = *box;
+      *box_axis(&slice, axis, true) = *lo + 1;
+      if (*hi - *lo <= 1 || box_moment(table, side, &slice).w)
+        break;
+      (*lo)++;
+    }
+    for (;;) {
+      ColorBox slice = *box;
+      *box_axis(&slice, axis, false) = *hi - 1;
+      if (*hi - *lo <= 1 || box_moment(table, side, &slice).w)
+        break;
+      (*hi)--;
+    }
+  }
+}
+
+static Color_Wideness widest_box_axis(const ColorBox *box, int *extent) {
+  int r_range = box->r1 - box->r0;
+  int g_range = box->g1 - box->g0;
+  int b_range = box->b1 - box->b0;
+  if (r_range >= g_range && r_range >= b_range) {
+    *extent = r_range;
+    return RED_WIDEST;
+  }
+  if (g_range >= b_range) {
+    *extent = g_range;
+    return GREEN_WIDEST;
+  }
+  *extent = b_range;
+  return BLUE_WIDEST;
+}
+
+// sum of squared distances from the colors in the box to their mean
+static double box_variance(const ColorMoment *table, int side,
+                           const ColorBox *box) {
+  ColorMoment m = box_moment(table, side, box);
+  if (!m.w)
     return 0;
+  double r = m.r, g = m.g, b = m.b;
+  return (double)m.m2 - (r * r + g * g + b * b) / m.w;
+}
 
-  // Initialize the first bucket with all colors
-  buckets[0].colors = (ColorStruct *)color_list;
-  buckets[0].count = color_count;
+// boxes one cell wide along every axis can't be split and stay out of
+// the heap
+static void histogram_queue_box(BucketHeap *heap, const ColorMoment *table,
+                                int side, const ColorBox *boxes,
+                                size_t index) {
+  int extent;
+  widest_box_axis(&boxes[index], &extent);
+  if (extent <= 1)
+    return;
+  heap->priority[index] =
+      bucket_split_priority == SPLIT_BY_VARIANCE
+          ? box_variance(table, side, &boxes[index])
+          : extent;
+  bucket_heap_push(heap, index);
+}
+
+static size_t histogram_palette(ColorStruct *palette, size_t palette_size,
+                                const ColorStruct *color_list,
+                                const uint32_t *weights, size_t color_count) {
+  int side = 1 << histogram_bits;
+  ColorMoment *table =
+      build_moment_table(color_list, weights, color_count, histogram_bits);
+  ColorBox *boxes = malloc(palette_size * sizeof(ColorBox));
+  double *priority = malloc(palette_size * sizeof(double));
+  BucketHeap heap = {malloc(palette_size * sizeof(size_t)), 0, priority};
+  if (!table || !boxes || !priority || !heap.items) {
+    free(table);
+    free(boxes);
+    free(priority);
+    free(heap.items);
+    return 0;
+  }
+  boxes[0] = (ColorBox){0, side, 0, side, 0, side};
+  shrink_box(table, side, &boxes[0]);
+  size_t box_count = 1;
+  histogram_queue_box(&heap, table, side, boxes, 0);
+
+  while (box_count < palette_size && heap.count) {
+    size_t next = bucket_heap_pop(&heap);
+    ColorBox *box = &boxes[next];
+    int extent;
+    Color_Wideness axis = widest_box_axis(box, &extent);
+    uint64_t box_weight = box_moment(table, side, box).w;
+    int lo = *box_axis(box, axis, false);
+    int hi = *box_axis(box, axis, true);
+    // last cut where the lower half holds no more than half the
+    // weight, each candidate is one box lookup. the box was shrunk so
+    // both end slices hold pixels and any cut in (lo, hi) works
+    int cut = lo + 1;
+    for (int c = lo + 1; c < hi; c++) {
+      ColorBox lower = *box;
+      *box_axis(&lower, axis, true) = c;
+      if (box_moment(table, side, &lower).w * 2 > box_weight)
+        break;
+      cut = c;
+    }
+
+    ColorBox upper = *box;
+    *box_axis(box, axis, true) = cut;
+    *box_axis(&upper, axis, false) = cut;
+    shrink_box(table, side, box);
+    shrink_box(table, side, &upper);
+    boxes[box_count] = upper;
+    histogram_queue_box(&heap, table, side, boxes, next);
+    histogram_queue_box(&heap, table, side, boxes, box_count++);
+  }
+
+  for (size_t i = 0; i < box_count; i++) {
+    ColorMoment m = box_moment(table, side, &boxes[i]);
+    uint64_t w = m.w ? m.w : 1;
+    palette[i] = (ColorStruct){m.r / w, m.g / w, m.b / w, 255};
+  }
+  free(table);
+  free(boxes);
+  free(priority);
+  free(heap.items);
+  return box_count;
+}
+
+static inline int box_cells(const ColorBox *box) {
+  return (box->r1 - box->r0) * (box->g1 - box->g0) * (box->b1 - box->b0);
+}
+
+// the cut along axis that leaves the two halves with the least
+// variance, which is the one maximizing |sum|^2 / w summed over both
+// halves. each candidate is one box lookup. returns 0 when no cut
+// leaves pixels on both sides
+static int wu_best_cut(const ColorMoment *table, int side, ColorBox box,
+                       Color_Wideness axis, const ColorMoment *whole,
+                       double *score) {
+  int lo = *box_axis(&box, axis, false);
+  int hi = *box_axis(&box, axis, true);
+  int cut = 0;
+  *score = 0;
+  for (int c = lo + 1; c < hi; c++) {
+    *box_axis(&box, axis, true) = c;
+    ColorMoment lower = box_moment(table, side, &box);
+    if (!lower.w)
+      continue;
+    ColorMoment upper = *whole;
+    moment_add(&upper, &lower, -1);
+    // the lower half only grows from here
+    if (!upper.w)
+      break;
+    double lr = lower.r, lg = lower.g, lb = lower.b;
+    double ur = upper.r, ug = upper.g, ub = upper.b;
+    double candidate = (lr * lr + lg * lg + lb * lb) / lower.w +
+                       (ur * ur + ug * ug + ub * ub) / upper.w;
+    if (candidate > *score) {
+      *score = candidate;
+      cut = c;
+    }
+  }
+  return cut;
+}
+
+static size_t wu_palette(ColorStruct *palette, size_t palette_size,
+                         const ColorStruct *color_list, const uint32_t *weights,
+                         size_t color_count) {
+  int side = 1 << histogram_bits;
+  ColorMoment *table =
+      build_moment_table(color_list, weights, color_count, histogram_bits);
+  ColorBox *boxes = malloc(palette_size * sizeof(ColorBox));
+  double *variance = malloc(palette_size * sizeof(double));
+  BucketHeap heap = {malloc(palette_size * sizeof(size_t)), 0, variance};
+  if (!table || !boxes || !variance || !heap.items) {
+    free(table);
+    free(boxes);
+    free(variance);
+    free(heap.items);
+    return 0;
+  }
+  boxes[0] = (ColorBox){0, side, 0, side, 0, side};
+  variance[0] = box_variance(table, side, &boxes[0]);
+  if (variance[0] > 0)
+    bucket_heap_push(&heap, 0);
+  size_t box_count = 1;
+
+  // always split the box whose colors are spread the most
+  while (box_count < palette_size && heap.count) {
+    size_t next = bucket_heap_pop(&heap);
+    ColorBox *box = &boxes[next];
+    ColorMoment whole = box_moment(table, side, box);
+    Color_Wideness best_axis = RED_WIDEST;
+    int best_cut = 0;
+    double best_score = 0;
+    for (Color_Wideness axis = RED_WIDEST; axis <= BLUE_WIDEST; axis++) {
+      double score;
+      int cut = wu_best_cut(table, side, *box, axis, &whole, &score);
+      if (cut && score > best_score) {
+        best_score = score;
+        best_cut = cut;
+        best_axis = axis;
+      }
+    }
+    if (!best_cut) {
+      // all of its pixels sit in one cell, it leaves the heap for good
+      continue;
+    }
+
+    ColorBox upper = *box;
+    *box_axis(box, best_axis, true) = best_cut;
+    *box_axis(&upper, best_axis, false) = best_cut;
+    boxes[box_count] = upper;
+    variance[next] =
+        box_cells(box) > 1 ? box_variance(table, side, box) : 0;
+    variance[box_count] =
+        box_cells(&upper) > 1 ? box_variance(table, side, &upper) : 0;
+    if (variance[next] > 0)
+      bucket_heap_push(&heap, next);
+    if (variance[box_count] > 0)
+      bucket_heap_push(&heap, box_count);
+    box_count++;
+  }
+
+  for (size_t i = 0; i < box_count; i++) {
+    ColorMoment m = box_moment(table, side, &boxes[i]);
+    uint64_t w = m.w ? m.w : 1;
+    palette[i] = (ColorStruct){m.r / w, m.g / w, m.b / w, 255};
+  }
+  free(table);
+  free(boxes);
+  free(variance);
+  free(heap.items);
+  return box_count;
+}
+
+// list links, children use 0 for none since the root is never a child
+#define OCTREE_NONE UINT32_MAX
+
+typedef struct {
+  uint64_t w, r, g, b;   // pixels and channel sums below this node
+  uint32_t children[8];  // pool indices
+  uint32_t next;         // next node in its level's reducible list
+  uint8_t level;
+  uint8_t child_cnt;
+  bool leaf;
+} OctreeNode;
+
+struct OctreeQuantizer {
+  OctreeNode *nodes; // pool, node 0 is the root
+  uint32_t node_cap;
+  uint32_t node_cnt;  // pool entries handed out so far
+  uint32_t free_list; // merged nodes to reuse, linked through next
+  uint32_t depth;
+  size_t max_leaves;
+  size_t leaf_cnt;
+  // nodes with children on each level, the deepest level is merged first
+  uint32_t reducible[OCTREE_MAX_DEPTH];
+};
+
+static uint32_t octree_depth = OCTREE_MAX_DEPTH;
+
+void set_octree_depth(uint32_t depth) {
+  if (depth < 1)
+    depth = 1;
+  if (depth > OCTREE_MAX_DEPTH)
+    depth = OCTREE_MAX_DEPTH;
+  octree_depth = depth;
+}
+
+static uint32_t octree_alloc(OctreeQuantizer *tree, uint8_t level) {
+  uint32_t index;
+  if (tree->free_list != OCTREE_NONE) {
+    index = tree->free_list;
+    tree->free_list = tree->nodes[index].next;
+  } else {
+    index = tree->node_cnt++;
+  }
+  OctreeNode *node = &tree->nodes[index];
+  *node = (OctreeNode){.next = OCTREE_NONE, .level = level};
+  if (level == tree->depth) {
+    node->leaf = true;
+    tree->leaf_cnt++;
+  } else {
+    // it is about to get a child
+    node->next = tree->reducible[level];
+    tree->reducible[level] = index;
+  }
+  return index;
+}
+
+OctreeQuantizer *octree_create(uint32_t depth, size_t max_leaves) {
+  if (depth < 1)
+    depth = 1;
+  if (depth > OCTREE_MAX_DEPTH)
+    depth = OCTREE_MAX_DEPTH;
+  if (max_leaves < 1)
+    max_leaves = 1;
+  OctreeQuantizer *tree = calloc(1, sizeof(OctreeQuantizer));
+  if (!tree)
+    return NULL;
+  // a color adds at most one leaf before the tree is merged back under
+  // budget, and each leaf keeps at most depth nodes alive above it
+  tree->node_cap = (max_leaves + 1) * depth + 1;
+  tree->nodes = malloc(tree->node_cap * sizeof(OctreeNode));
+  if (!tree->nodes) {
+    free(tree);
+    return NULL;
+  }
+  tree->depth = depth;
+  tree->max_leaves = max_leaves;
+  tree->free_list = OCTREE_NONE;
+  for (uint32_t i = 0; i < OCTREE_MAX_DEPTH; i++) {
+    tree->reducible[i] = OCTREE_NONE;
+  }
+  octree_alloc(tree, 0);
+  return tree;
+}
+
+void octree_destroy(OctreeQuantizer *tree) {
+  if (!tree)
+    return;
+  free(tree->nodes);
+  free(tree);
+}
+
+// folds the children of the lightest node on the deepest level with
+// children into it. children there are all leaves since nothing
+// deeper has children
+static void octree_reduce(OctreeQuantizer *tree) {
+  int level = tree->depth - 1;
+  while (level > 0 && tree->reducible[level] == OCTREE_NONE)
+    level--;
+  uint32_t *link = &tree->reducible[level];
+  uint32_t *lightest = link;
+  for (; *link != OCTREE_NONE; link = &tree->nodes[*link].next) {
+    if (tree->nodes[*link].w < tree->nodes[*lightest].w)
+      lightest = link;
+  }
+  uint32_t index = *lightest;
+  OctreeNode *node = &tree->nodes[index];
+  *lightest = node->next;
+  for (int i = 0; i < 8; i++) {
+    uint32_t child = node->children[i];
+    if (!child)
+      continue;
+    tree->nodes[child].next = tree->free_list;
+    tree->free_list = child;
+    node->children[i] = 0;
+  }
+  // the node already counts every pixel below it
+  tree->leaf_cnt -= node->child_cnt - 1;
+  node->child_cnt = 0;
+  node->leaf = true;
+  node->next = OCTREE_NONE;
+}
+
+void octree_add_color(OctreeQuantizer *tree, ColorStruct color,
+                      uint32_t weight) {
+  uint32_t index = 0;
+  for (;;) {
+    OctreeNode *node = &tree->nodes[index];
+    node->w += weight;
+    node->r += (uint64_t)color.r * weight;
+    node->g += (uint64_t)color.g * weight;
+    node->b += (uint64_t)color.b * weight;
+    if (node->leaf)
+      break;
+    uint32_t bit = 7 - node->level;
+    int octant = (((color.r >> bit) & 1) << 2) | (((color.g >> bit) & 1) << 1) |
+                 ((color.b >> bit) & 1);
+    if (!node->children[octant]) {
+      uint32_t child = octree_alloc(tree, node->level + 1);
+      node->children[octant] = child;
+      node->child_cnt++;
+    }
+    index = node->children[octant];
+  }
+  while (tree->leaf_cnt > tree->max_leaves)
+    octree_reduce(tree);
+}
+
+void octree_reduce_to(OctreeQuantizer *tree, size_t max_leaves) {
+  if (max_leaves < 1)
+    max_leaves = 1;
+  if (max_leaves < tree->max_leaves)
+    tree->max_leaves = max_leaves;
+  while (tree->leaf_cnt > tree->max_leaves)
+    octree_reduce(tree);
+}
+
+size_t octree_palette(const OctreeQuantizer *tree, ColorStruct *palette) {
+  // depth first walk with an explicit stack, at most 7 pending siblings
+  // per level
+  uint32_t stack[OCTREE_MAX_DEPTH * 8 + 1];
+  size_t stack_cnt = 0;
+  size_t palette_len = 0;
+  stack[stack_cnt++] = 0;
+  while (stack_cnt) {
+    const OctreeNode *node = &tree->nodes[stack[--stack_cnt]];
+    if (node->leaf) {
+      if (node->w) {
+        palette[palette_len++] = (ColorStruct){
+            node->r / node->w, node->g / node->w, node->b / node->w, 255};
+      }
+      continue;
+    }
+    for (int i = 7; i >= 0; i--) {
+      if (node->children[i])
+        stack[stack_cnt++] = node->children[i];
+    }
+  }
+  return palette_len;
+}
+
+static size_t octree_backend_palette(ColorStruct *palette,
+                                     size_t palette_size,
+                                     const ColorStruct *color_list,
+                                     const uint32_t *weights,
+                                     size_t color_count) {
+  OctreeQuantizer *tree =
+      octree_create(octree_depth, palette_size * OCTREE_LEAF_HEADROOM);
+  if (!tree)
+    return 0;
+  for (size_t i = 0; i < color_count; i++) {
+    octree_add_color(tree, color_list[i], weights ? weights[i] : 1);
+  }
+  octree_reduce_to(tree, palette_size);
+  size_t palette_len = octree_palette(tree, palette);
+  octree_destroy(tree);
+  return palette_len;
+}
+
+// colors per assignment task, and the widest vector the colors are
+// padded for
+#define KMEANS_TASK_COLORS 16384
+#define KMEANS_PAD 8
+// palette colors moving less than this stop the refinement
+#define KMEANS_TOLERANCE 0.5f
+
+static uint32_t kmeans_iterations = 0;
+static kmeans_report last_kmeans_report;
+
+void set_kmeans_iterations(uint32_t max_iterations) {
+  kmeans_iterations = max_iterations;
+}
+
+kmeans_report get_last_kmeans_report(void) { return last_kmeans_report; }
+
+typedef struct {
+  // colors as separate channels padded to whole vectors, the padding
+  // has weight 0
+  float *r, *g, *b;
+  uint32_t *w;
+  size_t count;
+  const float *cr, *cg, *cb;
+  size_t k;
+  // per thread weight and channel sums for every palette color, kept
+  // as integers so the result doesn't depend on the thread count
+  uint64_t (*acc)[4];
+} kmeans_ctx;
+
+// assigns colors [first, last) to their closest palette color and adds
+// them to acc. written once with gcc vector types and stamped out per
+// vector width, each lane is one color and the palette colors are
+// broadcast one at a time. ties go to the lower index like a scalar
+// scan, and every width does the same float ops per color so they all
+// pick the same palette colors
+#define KMEANS_ASSIGN_KERNEL(name, lanes, attributes)                          \
+  attributes static void name(const kmeans_ctx *ctx, size_t first,            \
+                              size_t last, uint64_t(*acc)[4]) {               \
+    typedef float vec __attribute__((vector_size(lanes * 4)));                \
+    typedef int32_t mask __attribute__((vector_size(lanes * 4)));             \
+    for (size_t i = first; i < last; i += lanes) {                            \
+      vec r, g, b;                                                            \
+      memcpy(&r, &ctx->r[i], sizeof(r));                                      \
+      memcpy(&g, &ctx->g[i], sizeof(g));                                      \
+      memcpy(&b, &ctx->b[i], sizeof(b));                                      \
+      vec best = (vec){0} + INFINITY;                                         \
+      mask best_idx = {0};                                                    \
+      for (size_t c = 0; c < ctx->k; c++) {                                   \
+        vec dr = r - ctx->cr[c];                                              \
+        vec dg = g - ctx->cg[c];                                              \
+        vec db = b - ctx->cb[c];                                              \
+        vec d = dr * dr + dg * dg + db * db;                                  \
+        mask closer = d < best;                                               \
+        best = (vec)(((mask)d & closer) | ((mask)best & ~closer));            \
+        best_idx = (((mask){0} + (int32_t)c) & closer) | (best_idx & ~closer); \
+      }                                                                       \
+      for (int lane = 0; lane < lanes; lane++) {                              \
+        uint64_t w = ctx->w[i + lane];                                        \
+        uint64_t *sum = acc[best_idx[lane]];                                  \
+        sum[0] += w;                                                          \
+        sum[1] += w * (uint32_t)r[lane];                                      \
+        sum[2] += w * (uint32_t)g[lane];                                      \
+        sum[3] += w * (uint32_t)b[lane];                                      \
+      }                                                                       \
+    }                                                                         \
+  }
 
-  // Find min and max values for the first bucket
+// 4 lanes is one sse or wasm simd128 register
+KMEANS_ASSIGN_KERNEL(kmeans_assign_128, 4, )
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KMEANS_HAVE_AVX2 1
+KMEANS_ASSIGN_KERNEL(kmeans_assign_avx2, 8, __attribute__((target("avx2"))))
+#endif
+
+static void kmeans_assign_task(void *arg, size_t task, size_t thread) {
+  kmeans_ctx *ctx = arg;
+  size_t first = task * KMEANS_TASK_COLORS;
+  size_t last = first + KMEANS_TASK_COLORS;
+  if (last > ctx->count)
+    last = ctx->count;
+  uint64_t(*acc)[4] = ctx->acc + thread * ctx->k;
+#ifdef KMEANS_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    kmeans_assign_avx2(ctx, first, last, acc);
+    return;
+  }
+#endif
+  kmeans_assign_128(ctx, first, last, acc);
+}
+
+kmeans_report refine_palette_kmeans(ColorStruct *palette, size_t palette_len,
+                                    const ColorStruct *color_list,
+                                    const uint32_t *weights,
+                                    size_t color_count,
+                                    uint32_t max_iterations, float tolerance) {
+  kmeans_report report = {0};
+  double start = timer_now_ms();
+  if (palette_len == 0 || color_count == 0 || max_iterations == 0)
+    return report;
+
+  size_t padded = (color_count + KMEANS_PAD - 1) / KMEANS_PAD * KMEANS_PAD;
+  size_t threads = parallel_thread_count();
+  kmeans_ctx ctx = {.count = padded, .k = palette_len};
+  ctx.r = malloc(padded * sizeof(float));
+  ctx.g = malloc(padded * sizeof(float));
+  ctx.b = malloc(padded * sizeof(float));
+  ctx.w = malloc(padded * sizeof(uint32_t));
+  float *centroids = malloc(3 * palette_len * sizeof(float));
+  ctx.acc = malloc(threads * palette_len * sizeof(*ctx.acc));
+  if (!ctx.r || !ctx.g || !ctx.b || !ctx.w || !centroids || !ctx.acc) {
+    free(ctx.r);
+    free(ctx.g);
+    free(ctx.b);
+    free(ctx.w);
+    free(centroids);
+    free(ctx.acc);
+    return report;
+  }
+  for (size_t i = 0; i < padded; i++) {
+    ColorStruct c = i < color_count ? color_list[i] : (ColorStruct){0};
+    ctx.r[i] = c.r;
+    ctx.g[i] = c.g;
+    ctx.b[i] = c.b;
+    ctx.w[i] = i < color_count ? (weights ? weights[i] : 1) : 0;
+  }
+  float *cr = centroids;
+  float *cg = centroids + palette_len;
+  float *cb = centroids + 2 * palette_len;
+  for (size_t c = 0; c < palette_len; c++) {
+    cr[c] = palette[c].r;
+    cg[c] = palette[c].g;
+    cb[c] = palette[c].b;
+  }
+  ctx.cr = cr;
+  ctx.cg = cg;
+  ctx.cb = cb;
+
+  while (report.iterations < max_iterations) {
+    memset(ctx.acc, 0, threads * palette_len * sizeof(*ctx.acc));
+    parallel_for((padded + KMEANS_TASK_COLORS - 1) / KMEANS_TASK_COLORS,
+                 kmeans_assign_task, &ctx);
+    report.iterations++;
+    report.last_shift = 0;
+    for (size_t c = 0; c < palette_len; c++) {
+      uint64_t sum[4] = {0};
+      for (size_t t = 0; t < threads; t++) {
+        for (int j = 0; j < 4; j++)
+          sum[j] += ctx.acc[t * palette_len + c][j];
+      }
+      // a palette color nothing is closest to stays where it is
+      if (!sum[0])
+        continue;
+      float r = (float)sum[1] / sum[0];
+      float g = (float)sum[2] / sum[0];
+      float b = (float)sum[3] / sum[0];
+      float shift = sqrtf((r - cr[c]) * (r - cr[c]) + (g - cg[c]) * (g - cg[c]) +
+                          (b - cb[c]) * (b - cb[c]));
+      if (shift > report.last_shift)
+        report.last_shift = shift;
+      cr[c] = r;
+      cg[c] = g;
+      cb[c] = b;
+    }
+    if (report.last_shift < tolerance)
+      break;
+  }
+
+  for (size_t c = 0; c < palette_len; c++) {
+    palette[c] = (ColorStruct){lroundf(cr[c]), lroundf(cg[c]), lroundf(cb[c]),
+                               255};
+  }
+  free(ctx.r);
+  free(ctx.g);
+  free(ctx.b);
+  free(ctx.w);
+  free(centroids);
+  free(ctx.acc);
+  report.elapsed_ms = timer_now_ms() - start;
+  return report;
+}
+
+typedef struct {
+  WeightedColor *colors;
+  size_t count;
+  uint64_t weight;
+  Color_Wideness widest_component;
+  uint8_t range; // extent of the widest component
+  uint8_t min_r, min_g, min_b;
+  uint8_t max_r, max_g, max_b;
+} ColorBucket;
+
+// bounds, widest component and weight of the bucket's colors, and its
+// split priority. returns false when the bucket is too narrow to split
+static bool measure_bucket(ColorBucket *bucket, double *priority) {
   uint8_t min_r = 255, min_g = 255, min_b = 255;
   uint8_t max_r = 0, max_g = 0, max_b = 0;
+  uint64_t weight = 0;
+  double sum_r = 0, sum_g = 0, sum_b = 0, sum_sq = 0;
+  bool variance = bucket_split_priority == SPLIT_BY_VARIANCE;
 
-  for (size_t i = 0; i < color_count; i++) {
-    if (color_list[i].r < min_r)
-      min_r = color_list[i].r;
-    if (color_list[i].g < min_g)
-      min_g = color_list[i].g;
-    if (color_list[i].b < min_b)
-      min_b = color_list[i].b;
-
-    if (color_list[i].r > max_r)
-      max_r = color_list[i].r;
-    if (color_list[i].g > max_g)
-      max_g = color_list[i].g;
-    if (color_list[i].b > max_b)
-      max_b = color_list[i].b;
-  }
-
-  buckets[0].min_r = min_r;
-  buckets[0].min_g = min_g;
-  buckets[0].min_b = min_b;
-  buckets[0].max_r = max_r;
-  buckets[0].max_g = max_g;
-  buckets[0].max_b = max_b;
+  for (size_t i = 0; i < bucket->count; i++) {
+    ColorStruct *c = &bucket->colors[i].color;
+    uint32_t w = bucket->colors[i].weight;
+
+    if (c->r < min_r)
+      min_r = c->r;
+    if (c->g < min_g)
+      min_g = c->g;
+    if (c->b < min_b)
+      min_b = c->b;
+
+    if (c->r > max_r)
+      max_r = c->r;
+    if (c->g > max_g)
+      max_g = c->g;
+    if (c->b > max_b)
+      max_b = c->b;
+
+    weight += w;
+    if (variance) {
+      sum_r += (double)c->r * w;
+      sum_g += (double)c->g * w;
+      sum_b += (double)c->b * w;
+      sum_sq += (double)(c->r * c->r + c->g * c->g + c->b * c->b) * w;
+    }
+  }
+
+  bucket->min_r = min_r;
+  bucket->min_g = min_g;
+  bucket->min_b = min_b;
+  bucket->max_r = max_r;
+  bucket->max_g = max_g;
+  bucket->max_b = max_b;
+  bucket->weight = weight;
 
   // Determine the widest color component
   uint8_t r_range = max_r - min_r;
@@ -167,71 +1461,113 @@ size_t gen_median_palette_from_color_list(ColorStruct *palette,
   uint8_t b_range = max_b - min_b;
 
   if (r_range >= g_range && r_range >= b_range) {
-    buckets[0].widest_component = RED_WIDEST;
+    bucket->widest_component = RED_WIDEST;
+    bucket->range = r_range;
   } else if (g_range >= r_range && g_range >= b_range) {
-    buckets[0].widest_component = GREEN_WIDEST;
+    bucket->widest_component = GREEN_WIDEST;
+    bucket->range = g_range;
   } else {
-    buckets[0].widest_component = BLUE_WIDEST;
+    bucket->widest_component = BLUE_WIDEST;
+    bucket->range = b_range;
   }
 
+  *priority = variance && weight ? sum_sq - (sum_r * sum_r + sum_g * sum_g +
+                                             sum_b * sum_b) /
+                                                weight
+                                 : bucket->range;
+  return bucket->range > 1;
+}
+
+static size_t median_cut_palette(ColorStruct *palette, size_t palette_size,
+                                 const ColorStruct *color_list,
+                                 const uint32_t *weights, size_t color_count) {
+  if (color_count == 0 || palette_size == 0)
+    return 0;
+
+  // Initial bucket containing all colors
+  ColorBucket *buckets = malloc(palette_size * sizeof(ColorBucket));
+  double *priority = malloc(palette_size * sizeof(double));
+  BucketHeap heap = {malloc(palette_size * sizeof(size_t)), 0, priority};
+  // work on a copy so the weights can be sorted along with the colors
+  WeightedColor *weighted = malloc(color_count * sizeof(WeightedColor));
+  if (!buckets || !priority || !heap.items || !weighted) {
+    free(buckets);
+    free(priority);
+    free(heap.items);
+    free(weighted);
+    return 0;
+  }
+  for (size_t i = 0; i < color_count; i++) {
+    weighted[i].color = color_list[i];
+    weighted[i].weight = weights ? weights[i] : 1;
+  }
+
+  // Initialize the first bucket with all colors
+  buckets[0].colors = weighted;
+  buckets[0].count = color_count;
+  if (measure_bucket(&buckets[0], &priority[0]))
+    bucket_heap_push(&heap, 0);
+
   // Number of active buckets
   size_t bucket_count = 1;
 
   // Split buckets until we have the desired palette size or can't split
-  // anymore
-  while (bucket_count < palette_size) {
-    // Find the bucket with the largest range
-    size_t largest_bucket_idx = 0;
-    uint8_t largest_range = 0;
-
-    for (size_t i = 0; i < bucket_count; i++) {
-      uint8_t range = 0;
+  // anymore. the heap hands out the bucket with the largest priority
+  // in log time, so large palettes don't rescan every bucket per split
+  while (bucket_count < palette_size && heap.count) {
+    size_t bucket_idx = bucket_heap_pop(&heap);
+    ColorBucket *bucket = &buckets[bucket_idx];
+    uint64_t bucket_weight = bucket->weight;
 
-      switch (buckets[i].widest_component) {
+    // Split the bucket at the weighted median, the last index where
+    // the first half holds no more than half of the weight. with equal
+    // weights this is count / 2
+    size_t median = 0;
+    if (median_cut_split == MEDIAN_SPLIT_SORT) {
+      // Sort the colors in the selected bucket based on the widest
+      // component
+      switch (bucket->widest_component) {
       case RED_WIDEST:
-        range = buckets[i].max_r - buckets[i].min_r;
+        qsort(bucket->colors, bucket->count, sizeof(WeightedColor), red_order);
         break;
       case GREEN_WIDEST:
-        range = buckets[i].max_g - buckets[i].min_g;
+        qsort(bucket->colors, bucket->count, sizeof(WeightedColor),
+              green_order);
         break;
       case BLUE_WIDEST:
-        range = buckets[i].max_b - buckets[i].min_b;
+        qsort(bucket->colors, bucket->count, sizeof(WeightedColor),
+              blue_order);
         break;
       case NONE_WIDEST:
-        range = 0;
-        break;
+        break; // Should not happen
       }
-
-      if (range > largest_range) {
-        largest_range = range;
-        largest_bucket_idx = i;
+      uint64_t prefix_weight = 0;
+      while (median < bucket->count &&
+             (prefix_weight + bucket->colors[median].weight) * 2 <=
+                 bucket_weight) {
+        prefix_weight += bucket->colors[median].weight;
+        median++;
       }
+      // both halves need at least one color
+      if (median == 0)
+        median = 1;
+      if (median == bucket->count)
+        median = bucket->count - 1;
+    } else {
+      // only which colors land below the median matters, not their
+      // order, so selecting them is enough
+      median = select_split(bucket->colors, bucket->count,
+                            bucket->widest_component, bucket_weight, true);
+      // both halves need at least one color
+      if (median == 0)
+        median = select_split(bucket->colors, bucket->count,
+                              bucket->widest_component, 1, false);
+      if (median == bucket->count)
+        median = select_split(bucket->colors, bucket->count,
+                              bucket->widest_component, bucket->count - 1,
+                              false);
     }
 
-    // If no bucket can be split further, exit
-    if (largest_range <= 1) {
-      break;
-    }
-
-    // Sort the colors in the selected bucket based on the widest component
-    ColorBucket *bucket = &buckets[largest_bucket_idx];
-    switch (bucket->widest_component) {
-    case RED_WIDEST:
-      qsort(bucket->colors, bucket->count, sizeof(ColorStruct), red_greater);
-      break;
-    case GREEN_WIDEST:
-      qsort(bucket->colors, bucket->count, sizeof(ColorStruct), green_greater);
-      break;
-    case BLUE_WIDEST:
-      qsort(bucket->colors, bucket->count, sizeof(ColorStruct), blue_greater);
-      break;
-    case NONE_WIDEST:
-      break; // Should not happen
-    }
-
-    // Split the bucket at the median
-    size_t median = bucket->count / 2;
-
     // Create a new bucket for the second half
     buckets[bucket_count].colors = bucket->colors + median;
     buckets[bucket_count].count = bucket->count - median;
@@ -240,66 +1576,110 @@ size_t gen_median_palette_from_color_list(ColorStruct *palette,
     bucket->count = median;
 
     // Recalculate min/max values and widest component for both buckets
-    for (size_t b = 0; b < 2; b++) {
-      ColorBucket *current = (b == 0) ? bucket : &buckets[bucket_count];
-
-      min_r = min_g = min_b = 255;
-      max_r = max_g = max_b = 0;
-
-      for (size_t i = 0; i < current->count; i++) {
-        ColorStruct *c = &current->colors[i];
-
-        if (c->r < min_r)
-          min_r = c->r;
-        if (c->g < min_g)
-          min_g = c->g;
-        if (c->b < min_b)
-          min_b = c->b;
-
-        if (c->r > max_r)
-          max_r = c->r;
-        if (c->g > max_g)
-          max_g = c->g;
-        if (c->b > max_b)
-          max_b = c->b;
-      }
-
-      current->min_r = min_r;
-      current->min_g = min_g;
-      current->min_b = min_b;
-      current->max_r = max_r;
-      current->max_g = max_g;
-      current->max_b = max_b;
-
-      r_range = max_r - min_r;
-      g_range = max_g - min_g;
-      b_range = max_b - min_b;
-
-      if (r_range >= g_range && r_range >= b_range) {
-        current->widest_component = RED_WIDEST;
-      } else if (g_range >= r_range && g_range >= b_range) {
-        current->widest_component = GREEN_WIDEST;
-      } else {
-        current->widest_component = BLUE_WIDEST;
-      }
-    }
+    if (measure_bucket(bucket, &priority[bucket_idx]))
+      bucket_heap_push(&heap, bucket_idx);
+    if (measure_bucket(&buckets[bucket_count], &priority[bucket_count]))
+      bucket_heap_push(&heap, bucket_count);
 
     bucket_count++;
   }
 
-  // Generate the palette colors by averaging each bucket
-  for (size_t i = 0; i < bucket_count; i++) {
-    ColorStruct avg = fetch_average_color(buckets[i].colors, buckets[i].count);
-    avg.a = 255; // Make opaque
-    palette[i] = avg;
+  // Generate the palette colors by averaging each bucket
+  for (size_t i = 0; i < bucket_count; i++) {
+    ColorStruct avg =
+        fetch_weighted_average_color(buckets[i].colors, buckets[i].count);
+    avg.a = 255; // Make opaque
+    palette[i] = avg;
+  }
+
+  free(weighted);
+  free(buckets);
+  free(priority);
+  free(heap.items);
+  return bucket_count;
+}
+
+size_t gen_weighted_median_palette(ColorStruct *palette, size_t palette_size,
+                                   const ColorStruct *color_list,
+                                   const uint32_t *weights,
+                                   size_t color_count) {
+  if (color_count == 0 || palette_size == 0)
+    return 0;
+
+  // the backends only see encoded colors, the palette is decoded back
+  // to srgb once they are done
+  ColorStruct *encoded = NULL;
+  if (palette_space != COLOR_SPACE_SRGB) {
+    encoded = malloc(color_count * sizeof(ColorStruct));
+    if (!encoded)
+      return 0;
+    encode_colors(color_list, color_count, palette_space, encoded);
+    color_list = encoded;
+  }
+
+  size_t palette_len;
+  switch (palette_generator) {
+  case PALETTE_HISTOGRAM:
+    palette_len = histogram_palette(palette, palette_size, color_list,
+                                    weights, color_count);
+    break;
+  case PALETTE_WU:
+    palette_len = wu_palette(palette, palette_size, color_list, weights,
+                             color_count);
+    break;
+  case PALETTE_OCTREE:
+    palette_len = octree_backend_palette(palette, palette_size, color_list,
+                                         weights, color_count);
+    break;
+  default:
+    palette_len = median_cut_palette(palette, palette_size, color_list,
+                                     weights, color_count);
+    break;
+  }
+
+  last_kmeans_report = (kmeans_report){0};
+  if (kmeans_iterations) {
+    last_kmeans_report =
+        refine_palette_kmeans(palette, palette_len, color_list, weights,
+                              color_count, kmeans_iterations, KMEANS_TOLERANCE);
+  }
 
-    printf("Palette color %zu is (%d,%d,%d)\n", i, avg.r, avg.g, avg.b);
+  if (encoded) {
+    for (size_t i = 0; i < palette_len; i++) {
+      palette[i] = decode_color(palette[i], palette_space);
+    }
+    free(encoded);
   }
 
-  sort_palette_by_luminance(palette, bucket_count);
+  sort_palette_by_luminance(palette, palette_len);
+  return palette_len;
+}
 
-  free(buckets);
-  return bucket_count;
+kmeans_report refine_palette_in_space(ColorStruct *palette, size_t palette_len,
+                                      const ColorStruct *color_list,
+                                      const uint32_t *weights,
+                                      size_t color_count,
+                                      uint32_t max_iterations,
+                                      float tolerance) {
+  if (palette_space == COLOR_SPACE_SRGB || palette_len == 0) {
+    return refine_palette_kmeans(palette, palette_len, color_list, weights,
+                                 color_count, max_iterations, tolerance);
+  }
+  ColorStruct *encoded = malloc((color_count + palette_len) *
+                                sizeof(ColorStruct));
+  if (!encoded) {
+    return (kmeans_report){0};
+  }
+  encode_colors(color_list, color_count, palette_space, encoded);
+  encode_colors(palette, palette_len, palette_space, encoded + color_count);
+  kmeans_report report = refine_palette_kmeans(
+      encoded + color_count, palette_len, encoded, weights, color_count,
+      max_iterations, tolerance);
+  for (size_t i = 0; i < palette_len; i++) {
+    palette[i] = decode_color(encoded[color_count + i], palette_space);
+  }
+  free(encoded);
+  return report;
 }
 
 static ColorName colors[] = {
@@ -1256,20 +2636,1082 @@ static ColorName colors[] = {
 
 static const int color_count = 949;
 
-const char *find_closest_color(unsigned char r, unsigned char g,
-                               unsigned char b) {
+#define NAME_CELL_WIDTH (256 / NAME_GRID_SIDE)
+
+typedef struct {
+  const ColorDictionaryEntry *entries;
+  size_t count;
+  // squared distance along one channel from every name to the nearest
+  // and farthest level of each slab of cells, a cell's bounds are the
+  // sum of its three slabs. laid out [channel][slab][name] so the sums
+  // run over contiguous rows
+  uint32_t *near, *far;
+  uint32_t *cell_cnt;
+  uint32_t *threshold; // per cell, the smallest farthest distance
+  uint32_t *cell_start;
+  uint16_t *candidates;
+  bool fill;
+} name_index_ctx;
+
+#define NAME_SLAB(ctx, table, channel, slab)                                   \
+  ((ctx)->table + ((size_t)(channel) * NAME_GRID_SIDE + (slab)) * (ctx)->count)
+
+// a name can only be nearest to some color in the cell when its
+// closest point in the cell is no farther than the farthest point of
+// whichever name is nearest overall. the first pass counts those names
+// per cell, the second writes them once the offsets are known
+static void name_index_task(void *arg, size_t task, size_t thread) {
+  name_index_ctx *ctx = arg;
+  const uint32_t *r_near = NAME_SLAB(ctx, near, 0, task);
+  const uint32_t *r_far = NAME_SLAB(ctx, far, 0, task);
+  for (int g_cell = 0; g_cell < NAME_GRID_SIDE; g_cell++) {
+    const uint32_t *g_near = NAME_SLAB(ctx, near, 1, g_cell);
+    const uint32_t *g_far = NAME_SLAB(ctx, far, 1, g_cell);
+    for (int b_cell = 0; b_cell < NAME_GRID_SIDE; b_cell++) {
+      const uint32_t *b_near = NAME_SLAB(ctx, near, 2, b_cell);
+      const uint32_t *b_far = NAME_SLAB(ctx, far, 2, b_cell);
+      size_t cell = (task * NAME_GRID_SIDE + g_cell) * NAME_GRID_SIDE + b_cell;
+      if (ctx->fill) {
+        uint32_t threshold = ctx->threshold[cell];
+        uint16_t *out = ctx->candidates + ctx->cell_start[cell];
+        for (size_t i = 0; i < ctx->count; i++) {
+          if (r_near[i] + g_near[i] + b_near[i] <= threshold) {
+            *out++ = i;
+          }
+        }
+        continue;
+      }
+      uint32_t threshold = UINT32_MAX;
+      for (size_t i = 0; i < ctx->count; i++) {
+        uint32_t far = r_far[i] + g_far[i] + b_far[i];
+        threshold = far < threshold ? far : threshold;
+      }
+      uint32_t cnt = 0;
+      for (size_t i = 0; i < ctx->count; i++) {
+        cnt += r_near[i] + g_near[i] + b_near[i] <= threshold;
+      }
+      ctx->threshold[cell] = threshold;
+      ctx->cell_cnt[cell] = cnt;
+    }
+  }
+}
+
+// runs both passes, the candidates are allocated once the first pass
+// has counted them. false if they couldn't be
+static bool fill_color_name_index(name_index_ctx *ctx) {
+  for (int channel = 0; channel < 3; channel++) {
+    for (int slab = 0; slab < NAME_GRID_SIDE; slab++) {
+      int lo = slab * NAME_CELL_WIDTH, hi = lo + NAME_CELL_WIDTH - 1;
+      uint32_t *near = NAME_SLAB(ctx, near, channel, slab);
+      uint32_t *far = NAME_SLAB(ctx, far, channel, slab);
+      for (size_t i = 0; i < ctx->count; i++) {
+        int c = (&ctx->entries[i].r)[channel];
+        int d = c < lo ? lo - c : c > hi ? c - hi : 0;
+        near[i] = d * d;
+        d = c - lo > hi - c ? c - lo : hi - c;
+        far[i] = d * d;
+      }
+    }
+  }
+  parallel_for(NAME_GRID_SIDE, name_index_task, ctx);
+  ctx->cell_start[0] = 0;
+  for (size_t cell = 0; cell < NAME_GRID_CELLS; cell++) {
+    ctx->cell_start[cell + 1] = ctx->cell_start[cell] + ctx->cell_cnt[cell];
+  }
+  ctx->candidates =
+      malloc((ctx->cell_start[NAME_GRID_CELLS] + 1) * sizeof(uint16_t));
+  if (!ctx->candidates) {
+    return false;
+  }
+  ctx->fill = true;
+  parallel_for(NAME_GRID_SIDE, name_index_task, ctx);
+  return true;
+}
+
+// builds the grid index over entries into cell_start, which needs room
+// for NAME_GRID_CELLS + 1 offsets, and a new candidates array. NULL if
+// it couldn't be allocated
+static uint16_t *build_name_index(const ColorDictionaryEntry *entries,
+                                  size_t count, uint32_t *cell_start) {
+  size_t slab_bytes = 3 * NAME_GRID_SIDE * count * sizeof(uint32_t);
+  name_index_ctx ctx = {.entries = entries,
+                        .count = count,
+                        .near = malloc(slab_bytes + 1),
+                        .far = malloc(slab_bytes + 1),
+                        .cell_cnt = malloc(NAME_GRID_CELLS * sizeof(uint32_t)),
+                        .threshold =
+                            malloc(NAME_GRID_CELLS * sizeof(uint32_t)),
+                        .cell_start = cell_start};
+  if (ctx.near && ctx.far && ctx.cell_cnt && ctx.threshold &&
+      !fill_color_name_index(&ctx)) {
+    ctx.candidates = NULL;
+  }
+  free(ctx.near);
+  free(ctx.far);
+  free(ctx.cell_cnt);
+  free(ctx.threshold);
+  return ctx.candidates;
+}
+
+static size_t dictionary_align(size_t offset) {
+  return (offset + 7) & ~(size_t)7;
+}
+
+static int dictionary_entry_compare(const void *a, const void *b) {
+  const ColorName *x = *(const ColorName *const *)a;
+  const ColorName *y = *(const ColorName *const *)b;
+  uint32_t x_key = (uint32_t)x->r << 16 | x->g << 8 | x->b;
+  uint32_t y_key = (uint32_t)y->r << 16 | y->g << 8 | y->b;
+  if (x_key != y_key) {
+    return x_key < y_key ? -1 : 1;
+  }
+  // keeps the order names were listed in, the first one is kept
+  return x < y ? -1 : x > y;
+}
+
+// points dict at the sections of a dictionary block, false if the block
+// isn't one. every offset is checked against the block so a damaged
+// file can't send a lookup outside it
+static bool open_dictionary_block(ColorDictionary *dict, const void *block,
+                                  size_t bytes) {
+  const ColorDictionaryHeader *header = block;
+  if (bytes < sizeof(*header) ||
+      memcmp(header->magic, COLOR_DICTIONARY_MAGIC, 8) != 0 ||
+      header->version != COLOR_DICTIONARY_VERSION ||
+      header->grid_bits != NAME_GRID_BITS || header->total_bytes != bytes ||
+      header->count >= UINT16_MAX || header->strings_bytes == 0) {
+    return false;
+  }
+  const struct {
+    uint32_t offset;
+    size_t bytes;
+  } sections[4] = {
+      {header->entries_offset, header->count * sizeof(ColorDictionaryEntry)},
+      {header->cell_start_offset, (NAME_GRID_CELLS + 1) * sizeof(uint32_t)},
+      {header->candidates_offset, header->candidate_cnt * sizeof(uint16_t)},
+      {header->strings_offset, header->strings_bytes}};
+  for (int i = 0; i < 4; i++) {
+    if (sections[i].offset % 8 || sections[i].offset > bytes ||
+        sections[i].bytes > bytes - sections[i].offset) {
+      return false;
+    }
+  }
+  const uint8_t *base = block;
+  const ColorDictionaryEntry *entries =
+      (const void *)(base + header->entries_offset);
+  const uint32_t *cell_start = (const void *)(base + header->cell_start_offset);
+  const uint16_t *candidates = (const void *)(base + header->candidates_offset);
+  const char *strings = (const char *)base + header->strings_offset;
+  if (strings[header->strings_bytes - 1] != '\0' ||
+      header->label >= header->strings_bytes || cell_start[0] != 0 ||
+      cell_start[NAME_GRID_CELLS] != header->candidate_cnt) {
+    return false;
+  }
+  for (size_t i = 0; i < header->count; i++) {
+    if (entries[i].name >= header->strings_bytes) {
+      return false;
+    }
+  }
+  for (size_t cell = 0; cell < NAME_GRID_CELLS; cell++) {
+    if (cell_start[cell] > cell_start[cell + 1]) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < header->candidate_cnt; i++) {
+    if (candidates[i] >= header->count) {
+      return false;
+    }
+  }
+  *dict = (ColorDictionary){
+      .label = strings + header->label,
+      .entries = entries,
+      .count = header->count,
+      .strings = strings,
+      .index = {.cell_start = cell_start,
+                .candidates = candidates,
+                .candidate_cnt = header->candidate_cnt,
+                .max_cell_cnt = header->max_cell_cnt},
+      .block = block,
+      .block_bytes = bytes};
+  return true;
+}
+
+// sorts names into entries, dropping every name but the first of a
+// repeated color, and lays them out as a block with their index.
+// sorted starts out pointing at names in order
+static void *pack_dictionary_block(const char *label, const ColorName *names,
+                                   const ColorName **sorted, size_t count,
+                                   ColorDictionaryEntry *entries,
+                                   uint32_t *cell_start, size_t *bytes) {
+  qsort(sorted, count, sizeof(*sorted), dictionary_entry_compare);
+  size_t unique = 0;
+  size_t strings_bytes = strlen(label) + 1;
+  for (size_t i = 0; i < count; i++) {
+    const ColorName *name = sorted[i];
+    if (unique && sorted[unique - 1]->r == name->r &&
+        sorted[unique - 1]->g == name->g && sorted[unique - 1]->b == name->b) {
+      continue;
+    }
+    sorted[unique] = name;
+    entries[unique] = (ColorDictionaryEntry){
+        strings_bytes, name->r, name->g, name->b, 0, name - names};
+    strings_bytes += strlen(name->name) + 1;
+    unique++;
+  }
+  if (unique >= UINT16_MAX) {
+    return NULL;
+  }
+  uint16_t *candidates = build_name_index(entries, unique, cell_start);
+  if (!candidates) {
+    return NULL;
+  }
+
+  ColorDictionaryHeader header = {.version = COLOR_DICTIONARY_VERSION,
+                                  .grid_bits = NAME_GRID_BITS,
+                                  .count = unique,
+                                  .candidate_cnt = cell_start[NAME_GRID_CELLS],
+                                  .label = 0,
+                                  .strings_bytes = strings_bytes};
+  memcpy(header.magic, COLOR_DICTIONARY_MAGIC, 8);
+  for (size_t cell = 0; cell < NAME_GRID_CELLS; cell++) {
+    uint32_t cnt = cell_start[cell + 1] - cell_start[cell];
+    header.max_cell_cnt = cnt > header.max_cell_cnt ? cnt : header.max_cell_cnt;
+  }
+  header.entries_offset = dictionary_align(sizeof(header));
+  header.cell_start_offset = dictionary_align(
+      header.entries_offset + unique * sizeof(ColorDictionaryEntry));
+  header.candidates_offset = dictionary_align(
+      header.cell_start_offset + (NAME_GRID_CELLS + 1) * sizeof(uint32_t));
+  header.strings_offset = dictionary_align(
+      header.candidates_offset + header.candidate_cnt * sizeof(uint16_t));
+  header.total_bytes = dictionary_align(header.strings_offset + strings_bytes);
+
+  uint8_t *block = calloc(1, header.total_bytes);
+  if (block) {
+    memcpy(block, &header, sizeof(header));
+    memcpy(block + header.entries_offset, entries,
+           unique * sizeof(ColorDictionaryEntry));
+    memcpy(block + header.cell_start_offset, cell_start,
+           (NAME_GRID_CELLS + 1) * sizeof(uint32_t));
+    memcpy(block + header.candidates_offset, candidates,
+           header.candidate_cnt * sizeof(uint16_t));
+    char *strings = (char *)block + header.strings_offset;
+    strcpy(strings, label);
+    for (size_t i = 0; i < unique; i++) {
+      strcpy(strings + entries[i].name, sorted[i]->name);
+    }
+    *bytes = header.total_bytes;
+  }
+  free(candidates);
+  return block;
+}
+
+// builds the same block color_script.py writes for these names, byte
+// for byte
+static void *build_dictionary_block(const char *label, const ColorName *names,
+                                    size_t count, size_t *bytes) {
+  const ColorName **sorted = malloc((count + 1) * sizeof(ColorName *));
+  ColorDictionaryEntry *entries =
+      malloc((count + 1) * sizeof(ColorDictionaryEntry));
+  uint32_t *cell_start = malloc((NAME_GRID_CELLS + 1) * sizeof(uint32_t));
+  void *block = NULL;
+  if (sorted && entries && cell_start) {
+    for (size_t i = 0; i < count; i++) {
+      sorted[i] = &names[i];
+    }
+    block = pack_dictionary_block(label, names, sorted, count, entries,
+                                  cell_start, bytes);
+  }
+  free(sorted);
+  free(entries);
+  free(cell_start);
+  return block;
+}
+
+static ColorDictionary builtin_dictionary;
+static bool builtin_dictionary_built;
+static ColorDictionary *active_dictionary;
+
+// the built-in names get their index built here, at first use
+static ColorDictionary *get_builtin_dictionary(void) {
+  if (!builtin_dictionary_built) {
+    builtin_dictionary_built = true;
+    double start = timer_now_ms();
+    size_t bytes = 0;
+    void *block = build_dictionary_block("xkcd", colors, color_count, &bytes);
+    if (!block || !open_dictionary_block(&builtin_dictionary, block, bytes)) {
+      // out of memory, an empty dictionary names everything "Unknown"
+      free(block);
+      builtin_dictionary = (ColorDictionary){.label = "xkcd"};
+    }
+    builtin_dictionary.load_ms = timer_now_ms() - start;
+    builtin_dictionary.index.build_ms = builtin_dictionary.load_ms;
+  }
+  return &builtin_dictionary;
+}
+
+ColorDictionary *get_color_dictionary(void) {
+  return active_dictionary ? active_dictionary : get_builtin_dictionary();
+}
+
+void set_color_dictionary(ColorDictionary *dict) { active_dictionary = dict; }
+
+static void release_dictionary_block(const void *block, size_t bytes,
+                                     bool mapped) {
+#ifdef COLORS_HAVE_MMAP
+  if (mapped) {
+    munmap((void *)block, bytes);
+    return;
+  }
+#endif
+  free((void *)block);
+}
+
+ColorDictionary *load_color_dictionary(const char *path) {
+  double start = timer_now_ms();
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long bytes = ftell(file);
+  void *block = NULL;
+  bool mapped = false;
+#ifdef COLORS_HAVE_MMAP
+  if (bytes > 0) {
+    block = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    mapped = block != MAP_FAILED;
+    block = mapped ? block : NULL;
+  }
+#else
+  // no mmap, read it in once instead. still no parsing
+  block = bytes > 0 ? malloc(bytes) : NULL;
+  fseek(file, 0, SEEK_SET);
+  if (block && fread(block, 1, bytes, file) != (size_t)bytes) {
+    free(block);
+    block = NULL;
+  }
+#endif
+  fclose(file);
+  if (!block) {
+    return NULL;
+  }
+  ColorDictionary *dict = calloc(1, sizeof(ColorDictionary));
+  if (!dict || !open_dictionary_block(dict, block, bytes)) {
+    release_dictionary_block(block, bytes, mapped);
+    free(dict);
+    return NULL;
+  }
+  dict->mapped = mapped;
+  dict->load_ms = timer_now_ms() - start;
+  return dict;
+}
+
+bool save_color_dictionary(const ColorDictionary *dict, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = dict->block &&
+            fwrite(dict->block, 1, dict->block_bytes, file) == dict->block_bytes;
+  return fclose(file) == 0 && ok;
+}
+
+static void free_name_tree(struct ColorNameTree *tree);
+static void free_lab_tree(struct ColorLabTree *tree);
+
+void unload_color_dictionary(ColorDictionary *dict) {
+  if (!dict || dict == &builtin_dictionary) {
+    return;
+  }
+  if (active_dictionary == dict) {
+    active_dictionary = NULL;
+  }
+  free_name_tree(dict->tree);
+  for (int space = 0; space < COLOR_SPACE_COUNT; space++) {
+    free_lab_tree(dict->lab_trees[space]);
+  }
+  release_dictionary_block(dict->block, dict->block_bytes, dict->mapped);
+  free(dict);
+}
+
+static const char *dictionary_name(const ColorDictionary *dict, size_t i) {
+  return dict->strings + dict->entries[i].name;
+}
+
+// whether entry i at distance beats the best so far, every search
+// breaks ties the same way so they all agree with a scan of the list
+// in its source order. UINT16_MAX is no name yet
+static bool name_beats(const ColorDictionary *dict, size_t i, float distance,
+                       uint16_t best, float best_distance) {
+  return distance < best_distance ||
+         (distance == best_distance &&
+          (best == UINT16_MAX ||
+           dict->entries[i].rank < dict->entries[best].rank));
+}
+
+const char *find_closest_color_linear(unsigned char r, unsigned char g,
+                                      unsigned char b) {
+  const ColorDictionary *dict = get_color_dictionary();
   int min_distance = 195076; // Maximum possible distance in RGB space
-  const char *closest_color = "Unknown";
-  for (int i = 0; i < color_count; i++) {
-    int dr = colors[i].r - r;
-    int dg = colors[i].g - g;
-    int db = colors[i].b - b;
+  uint16_t closest = UINT16_MAX;
+  for (size_t i = 0; i < dict->count; i++) {
+    int dr = dict->entries[i].r - r;
+    int dg = dict->entries[i].g - g;
+    int db = dict->entries[i].b - b;
+    int distance = dr * dr + dg * dg + db * db;
+    if (name_beats(dict, i, distance, closest, min_distance)) {
+      min_distance = distance;
+      closest = i;
+    }
+  }
+  return closest == UINT16_MAX ? "Unknown" : dictionary_name(dict, closest);
+}
+
+const ColorName *get_builtin_color_names(size_t *count) {
+  *count = color_count;
+  return colors;
+}
+
+const ColorNameIndex *get_color_name_index(void) {
+  const ColorDictionary *dict = get_color_dictionary();
+  return dict->count ? &dict->index : NULL;
+}
+
+size_t color_name_index_bytes(const ColorNameIndex *index) {
+  if (!index) {
+    return 0;
+  }
+  return sizeof(*index) + (NAME_GRID_CELLS + 1) * sizeof(uint32_t) +
+         index->candidate_cnt * sizeof(uint16_t);
+}
+
+static const char *grid_closest_color(const ColorDictionary *dict,
+                                      unsigned char r, unsigned char g,
+                                      unsigned char b, size_t *evaluations) {
+  const ColorNameIndex *index = &dict->index;
+  size_t cell = ((size_t)(r >> (8 - NAME_GRID_BITS)) << (2 * NAME_GRID_BITS)) |
+                ((g >> (8 - NAME_GRID_BITS)) << NAME_GRID_BITS) |
+                (b >> (8 - NAME_GRID_BITS));
+  int min_distance = INT32_MAX;
+  uint16_t closest = UINT16_MAX;
+  *evaluations = index->cell_start[cell + 1] - index->cell_start[cell];
+  for (uint32_t i = index->cell_start[cell]; i < index->cell_start[cell + 1];
+       i++) {
+    uint16_t name = index->candidates[i];
+    int dr = dict->entries[name].r - r;
+    int dg = dict->entries[name].g - g;
+    int db = dict->entries[name].b - b;
     int distance = dr * dr + dg * dg + db * db;
-    if (distance < min_distance) {
+    if (name_beats(dict, name, distance, closest, min_distance)) {
       min_distance = distance;
-      closest_color = colors[i].name;
+      closest = name;
+    }
+  }
+  return closest == UINT16_MAX ? "Unknown" : dictionary_name(dict, closest);
+}
+
+// far enough that a padding slot never beats a real name
+#define NAME_LEAF_PAD 4096
+
+static int name_channel_greater(const ColorDictionaryEntry *a,
+                                const ColorDictionaryEntry *b, int channel) {
+  int diff = (&a->r)[channel] - (&b->r)[channel];
+  return diff ? diff > 0 : a > b;
+}
+
+static void name_tree_build(ColorNameTree *tree,
+                            const ColorDictionaryEntry *entries,
+                            uint16_t *order, size_t count, size_t node,
+                            size_t level) {
+  if (level == tree->depth) {
+    size_t slot = (node - ((1 << tree->depth) - 1)) * NAME_LEAF_SIZE;
+    for (size_t i = 0; i < NAME_LEAF_SIZE; i++) {
+      bool real = i < count;
+      tree->r[slot + i] = real ? entries[order[i]].r : NAME_LEAF_PAD;
+      tree->g[slot + i] = real ? entries[order[i]].g : NAME_LEAF_PAD;
+      tree->b[slot + i] = real ? entries[order[i]].b : NAME_LEAF_PAD;
+      tree->name[slot + i] = real ? order[i] : UINT16_MAX;
+    }
+    return;
+  }
+  uint8_t lo[3] = {255, 255, 255}, hi[3] = {0};
+  for (size_t i = 0; i < count; i++) {
+    for (int c = 0; c < 3; c++) {
+      uint8_t v = (&entries[order[i]].r)[c];
+      lo[c] = v < lo[c] ? v : lo[c];
+      hi[c] = v > hi[c] ? v : hi[c];
+    }
+  }
+  int channel = 0;
+  for (int c = 1; c < 3; c++) {
+    if (hi[c] - lo[c] > hi[channel] - lo[channel]) {
+      channel = c;
+    }
+  }
+  // a few hundred names at most, insertion sort is plenty
+  for (size_t i = 1; i < count; i++) {
+    uint16_t cur = order[i];
+    size_t j = i;
+    for (; j > 0 && name_channel_greater(&entries[order[j - 1]],
+                                         &entries[cur], channel);
+         j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = cur;
+  }
+  size_t half = count / 2;
+  tree->split_channel[node] = channel;
+  tree->split_value[node] = (&entries[order[half]].r)[channel];
+  name_tree_build(tree, entries, order, half, 2 * node + 1, level + 1);
+  name_tree_build(tree, entries, order + half, count - half, 2 * node + 2,
+                  level + 1);
+}
+
+static void free_name_tree(ColorNameTree *tree) {
+  if (tree) {
+    free(tree->split_channel);
+    free(tree->split_value);
+    free(tree->r);
+    free(tree->g);
+    free(tree->b);
+    free(tree->name);
+    free(tree);
+  }
+}
+
+static ColorNameTree *build_color_name_tree(const ColorDictionary *dict) {
+  double start = timer_now_ms();
+  ColorNameTree *tree = calloc(1, sizeof(ColorNameTree));
+  uint16_t *order = malloc((dict->count + 1) * sizeof(uint16_t));
+  if (!tree || !order) {
+    free(tree);
+    free(order);
+    return NULL;
+  }
+  // the smallest tree whose leaves all fit, halving the names per level
+  while ((dict->count + (1 << tree->depth) - 1) >> tree->depth >
+         NAME_LEAF_SIZE) {
+    tree->depth++;
+  }
+  tree->leaf_cnt = (size_t)1 << tree->depth;
+  size_t inner_cnt = tree->leaf_cnt - 1;
+  size_t slots = tree->leaf_cnt * NAME_LEAF_SIZE;
+  tree->split_channel = malloc(inner_cnt + 1);
+  tree->split_value = malloc(inner_cnt + 1);
+  tree->r = malloc(slots * sizeof(int32_t));
+  tree->g = malloc(slots * sizeof(int32_t));
+  tree->b = malloc(slots * sizeof(int32_t));
+  tree->name = malloc(slots * sizeof(uint16_t));
+  if (!tree->split_channel || !tree->split_value || !tree->r || !tree->g ||
+      !tree->b || !tree->name) {
+    free_name_tree(tree);
+    free(order);
+    return NULL;
+  }
+  for (size_t i = 0; i < dict->count; i++) {
+    order[i] = i;
+  }
+  name_tree_build(tree, dict->entries, order, dict->count, 0, 0);
+  free(order);
+  tree->build_ms = timer_now_ms() - start;
+  return tree;
+}
+
+typedef int32_t name_leaf_vec
+    __attribute__((vector_size(NAME_LEAF_SIZE * sizeof(int32_t))));
+
+typedef struct {
+  const ColorDictionary *dict;
+  int32_t r, g, b;
+  int32_t best_distance;
+  uint16_t best_name;
+  size_t evaluations;
+} name_query;
+
+static void name_leaf_scan(const ColorNameTree *tree, size_t leaf,
+                           name_query *query) {
+  size_t slot = leaf * NAME_LEAF_SIZE;
+  name_leaf_vec r, g, b;
+  memcpy(&r, &tree->r[slot], sizeof(r));
+  memcpy(&g, &tree->g[slot], sizeof(g));
+  memcpy(&b, &tree->b[slot], sizeof(b));
+  name_leaf_vec dr = r - query->r;
+  name_leaf_vec dg = g - query->g;
+  name_leaf_vec db = b - query->b;
+  name_leaf_vec distance = dr * dr + dg * dg + db * db;
+  query->evaluations += NAME_LEAF_SIZE;
+  for (int i = 0; i < NAME_LEAF_SIZE; i++) {
+    uint16_t name = tree->name[slot + i];
+    if (name != UINT16_MAX &&
+        name_beats(query->dict, name, distance[i], query->best_name,
+                   query->best_distance)) {
+      query->best_distance = distance[i];
+      query->best_name = name;
+    }
+  }
+}
+
+static void name_tree_search(const ColorNameTree *tree, size_t node,
+                             size_t level, name_query *query) {
+  if (level == tree->depth) {
+    name_leaf_scan(tree, node - (tree->leaf_cnt - 1), query);
+    return;
+  }
+  int channel = tree->split_channel[node];
+  int32_t diff = (&query->r)[channel] - tree->split_value[node];
+  size_t left = 2 * node + 1;
+  name_tree_search(tree, diff <= 0 ? left : left + 1, level + 1, query);
+  // the other side can't be closer than the split plane, and an equal
+  // distance can still hold a lower rank
+  if (diff * diff <= query->best_distance) {
+    name_tree_search(tree, diff <= 0 ? left + 1 : left, level + 1, query);
+  }
+}
+
+static const char *tree_closest_color(const ColorDictionary *dict,
+                                      const ColorNameTree *tree,
+                                      unsigned char r, unsigned char g,
+                                      unsigned char b, size_t *evaluations) {
+  name_query query = {dict, r, g, b, INT32_MAX, UINT16_MAX};
+  name_tree_search(tree, 0, 0, &query);
+  *evaluations = query.evaluations;
+  return query.best_name == UINT16_MAX ? "Unknown"
+                                       : dictionary_name(dict, query.best_name);
+}
+
+static const ColorNameTree *dictionary_name_tree(ColorDictionary *dict) {
+  if (!dict->tree_built) {
+    dict->tree = build_color_name_tree(dict);
+    dict->tree_built = true;
+  }
+  return dict->tree;
+}
+
+const ColorNameTree *get_color_name_tree(void) {
+  return dictionary_name_tree(get_color_dictionary());
+}
+
+// lab k-d tree, laid out like ColorNameTree but with a bounding box
+// on every node, inner and leaf, since a split plane alone doesn't
+// bound CIEDE2000. the fourth box entry is CIELAB chroma
+typedef struct ColorLabTree {
+  float (*lo)[4], (*hi)[4]; // 2 * leaf_cnt - 1 nodes
+  LabColor *lab;            // leaf slots
+  float *chroma;
+  uint16_t *name; // UINT16_MAX marks padding
+  size_t depth;
+  size_t leaf_cnt;
+  // every entry in table order, for the exhaustive scan
+  LabColor *entry_lab;
+} ColorLabTree;
+
+static float name_lab_coord(const LabColor *lab, const float *chroma,
+                            int axis) {
+  return axis == 3 ? *chroma : (&lab->l)[axis];
+}
+
+static void lab_tree_build(ColorLabTree *tree, const LabColor *lab,
+                           const float *chroma, uint16_t *order, size_t count,
+                           size_t node, size_t level) {
+  for (int axis = 0; axis < 4; axis++) {
+    tree->lo[node][axis] = INFINITY;
+    tree->hi[node][axis] = -INFINITY;
+  }
+  for (size_t i = 0; i < count; i++) {
+    for (int axis = 0; axis < 4; axis++) {
+      float v = name_lab_coord(&lab[order[i]], &chroma[order[i]], axis);
+      tree->lo[node][axis] = fminf(tree->lo[node][axis], v);
+      tree->hi[node][axis] = fmaxf(tree->hi[node][axis], v);
+    }
+  }
+  if (level == tree->depth) {
+    size_t slot = (node - (tree->leaf_cnt - 1)) * NAME_LEAF_SIZE;
+    for (size_t i = 0; i < NAME_LEAF_SIZE; i++) {
+      bool real = i < count;
+      tree->lab[slot + i] = real ? lab[order[i]] : (LabColor){0};
+      tree->chroma[slot + i] = real ? chroma[order[i]] : 0;
+      tree->name[slot + i] = real ? order[i] : UINT16_MAX;
+    }
+    return;
+  }
+  int axis = 0;
+  for (int a = 1; a < 3; a++) {
+    if (tree->hi[node][a] - tree->lo[node][a] >
+        tree->hi[node][axis] - tree->lo[node][axis]) {
+      axis = a;
+    }
+  }
+  for (size_t i = 1; i < count; i++) {
+    uint16_t cur = order[i];
+    float v = (&lab[cur].l)[axis];
+    size_t j = i;
+    for (; j > 0 && ((&lab[order[j - 1]].l)[axis] > v ||
+                     ((&lab[order[j - 1]].l)[axis] == v && order[j - 1] > cur));
+         j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = cur;
+  }
+  size_t half = count / 2;
+  lab_tree_build(tree, lab, chroma, order, half, 2 * node + 1, level + 1);
+  lab_tree_build(tree, lab, chroma, order + half, count - half, 2 * node + 2,
+                 level + 1);
+}
+
+static void free_lab_tree(ColorLabTree *tree) {
+  if (tree) {
+    free(tree->lo);
+    free(tree->hi);
+    free(tree->lab);
+    free(tree->chroma);
+    free(tree->name);
+    free(tree->entry_lab);
+    free(tree);
+  }
+}
+
+static ColorLabTree *build_lab_tree(const ColorDictionary *dict,
+                                    color_space space) {
+  size_t count = dict->count;
+  ColorStruct *srgb = calloc(count + 1, sizeof(ColorStruct));
+  LabColor *lab = malloc((count + 1) * sizeof(LabColor));
+  float *chroma = malloc((count + 1) * sizeof(float));
+  uint16_t *order = malloc((count + 1) * sizeof(uint16_t));
+  ColorLabTree *tree = calloc(1, sizeof(ColorLabTree));
+  if (!srgb || !lab || !chroma || !order || !tree) {
+    free(srgb);
+    free(lab);
+    free(chroma);
+    free(order);
+    free(tree);
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    const ColorDictionaryEntry *entry = &dict->entries[i];
+    srgb[i] = (ColorStruct){entry->r, entry->g, entry->b, 255};
+    order[i] = i;
+  }
+  get_lab_kernel()(srgb, count, space, lab);
+  for (size_t i = 0; i < count; i++) {
+    chroma[i] = hypotf(lab[i].a, lab[i].b);
+  }
+  free(srgb);
+  tree->entry_lab = lab;
+
+  while ((count + (1 << tree->depth) - 1) >> tree->depth > NAME_LEAF_SIZE) {
+    tree->depth++;
+  }
+  tree->leaf_cnt = (size_t)1 << tree->depth;
+  size_t node_cnt = 2 * tree->leaf_cnt - 1;
+  size_t slots = tree->leaf_cnt * NAME_LEAF_SIZE;
+  tree->lo = malloc(node_cnt * sizeof(*tree->lo));
+  tree->hi = malloc(node_cnt * sizeof(*tree->hi));
+  tree->lab = malloc(slots * sizeof(LabColor));
+  tree->chroma = malloc(slots * sizeof(float));
+  tree->name = malloc(slots * sizeof(uint16_t));
+  if (!tree->lo || !tree->hi || !tree->lab || !tree->chroma || !tree->name) {
+    free_lab_tree(tree);
+    tree = NULL;
+  } else {
+    lab_tree_build(tree, lab, chroma, order, count, 0, 0);
+  }
+  free(order);
+  free(chroma);
+  return tree;
+}
+
+static const ColorLabTree *dictionary_lab_tree(ColorDictionary *dict,
+                                               color_space space) {
+  if (!dict->lab_trees_built[space]) {
+    dict->lab_trees[space] = build_lab_tree(dict, space);
+    dict->lab_trees_built[space] = true;
+  }
+  return dict->lab_trees[space];
+}
+
+typedef struct {
+  const ColorDictionary *dict;
+  LabColor lab;
+  float chroma;
+  name_metric metric;
+  float best_distance;
+  uint16_t best_name;
+  size_t evaluations;
+} lab_query;
+
+// the bounds below are computed in double and trusted down to this
+// factor, far looser than their rounding error
+#define NAME_BOUND_SLACK 0.999
+
+// CIEDE2000 weights can only be bounded, not computed, without the
+// hue angles. T stays within 1 -+ 0.93, the sum of its cosine
+// weights, and the rotation term's sine is at most sin(60 degrees)
+#define DE2000_T_MIN 0.07
+#define DE2000_T_MAX 1.93
+#define DE2000_SIN_MAX 0.8660255
+
+static double de2000_rc(double cp_mean) {
+  double cp7 = de2000_pow7(cp_mean);
+  return 2 * sqrt(cp7 / (cp7 + DE2000_POW25_7));
+}
+
+static double de2000_sl(double l_mean) {
+  double l50 = (l_mean - 50) * (l_mean - 50);
+  return 1 + 0.015 * l50 / sqrt(20 + l50);
+}
+
+// lower bound on CIEDE2000 without any trig. everything but the hue
+// weight and the rotation term is exact, and the hue difference comes
+// from |delta a'b'|^2 = delta C'^2 + delta H'^2. the rotation term
+// is then at its most negative within the range SH allows
+static double de2000_pair_bound(const lab_query *query, LabColor lab,
+                                float chroma) {
+  double c_mean = (query->chroma + chroma) / 2.0;
+  double c7 = de2000_pow7(c_mean);
+  double g = 0.5 * (1 - sqrt(c7 / (c7 + DE2000_POW25_7)));
+  double a1 = (1 + g) * query->lab.a, a2 = (1 + g) * lab.a;
+  double c1 = hypot(a1, query->lab.b), c2 = hypot(a2, lab.b);
+  double dc = c2 - c1;
+  double dab = (a2 - a1) * (a2 - a1) + (double)(lab.b - query->lab.b) *
+                                           (lab.b - query->lab.b);
+  double dh = sqrt(fmax(0, dab - dc * dc));
+  double cp_mean = (c1 + c2) / 2;
+  double sl = de2000_sl((query->lab.l + lab.l) / 2.0);
+  double sc = 1 + 0.045 * cp_mean;
+  double rt = DE2000_SIN_MAX * de2000_rc(cp_mean);
+  double x = fabs(dc) / sc;
+  double y_lo = dh / (1 + 0.015 * cp_mean * DE2000_T_MAX);
+  double y_hi = dh / (1 + 0.015 * cp_mean * DE2000_T_MIN);
+  double y = fmin(fmax(rt * x / 2, y_lo), y_hi);
+  double tl = (lab.l - query->lab.l) / sl;
+  return sqrt(fmax(0, tl * tl + x * x + y * y - rt * x * y));
+}
+
+static double axis_gap(double v, double lo, double hi) {
+  return v < lo ? lo - v : v > hi ? v - hi : 0;
+}
+
+// lower bound on the distance to anything in a node's box. for
+// CIEDE2000 chroma is at most 1.5x the CIELAB chroma, which caps the
+// weights, and the rotation term can at worst scale the chroma and hue
+// part by 1 - |RT| / 2
+static double lab_box_bound(const lab_query *query, const float *lo,
+                            const float *hi) {
+  double dl = axis_gap(query->lab.l, lo[0], hi[0]);
+  double da = axis_gap(query->lab.a, lo[1], hi[1]);
+  double db = axis_gap(query->lab.b, lo[2], hi[2]);
+  if (query->metric == NAME_METRIC_OKLAB) {
+    return sqrt(dl * dl + da * da + db * db);
+  }
+  double sl = fmax(de2000_sl((query->lab.l + lo[0]) / 2.0),
+                   de2000_sl((query->lab.l + hi[0]) / 2.0));
+  double cp_max = 1.5 * (query->chroma + hi[3]) / 2;
+  double s_max = 1 + 0.045 * cp_max;
+  double scale = 1 - DE2000_SIN_MAX * de2000_rc(cp_max) / 2;
+  return sqrt(dl * dl / (sl * sl) +
+              scale * (da * da + db * db) / (s_max * s_max));
+}
+
+static float lab_distance(const lab_query *query, LabColor lab) {
+  if (query->metric == NAME_METRIC_OKLAB) {
+    float dl = lab.l - query->lab.l;
+    float da = lab.a - query->lab.a;
+    float db = lab.b - query->lab.b;
+    return sqrtf(dl * dl + da * da + db * db);
+  }
+  return delta_e_2000(query->lab, lab);
+}
+
+static void lab_query_consider(lab_query *query, LabColor lab,
+                               uint16_t name) {
+  float distance = lab_distance(query, lab);
+  query->evaluations++;
+  if (name_beats(query->dict, name, distance, query->best_name,
+                 query->best_distance)) {
+    query->best_distance = distance;
+    query->best_name = name;
+  }
+}
+
+// bounds every name in the leaf, then computes full distances from the
+// lowest bound up until the bounds pass the best distance found
+static void lab_leaf_scan(const ColorLabTree *tree, size_t leaf,
+                          lab_query *query) {
+  size_t slot = leaf * NAME_LEAF_SIZE;
+  if (query->metric == NAME_METRIC_OKLAB) {
+    for (size_t i = slot; i < slot + NAME_LEAF_SIZE; i++) {
+      if (tree->name[i] != UINT16_MAX) {
+        lab_query_consider(query, tree->lab[i], tree->name[i]);
+      }
+    }
+    return;
+  }
+  double bound[NAME_LEAF_SIZE];
+  for (size_t i = 0; i < NAME_LEAF_SIZE; i++) {
+    bound[i] = tree->name[slot + i] == UINT16_MAX
+                   ? INFINITY
+                   : de2000_pair_bound(query, tree->lab[slot + i],
+                                       tree->chroma[slot + i]);
+  }
+  for (;;) {
+    size_t next = 0;
+    for (size_t i = 1; i < NAME_LEAF_SIZE; i++) {
+      next = bound[i] < bound[next] ? i : next;
+    }
+    if (bound[next] * NAME_BOUND_SLACK > query->best_distance) {
+      return;
+    }
+    bound[next] = INFINITY;
+    lab_query_consider(query, tree->lab[slot + next], tree->name[slot + next]);
+  }
+}
+
+static void lab_tree_search(const ColorLabTree *tree, size_t node,
+                            size_t level, lab_query *query) {
+  if (level == tree->depth) {
+    lab_leaf_scan(tree, node - (tree->leaf_cnt - 1), query);
+    return;
+  }
+  size_t child[2] = {2 * node + 1, 2 * node + 2};
+  double bound[2];
+  for (int i = 0; i < 2; i++) {
+    bound[i] = lab_box_bound(query, tree->lo[child[i]], tree->hi[child[i]]);
+  }
+  int first = bound[1] < bound[0];
+  for (int i = 0; i < 2; i++) {
+    int side = i ? !first : first;
+    if (bound[side] * NAME_BOUND_SLACK <= query->best_distance) {
+      lab_tree_search(tree, child[side], level + 1, query);
+    }
+  }
+}
+
+static name_metric active_name_metric = NAME_METRIC_RGB;
+
+void set_name_metric(name_metric metric) { active_name_metric = metric; }
+
+const char *name_metric_name(name_metric metric) {
+  switch (metric) {
+  case NAME_METRIC_RGB:
+    return "rgb";
+  case NAME_METRIC_CIEDE2000:
+    return "de2000";
+  case NAME_METRIC_OKLAB:
+    return "oklab";
+  }
+  return "unknown";
+}
+
+static color_space name_metric_space(name_metric metric) {
+  return metric == NAME_METRIC_OKLAB ? COLOR_SPACE_OKLAB : COLOR_SPACE_CIELAB;
+}
+
+static const char *lab_closest_color(ColorDictionary *dict,
+                                     name_metric metric, bool exhaustive,
+                                     unsigned char r, unsigned char g,
+                                     unsigned char b, size_t *evaluations) {
+  color_space space = name_metric_space(metric);
+  const ColorLabTree *tree = dictionary_lab_tree(dict, space);
+  if (!tree) {
+    *evaluations = 0;
+    return "Unknown";
+  }
+  lab_query query = {.dict = dict,
+                     .metric = metric,
+                     .best_distance = INFINITY,
+                     .best_name = UINT16_MAX};
+  get_lab_kernel()(&(ColorStruct){r, g, b, 255}, 1, space, &query.lab);
+  query.chroma = hypotf(query.lab.a, query.lab.b);
+  if (exhaustive) {
+    for (size_t i = 0; i < dict->count; i++) {
+      lab_query_consider(&query, tree->entry_lab[i], i);
+    }
+  } else {
+    lab_tree_search(tree, 0, 0, &query);
+  }
+  *evaluations = query.evaluations;
+  return query.best_name == UINT16_MAX ? "Unknown"
+                                       : dictionary_name(dict, query.best_name);
+}
+
+static name_search active_name_search = NAME_SEARCH_GRID;
+
+void set_name_search(name_search search) { active_name_search = search; }
+
+const char *name_search_name(name_search search) {
+  switch (search) {
+  case NAME_SEARCH_LINEAR:
+    return "linear";
+  case NAME_SEARCH_GRID:
+    return "grid";
+  case NAME_SEARCH_KDTREE:
+    return "kdtree";
+  }
+  return "unknown";
+}
+
+const char *find_closest_color_counted(unsigned char r, unsigned char g,
+                                       unsigned char b, size_t *evaluations) {
+  ColorDictionary *dict = get_color_dictionary();
+  if (dict->count == 0) {
+    *evaluations = 0;
+    return "Unknown";
+  }
+  if (active_name_metric != NAME_METRIC_RGB) {
+    return lab_closest_color(dict, active_name_metric,
+                             active_name_search == NAME_SEARCH_LINEAR, r, g, b,
+                             evaluations);
+  }
+  if (active_name_search == NAME_SEARCH_GRID) {
+    return grid_closest_color(dict, r, g, b, evaluations);
+  } else if (active_name_search == NAME_SEARCH_KDTREE) {
+    const ColorNameTree *tree = dictionary_name_tree(dict);
+    if (tree) {
+      return tree_closest_color(dict, tree, r, g, b, evaluations);
     }
   }
-  return closest_color;
+  *evaluations = dict->count;
+  return find_closest_color_linear(r, g, b);
+}
+
+const char *find_closest_color(unsigned char r, unsigned char g,
+                               unsigned char b) {
+  size_t evaluations;
+  return find_closest_color_counted(r, g, b, &evaluations);
+}
+
+#define NAME_BATCH_TASK 4096
+
+typedef struct {
+  const ColorStruct *queries;
+  size_t n;
+  const char **out;
+} name_batch_ctx;
+
+static void name_batch_task(void *arg, size_t task, size_t thread) {
+  name_batch_ctx *ctx = arg;
+  size_t first = task * NAME_BATCH_TASK;
+  size_t last = first + NAME_BATCH_TASK;
+  if (last > ctx->n)
+    last = ctx->n;
+  for (size_t i = first; i < last; i++) {
+    ctx->out[i] = find_closest_color(ctx->queries[i].r, ctx->queries[i].g,
+                                     ctx->queries[i].b);
+  }
+}
+
+void find_closest_colors(const ColorStruct *queries, size_t n,
+                         const char **out) {
+  // the workers only read the lookup structures, build them first
+  ColorDictionary *dict = get_color_dictionary();
+  if (dict->count > 0 && active_name_metric != NAME_METRIC_RGB) {
+    dictionary_lab_tree(dict, name_metric_space(active_name_metric));
+  } else if (dict->count > 0 && active_name_search == NAME_SEARCH_KDTREE) {
+    dictionary_name_tree(dict);
+  }
+  name_batch_ctx ctx = {queries, n, out};
+  parallel_for((n + NAME_BATCH_TASK - 1) / NAME_BATCH_TASK, name_batch_task,
+               &ctx);
 }
 #endif
@@ -0,0 +1,366 @@
+#pragma once
+#include "colors.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// lightness and two opponent axes, OKLab has L in [0, 1] and CIELAB
+// has L in [0, 100]
+typedef struct {
+  float l, a, b;
+} LabColor;
+
+// converts count srgb colors to space (COLOR_SPACE_OKLAB or
+// COLOR_SPACE_CIELAB). the srgb curve is a 256 entry table and the rest
+// is vectorized
+typedef void (*lab_kernel)(const ColorStruct *in, size_t count,
+                           color_space space, LabColor *out);
+
+typedef struct {
+  const char *name;
+  lab_kernel kernel;
+} lab_kernel_entry;
+
+// fastest kernel the cpu supports, detected on the first call
+lab_kernel get_lab_kernel(void);
+
+// every kernel the cpu supports, fastest first, used by the benchmarks
+size_t get_lab_kernels(lab_kernel_entry *out, size_t max);
+
+// inverse of the conversion, clamped to the srgb gamut
+ColorStruct lab_to_srgb(LabColor lab, color_space space);
+
+// palette backends work on 8 bit channels, so lab colors are stored
+// with one scale on every axis to keep distances uniform. OKLab is
+// scaled by 255 with a and b offset by 128, CIELAB keeps its units
+// with a and b offset by 128. encoding runs across the thread pool
+void encode_colors(const ColorStruct *in, size_t count, color_space space,
+                   ColorStruct *out);
+ColorStruct decode_color(ColorStruct encoded, color_space space);
+
+// CIEDE2000 difference between two CIELAB colors, as laid out in
+// Sharma, Wu and Dalal's notes on the formula, computed in double
+float delta_e_2000(LabColor x, LabColor y);
+
+// 25^7, where CIEDE2000's chroma weighting crosses over, and the
+// seventh power the weighting uses
+#define DE2000_POW25_7 6103515625.0
+
+static inline double de2000_pow7(double x) {
+  double x2 = x * x;
+  return x2 * x2 * x2 * x;
+}
+
+#ifdef COLORSPACE_LIB_IMPLEMENTATION
+#include "parallel.h"
+#include <math.h>
+#include <string.h>
+
+// colors per encoding task, and per kernel call inside a task
+#define ENCODE_TASK_COLORS 16384
+#define ENCODE_BLOCK_COLORS 256
+
+#define OKLAB_SCALE 255.0f
+#define LAB_OFFSET 128.0f
+
+static float srgb_to_linear_lut[256];
+static bool srgb_lut_ready = false;
+
+static void build_srgb_lut(void) {
+  for (int i = 0; i < 256; i++) {
+    float c = i / 255.0f;
+    srgb_to_linear_lut[i] =
+        c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+  }
+  srgb_lut_ready = true;
+}
+
+static float linear_to_srgb(float c) {
+  c = c < 0 ? 0 : c > 1 ? 1 : c;
+  return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+}
+
+// CIELAB's cube root with the linear segment near black
+#define CIELAB_EPSILON (216.0f / 24389.0f)
+#define CIELAB_KAPPA (24389.0f / 27.0f)
+// D65 white
+#define WHITE_X 0.95047f
+#define WHITE_Z 1.08883f
+
+static void lab_scalar(const ColorStruct *in, size_t count, color_space space,
+                       LabColor *out) {
+  for (size_t i = 0; i < count; i++) {
+    float r = srgb_to_linear_lut[in[i].r];
+    float g = srgb_to_linear_lut[in[i].g];
+    float b = srgb_to_linear_lut[in[i].b];
+    if (space == COLOR_SPACE_OKLAB) {
+      float l =
+          cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+      float m =
+          cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+      float s =
+          cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+      out[i] = (LabColor){
+          0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s,
+          1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s,
+          0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s};
+    } else {
+      float xyz[3] = {
+          (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / WHITE_X,
+          0.2126729f * r + 0.7151522f * g + 0.0721750f * b,
+          (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / WHITE_Z};
+      for (int j = 0; j < 3; j++) {
+        xyz[j] = xyz[j] > CIELAB_EPSILON ? cbrtf(xyz[j])
+                                         : (CIELAB_KAPPA * xyz[j] + 16) / 116;
+      }
+      out[i] = (LabColor){116 * xyz[1] - 16, 500 * (xyz[0] - xyz[1]),
+                          200 * (xyz[1] - xyz[2])};
+    }
+  }
+}
+
+// the vector kernels are written once with gcc vector types and
+// stamped out per width. the cube root starts from a bit trick guess
+// and takes three newton steps, plenty for 8 bit encodings
+#define LAB_VECTOR_KERNEL(name, lanes, attributes)                             \
+  attributes static void name(const ColorStruct *in, size_t count,             \
+                              color_space space, LabColor *out) {              \
+    typedef float vec __attribute__((vector_size(lanes * 4)));                 \
+    typedef int32_t ivec __attribute__((vector_size(lanes * 4)));              \
+    size_t i = 0;                                                              \
+    for (; i + lanes <= count; i += lanes) {                                   \
+      vec r, g, b;                                                             \
+      for (int lane = 0; lane < lanes; lane++) {                               \
+        r[lane] = srgb_to_linear_lut[in[i + lane].r];                          \
+        g[lane] = srgb_to_linear_lut[in[i + lane].g];                          \
+        b[lane] = srgb_to_linear_lut[in[i + lane].b];                          \
+      }                                                                        \
+      vec x, y, z;                                                             \
+      if (space == COLOR_SPACE_OKLAB) {                                        \
+        x = 0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b;         \
+        y = 0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b;         \
+        z = 0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b;         \
+      } else {                                                                 \
+        x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / WHITE_X;      \
+        y = 0.2126729f * r + 0.7151522f * g + 0.0721750f * b;                  \
+        z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / WHITE_Z;      \
+      }                                                                        \
+      vec *channels[3] = {&x, &y, &z};                                         \
+      for (int c = 0; c < 3; c++) {                                            \
+        vec v = *channels[c];                                                  \
+        /* zero would divide by zero in the newton step */                     \
+        v = (vec)((ivec)v & (ivec)(v > 1e-12f)) +                              \
+            (vec)((ivec)((vec){0} + 1e-12f) & ~(ivec)(v > 1e-12f));            \
+        vec root = (vec)((ivec)v / 3 + 709921077);                             \
+        for (int step = 0; step < 3; step++) {                                 \
+          root = root - (root * root * root - v) / (3 * root * root);          \
+        }                                                                      \
+        if (space == COLOR_SPACE_CIELAB) {                                     \
+          ivec cube = (ivec)(*channels[c] > CIELAB_EPSILON);                   \
+          vec linear = (CIELAB_KAPPA * *channels[c] + 16) / 116;               \
+          root = (vec)(((ivec)root & cube) | ((ivec)linear & ~cube));          \
+        }                                                                      \
+        *channels[c] = root;                                                   \
+      }                                                                        \
+      vec l_out, a_out, b_out;                                                 \
+      if (space == COLOR_SPACE_OKLAB) {                                        \
+        l_out = 0.2104542553f * x + 0.7936177850f * y - 0.0040720468f * z;     \
+        a_out = 1.9779984951f * x - 2.4285922050f * y + 0.4505937099f * z;     \
+        b_out = 0.0259040371f * x + 0.7827717662f * y - 0.8086757660f * z;     \
+      } else {                                                                 \
+        l_out = 116 * y - 16;                                                  \
+        a_out = 500 * (x - y);                                                 \
+        b_out = 200 * (y - z);                                                 \
+      }                                                                        \
+      for (int lane = 0; lane < lanes; lane++) {                               \
+        out[i + lane] = (LabColor){l_out[lane], a_out[lane], b_out[lane]};     \
+      }                                                                        \
+    }                                                                          \
+    lab_scalar(in + i, count - i, space, out + i);                             \
+  }
+
+// 4 lanes is one sse or wasm simd128 register
+LAB_VECTOR_KERNEL(lab_vec128, 4, )
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LAB_HAVE_AVX2 1
+LAB_VECTOR_KERNEL(lab_avx2, 8, __attribute__((target("avx2"))))
+#endif
+
+size_t get_lab_kernels(lab_kernel_entry *out, size_t max) {
+  if (!srgb_lut_ready) {
+    build_srgb_lut();
+  }
+  size_t count = 0;
+#ifdef LAB_HAVE_AVX2
+  __builtin_cpu_init();
+  if (count < max && __builtin_cpu_supports("avx2")) {
+    out[count++] = (lab_kernel_entry){"avx2", lab_avx2};
+  }
+#endif
+  if (count < max) {
+    out[count++] = (lab_kernel_entry){"vec128", lab_vec128};
+  }
+  if (count < max) {
+    out[count++] = (lab_kernel_entry){"scalar", lab_scalar};
+  }
+  return count;
+}
+
+lab_kernel get_lab_kernel(void) {
+  static lab_kernel best = NULL;
+  if (!best) {
+    lab_kernel_entry entry;
+    get_lab_kernels(&entry, 1);
+    best = entry.kernel;
+  }
+  return best;
+}
+
+ColorStruct lab_to_srgb(LabColor lab, color_space space) {
+  float r, g, b;
+  if (space == COLOR_SPACE_OKLAB) {
+    float l = lab.l + 0.3963377774f * lab.a + 0.2158037573f * lab.b;
+    float m = lab.l - 0.1055613458f * lab.a - 0.0638541728f * lab.b;
+    float s = lab.l - 0.0894841775f * lab.a - 1.2914855480f * lab.b;
+    l = l * l * l;
+    m = m * m * m;
+    s = s * s * s;
+    r = 4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
+    g = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
+    b = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+  } else {
+    float fy = (lab.l + 16) / 116;
+    float f[3] = {fy + lab.a / 500, fy, fy - lab.b / 200};
+    for (int j = 0; j < 3; j++) {
+      float cube = f[j] * f[j] * f[j];
+      f[j] = cube > CIELAB_EPSILON ? cube : (116 * f[j] - 16) / CIELAB_KAPPA;
+    }
+    float x = f[0] * WHITE_X, y = f[1], z = f[2] * WHITE_Z;
+    r = 3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+    g = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+    b = 0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+  }
+  return (ColorStruct){lroundf(linear_to_srgb(r) * 255),
+                       lroundf(linear_to_srgb(g) * 255),
+                       lroundf(linear_to_srgb(b) * 255), 255};
+}
+
+static inline unsigned char encode_channel(float value) {
+  value = roundf(value);
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+typedef struct {
+  const ColorStruct *in;
+  size_t count;
+  color_space space;
+  lab_kernel kernel;
+  ColorStruct *out;
+} encode_ctx;
+
+static void encode_task(void *arg, size_t task, size_t thread) {
+  encode_ctx *ctx = arg;
+  size_t first = task * ENCODE_TASK_COLORS;
+  size_t last = first + ENCODE_TASK_COLORS;
+  if (last > ctx->count) {
+    last = ctx->count;
+  }
+  float scale = ctx->space == COLOR_SPACE_OKLAB ? OKLAB_SCALE : 1.0f;
+  LabColor lab[ENCODE_BLOCK_COLORS];
+  for (size_t i = first; i < last; i += ENCODE_BLOCK_COLORS) {
+    size_t block = last - i < ENCODE_BLOCK_COLORS ? last - i
+                                                  : ENCODE_BLOCK_COLORS;
+    ctx->kernel(ctx->in + i, block, ctx->space, lab);
+    for (size_t j = 0; j < block; j++) {
+      ctx->out[i + j] = (ColorStruct){
+          encode_channel(lab[j].l * scale),
+          encode_channel(lab[j].a * scale + LAB_OFFSET),
+          encode_channel(lab[j].b * scale + LAB_OFFSET), 255};
+    }
+  }
+}
+
+void encode_colors(const ColorStruct *in, size_t count, color_space space,
+                   ColorStruct *out) {
+  if (space == COLOR_SPACE_SRGB) {
+    memmove(out, in, count * sizeof(ColorStruct));
+    return;
+  }
+  encode_ctx ctx = {.in = in,
+                    .count = count,
+                    .space = space,
+                    .kernel = get_lab_kernel(),
+                    .out = out};
+  parallel_for((count + ENCODE_TASK_COLORS - 1) / ENCODE_TASK_COLORS,
+               encode_task, &ctx);
+}
+
+ColorStruct decode_color(ColorStruct encoded, color_space space) {
+  if (space == COLOR_SPACE_SRGB) {
+    return encoded;
+  }
+  float scale = space == COLOR_SPACE_OKLAB ? OKLAB_SCALE : 1.0f;
+  LabColor lab = {encoded.r / scale, (encoded.g - LAB_OFFSET) / scale,
+                  (encoded.b - LAB_OFFSET) / scale};
+  return lab_to_srgb(lab, space);
+}
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#define DEG_TO_RAD (M_PI / 180.0)
+// hues exactly opposite each other count as 180 degrees apart, not
+// more, even when rounding in atan2 puts them a hair past it
+#define DE2000_HUE_SLACK 1e-9
+static double de2000_hue(double b, double a) {
+  if (a == 0 && b == 0) {
+    return 0;
+  }
+  double h = atan2(b, a);
+  return h < 0 ? h + 2 * M_PI : h;
+}
+
+float delta_e_2000(LabColor x, LabColor y) {
+  double c_mean = (hypot(x.a, x.b) + hypot(y.a, y.b)) / 2;
+  double c7 = de2000_pow7(c_mean);
+  double g = 0.5 * (1 - sqrt(c7 / (c7 + DE2000_POW25_7)));
+  double a1 = (1 + g) * x.a, a2 = (1 + g) * y.a;
+  double c1 = hypot(a1, x.b), c2 = hypot(a2, y.b);
+  double h1 = de2000_hue(x.b, a1), h2 = de2000_hue(y.b, a2);
+
+  double dh = 0;
+  double h_mean = h1 + h2;
+  if (c1 * c2 != 0) {
+    dh = h2 - h1;
+    if (dh > M_PI + DE2000_HUE_SLACK) {
+      dh -= 2 * M_PI;
+    } else if (dh < -M_PI - DE2000_HUE_SLACK) {
+      dh += 2 * M_PI;
+    }
+    if (fabs(h1 - h2) > M_PI + DE2000_HUE_SLACK) {
+      h_mean += h_mean < 2 * M_PI ? 2 * M_PI : -2 * M_PI;
+    }
+    h_mean /= 2;
+  }
+  double dl = y.l - x.l;
+  double dc = c2 - c1;
+  double dhh = 2 * sqrt(c1 * c2) * sin(dh / 2);
+
+  double l50 = (x.l + y.l) / 2 - 50;
+  l50 *= l50;
+  double cp_mean = (c1 + c2) / 2;
+  double t = 1 - 0.17 * cos(h_mean - 30 * DEG_TO_RAD) +
+             0.24 * cos(2 * h_mean) + 0.32 * cos(3 * h_mean + 6 * DEG_TO_RAD) -
+             0.20 * cos(4 * h_mean - 63 * DEG_TO_RAD);
+  double hue_offset = (h_mean / DEG_TO_RAD - 275) / 25;
+  double d_theta = 30 * DEG_TO_RAD * exp(-hue_offset * hue_offset);
+  double cp7 = de2000_pow7(cp_mean);
+  double rc = 2 * sqrt(cp7 / (cp7 + DE2000_POW25_7));
+  double sl = 1 + 0.015 * l50 / sqrt(20 + l50);
+  double sc = 1 + 0.045 * cp_mean;
+  double sh = 1 + 0.015 * cp_mean * t;
+  double rt = -sin(2 * d_theta) * rc;
+
+  double tl = dl / sl, tc = dc / sc, th = dhh / sh;
+  return sqrt(tl * tl + tc * tc + th * th + rt * tc * th);
+}
+#endif
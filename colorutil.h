@@ -1,3 +1,5 @@
+#include "extract.h"
+#include "remap.h"
 #include <raylib.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -16,28 +18,106 @@ typedef struct {
   char text[50];
 } particle;
 
+// sampling state kept between calls so it can run a slice at a time
+typedef struct {
+  sample_sequence sequence;
+  uint64_t (*sums)[3]; // channel sums per voxel, for its mean color
+  Color *chunk;        // samples read ahead of the histogram
+  size_t chunk_first, chunk_cnt, chunk_size;
+  size_t samples, singletons, color_cnt;
+  uint32_t quant_bits;
+  uint64_t elapsed_ms; // summed over slices
+  sample_stop_reason stop_reason;
+  bool done;
+} color_sampler;
+
 struct image_info {
-  size_t color_cnt;
+  extract_mode mode;
+  sample_options sampling;
+  sample_report sample_stats;
+  uint32_t quant_bits; // bits per channel of the color grid, 8 is exact
+  color_estimate estimate;
+  extract_plan plan; // mode and grid the current image was extracted with
+  size_t color_cnt;    // colors, or occupied voxels when quantized
+  size_t color_cap;
+  size_t draw_cnt; // colors given a sphere, capped at MAX_COLORS
   size_t num_pixels;
   Image *target_image;
   Texture2D *target_texture;
-  Matrix **transform_list;
+  // one per drawn color, rgb places its sphere in the cube and a is the
+  // sphere's scale. the vertex shader mirrors them into the quadrants
+  Color *instances;
+  unsigned int instance_buffer; // on the gpu, 0 until first drawn
+  size_t instance_buffer_cnt;   // instances the buffer has room for
+  bool instances_changed;
   Color *color_list;
-  uint8_t *drawn_pixel_map;
+  uint32_t *color_counts;  // pixels (or samples) per entry of color_list
+  uint32_t *color_hist;    // scratch indexed by color key, zero between uses
+  uint64_t counted_pixels; // sum of color_counts
+  uint64_t *drawn_pixel_map;
   Color *palette;
+  size_t palette_size; // colors asked for, palette_len is what was made
   const char **palette_color_names;
   size_t palette_len;
+  bool measure_quality;   // remap the image after every palette
+  dither_method dither;   // used for the remap and for export
+  bool has_metrics;
+  remap_metrics metrics; // remapped image against the original
+  bool progressive;      // sample a slice per frame, refreshing the palette
+  uint32_t refresh_ms;   // time between progressive palette refreshes
+  color_sampler sampler;
+  bool sampling_in_progress;
+  uint64_t refresh_start_ms;
   particle copy_particles[NUM_PARTICLES];
 };
 
 void Draw_Image_In_Region(Texture2D tex, Rectangle region);
 
-bool color_in_list(Color cur_color, uint8_t *drawn_pixel_map);
-
 int populate_color_list(Image target_image, Color *color_list,
-                        uint8_t *drawn_pixel_map);
+                        uint32_t *color_counts, uint32_t *color_hist,
+                        uint32_t quant_bits, const sample_options *options,
+                        sample_report *report);
+
+void sampler_start(color_sampler *sampler, Image image,
+                   const sample_options *options, uint32_t quant_bits);
+
+// samples until the stopping rules are met or slice_ms runs out, 0 is
+// no limit. returns true once sampling is done
+bool sampler_run(color_sampler *sampler, Image image, uint32_t *color_counts,
+                 uint32_t *color_hist, const sample_options *options,
+                 uint32_t slice_ms);
+
+// writes the mean color of every voxel seen so far into color_list
+void sampler_snapshot(const color_sampler *sampler, Color *color_list,
+                      const uint32_t *color_counts);
+
+// fills the report and color list, clears the histogram and frees the
+// sampler's buffers. returns the number of colors
+size_t sampler_finish(color_sampler *sampler, Color *color_list,
+                      const uint32_t *color_counts, uint32_t *color_hist,
+                      sample_report *report);
 
-void load_transforms_from_color_list(Matrix *transform_list, Color *color_list,
-                                     int color_cnt, unsigned int quadrant);
+void pack_instance(Color *instance, Color color, uint32_t color_count,
+                   float mean_count);
 
 void process_image(struct image_info *info, Image target_image);
+
+// runs the next slice of progressive sampling, called once per frame
+void continue_processing(struct image_info *info, Image target_image);
+
+void finish_processing(struct image_info *info, Image target_image,
+                       uint64_t extraction_ms);
+
+void build_instances(struct image_info *info);
+
+// uploads the instances if they changed and draws mesh once per
+// quadrant, shader takes them through instance_loc
+void draw_color_instances(struct image_info *info, Mesh mesh, Shader shader,
+                          int instance_loc, int quadrant_loc);
+
+// remaps the image to the current palette, fills info->metrics and
+// writes an indexed png when export_path isn't NULL
+bool remap_to_palette(struct image_info *info, Image image,
+                      const char *export_path);
+
+uint64_t get_current_ms();
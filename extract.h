@@ -0,0 +1,946 @@
+#pragma once
+#include <raylib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// one bit per 24 bit rgb color, stored as 64 bit words so
+// threads can mark colors with a single atomic or
+#define COLOR_BITMAP_WORDS ((256 * 256 * 256) / 64)
+#define COLOR_BITMAP_BYTES (COLOR_BITMAP_WORDS * sizeof(uint64_t))
+// one pixel count per 24 bit rgb color, 64MB so it is only
+// allocated once something asks for counts
+#define COLOR_HIST_ENTRIES (256 * 256 * 256)
+// range of the per channel quantization grid, 8 keeps every color
+#define QUANT_MIN_BITS 3
+#define QUANT_MAX_BITS 8
+
+typedef enum {
+  EXTRACT_SAMPLED, // random samples, fast but can miss rare colors
+  EXTRACT_EXACT,   // every pixel is visited
+  EXTRACT_AUTO     // picked per image from a cardinality estimate
+} extract_mode;
+
+typedef enum {
+  SAMPLE_STOP_CONVERGED,   // estimated unseen mass fell below the threshold
+  SAMPLE_STOP_TIME_BUDGET, // ran out of time
+  SAMPLE_STOP_MAX_SAMPLES, // hit the sample cap
+  SAMPLE_STOP_MAX_COLORS,  // the color list is full
+  SAMPLE_STOP_FULL_SCAN,   // exact mode, every pixel was read
+  SAMPLE_STOP_NO_MEMORY    // the sampler's buffers couldn't be allocated
+} sample_stop_reason;
+
+typedef enum {
+  SAMPLE_UNIFORM,    // independent uniform pixels
+  SAMPLE_STRATIFIED, // one jittered sample per grid cell, coarse to fine
+  SAMPLE_BLUE_NOISE  // best candidate points repeated over the image
+} sample_pattern;
+
+typedef struct {
+  // stop once the Good-Turing estimate of the share of pixels whose
+  // color hasn't been sampled yet drops below this
+  float missing_mass;
+  uint32_t time_budget_ms; // 0 for no limit
+  size_t max_samples;
+  uint64_t seed; // sample i only depends on (seed, i)
+  sample_pattern pattern;
+} sample_options;
+
+typedef struct {
+  size_t samples;
+  float missing_mass; // estimate when sampling stopped
+  sample_stop_reason stop_reason;
+} sample_report;
+
+const char *sample_stop_reason_name(sample_stop_reason reason);
+
+// maps sample indices to pixels, built once per image so no division
+// happens per sample
+typedef struct {
+  sample_pattern pattern;
+  uint64_t seed;
+  uint32_t width, height;
+  // Lemire's rejection thresholds, 2^32 mod width and 2^32 mod height
+  uint32_t width_threshold, height_threshold;
+  // the stratified grid and the blue noise tiles are 2^levels cells
+  // on a side
+  uint32_t levels;
+} sample_sequence;
+
+// the i-th output of SplitMix64 seeded with seed, a pure function of
+// (seed, i) so any thread can compute any sample
+static inline uint64_t counter_rand(uint64_t seed, uint64_t i) {
+  uint64_t z = seed + (i + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+// Lemire's multiply shift, bits is redrawn in the rare case the
+// product lands in the biased low range
+static inline uint32_t bounded_rand(uint64_t *bits, uint32_t range,
+                                    uint32_t threshold) {
+  for (;;) {
+    uint64_t product = (uint64_t)(uint32_t)*bits * range;
+    if ((uint32_t)product >= threshold) {
+      *bits >>= 32;
+      return product >> 32;
+    }
+    *bits = counter_rand(*bits, 0);
+  }
+}
+
+sample_sequence sample_sequence_init(const sample_options *options,
+                                     uint32_t width, uint32_t height);
+
+// linear pixel index of sample i
+size_t sample_pixel_index(const sample_sequence *sequence, uint64_t i);
+
+const char *sample_pattern_name(sample_pattern pattern);
+
+static inline uint32_t color_key(Color c) {
+  return (uint32_t)c.r | ((uint32_t)c.g << 8) | ((uint32_t)c.b << 16);
+}
+
+static inline Color color_from_key(uint32_t key) {
+  return (Color){key & 0xFF, (key >> 8) & 0xFF, (key >> 16) & 0xFF, 255};
+}
+
+// voxel holding c on a grid with 2^bits levels per channel, the same
+// as color_key when bits is 8
+static inline uint32_t quantized_key(Color c, uint32_t bits) {
+  uint32_t shift = 8 - bits;
+  return (uint32_t)(c.r >> shift) | ((uint32_t)(c.g >> shift) << bits) |
+         ((uint32_t)(c.b >> shift) << (2 * bits));
+}
+
+// grows color_list and color_counts together so both hold at least
+// needed entries, returns false if the allocation failed
+bool grow_color_list(Color **color_list, uint32_t **color_counts,
+                     size_t *color_cap, size_t needed);
+
+// reads the pixels of samples [first, first + count) into out across
+// the thread pool, out[j] only depends on sample first + j so the result
+// is the same for any thread count
+void read_samples(Image image, const sample_sequence *sequence, size_t first,
+                  size_t count, Color *out);
+
+// zeroes only the bitmap words holding the given colors, every bit set
+// by an extraction pass belongs to a color it returned so this leaves
+// the whole bitmap clear in time proportional to the colors found
+void clear_color_bitmap(uint64_t *bitmap, const Color *color_list,
+                        size_t color_cnt);
+
+// visits every pixel of the image across the thread pool and marks
+// it in bitmap, then writes each color present once to color_list
+// in ascending key order so the result does not depend on thread
+// timing. color_counts[i] gets the number of pixels with color i,
+// counted in per thread tables that are merged through hist.
+// the lists are grown if they can't hold every color.
+// bitmap and hist must be cleared by the caller and hist is left
+// cleared again on return, bitmap can be cleared with
+// clear_color_bitmap. compaction only walks the words the scan
+// touched unless most of the bitmap is in use
+size_t scan_unique_colors(Image image, uint64_t *bitmap, uint32_t *hist,
+                          Color **color_list, uint32_t **color_counts,
+                          size_t *color_cap);
+
+// HyperLogLog estimates of the unique colors among a strided subset
+// of an image's pixels, indexed by bits per channel so quantized grids
+// get their own estimate. hashed_low and hashed_high bound it at two
+// standard errors. they say nothing about the image as a whole, which
+// can hold many more colors in the pixels between the strides
+typedef struct {
+  size_t pixels; // pixels hashed
+  float hashed[QUANT_MAX_BITS + 1];
+  float hashed_low[QUANT_MAX_BITS + 1];
+  float hashed_high[QUANT_MAX_BITS + 1];
+} color_estimate;
+
+// hashes at most max_pixels evenly strided pixels across the thread pool
+color_estimate estimate_unique_colors(Image image, size_t max_pixels);
+
+typedef struct {
+  extract_mode mode; // never EXTRACT_AUTO
+  uint32_t quant_bits;
+} extract_plan;
+
+// resolves EXTRACT_AUTO. images up to exact_pixels are scanned exactly
+// and bigger ones sampled, and the grid is coarsened from max_bits
+// until the estimated voxel count fits in max_colors. other modes are
+// kept as they are with max_bits
+extract_plan plan_extraction(extract_mode mode, uint32_t max_bits,
+                             const color_estimate *estimate,
+                             size_t pixel_cnt, size_t exact_pixels,
+                             size_t max_colors);
+
+// merges the colors sharing a voxel of a bits per channel grid into
+// one entry, in place. each voxel keeps the count weighted mean of its
+// colors, which always lands back in the same voxel, and the sum of
+// their counts. voxels come out in order of their first color so
+// sorted input stays sorted by its first color. hist must be cleared
+// and is left cleared, returns the number of voxels
+size_t quantize_color_list(Color *color_list, uint32_t *color_counts,
+                           size_t color_cnt, uint32_t bits, uint32_t *hist);
+
+#ifdef EXTRACT_LIB_IMPLEMENTATION
+#include "parallel.h"
+#include "pixels.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// rows handed to a thread at a time, small enough to balance
+// but large enough that the atomic task counter is not hot
+#define EXACT_BAND_ROWS 32
+// pixels converted per reader call
+#define EXACT_CHUNK_PIXELS 256
+// bitmap words per compaction task
+#define COMPACT_CHUNK_WORDS 4096
+#define COMPACT_CHUNKS (COLOR_BITMAP_WORDS / COMPACT_CHUNK_WORDS)
+// below this many touched words the compaction sorts the touched
+// words instead of walking the whole bitmap
+#define SPARSE_COMPACT_WORDS (COLOR_BITMAP_WORDS / 16)
+// samples read per thread task
+#define SAMPLE_TASK_SIZE 1024
+// cell positions are 24 bit fractions so cell * width stays in 64 bits
+#define SAMPLE_FRACTION_BITS 24
+#define SAMPLE_MAX_LEVELS 12
+// points in the blue noise tile and candidates tried per point
+#define BLUE_NOISE_POINTS 1024
+#define BLUE_NOISE_CANDIDATES 16
+// HyperLogLog registers are indexed by the top bits of the hash,
+// 2^12 of them give about 1.6% standard error
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+// strided pixels hashed per thread task
+#define HLL_TASK_PIXELS 4096
+// one sketch per grid size, QUANT_MIN_BITS to QUANT_MAX_BITS
+#define HLL_GRIDS (QUANT_MAX_BITS - QUANT_MIN_BITS + 1)
+// starting slots of a per thread count table
+#define COUNT_TABLE_MIN_SLOTS 4096
+// past this the table is flushed into the shared histogram instead of
+// grown, so it stays cache sized on images with millions of colors
+#define COUNT_TABLE_MAX_SLOTS 65536
+
+const char *sample_stop_reason_name(sample_stop_reason reason) {
+  switch (reason) {
+  case SAMPLE_STOP_CONVERGED:
+    return "converged";
+  case SAMPLE_STOP_TIME_BUDGET:
+    return "time budget";
+  case SAMPLE_STOP_MAX_SAMPLES:
+    return "max samples";
+  case SAMPLE_STOP_MAX_COLORS:
+    return "max colors";
+  case SAMPLE_STOP_FULL_SCAN:
+    return "full scan";
+  case SAMPLE_STOP_NO_MEMORY:
+    return "out of memory";
+  }
+  return "unknown";
+}
+
+bool grow_color_list(Color **color_list, uint32_t **color_counts,
+                     size_t *color_cap, size_t needed) {
+  if (needed <= *color_cap) {
+    return true;
+  }
+  Color *colors = realloc(*color_list, needed * sizeof(Color));
+  if (!colors) {
+    return false;
+  }
+  *color_list = colors;
+  uint32_t *counts = realloc(*color_counts, needed * sizeof(uint32_t));
+  if (!counts) {
+    return false;
+  }
+  *color_counts = counts;
+  *color_cap = needed;
+  return true;
+}
+
+// open addressing pixel counts private to one thread, keys are
+// stored plus one so a zeroed slot is empty
+typedef struct {
+  uint32_t *keys;
+  uint32_t *counts;
+  size_t mask;
+  size_t used;
+} count_table;
+
+static inline size_t count_table_slot(const count_table *table, uint32_t key) {
+  uint32_t hash = key * 2654435761u;
+  return (hash ^ (hash >> 15)) & table->mask;
+}
+
+static void count_table_insert(count_table *table, uint32_t key,
+                               uint32_t count) {
+  size_t slot = count_table_slot(table, key);
+  while (table->keys[slot] && table->keys[slot] != key + 1) {
+    slot = (slot + 1) & table->mask;
+  }
+  if (!table->keys[slot]) {
+    table->keys[slot] = key + 1;
+    table->used++;
+  }
+  table->counts[slot] += count;
+}
+
+// false if the bigger table couldn't be allocated, the old one is
+// left as it was
+static bool count_table_grow(count_table *table) {
+  count_table old = *table;
+  size_t slots = old.keys ? (old.mask + 1) * 2 : COUNT_TABLE_MIN_SLOTS;
+  table->keys = calloc(slots, sizeof(uint32_t));
+  table->counts = calloc(slots, sizeof(uint32_t));
+  if (!table->keys || !table->counts) {
+    free(table->keys);
+    free(table->counts);
+    *table = old;
+    return false;
+  }
+  table->mask = slots - 1;
+  table->used = 0;
+  for (size_t i = 0; old.keys && i <= old.mask; i++) {
+    if (old.keys[i]) {
+      count_table_insert(table, old.keys[i] - 1, old.counts[i]);
+    }
+  }
+  free(old.keys);
+  free(old.counts);
+  return true;
+}
+
+static void count_table_flush(count_table *table, uint32_t *hist) {
+  for (size_t i = 0; table->keys && i <= table->mask; i++) {
+    if (table->keys[i]) {
+      __atomic_fetch_add(&hist[table->keys[i] - 1], table->counts[i],
+                         __ATOMIC_RELAXED);
+    }
+  }
+  if (table->keys) {
+    memset(table->keys, 0, (table->mask + 1) * sizeof(uint32_t));
+    memset(table->counts, 0, (table->mask + 1) * sizeof(uint32_t));
+  }
+  table->used = 0;
+}
+
+// false if the table had to grow and couldn't
+static inline bool count_table_add(count_table *table, uint32_t *hist,
+                                   uint32_t key, uint32_t count) {
+  // keep the load under a half so probes stay short
+  if (!table->keys || (table->used + 1) * 2 > table->mask + 1) {
+    if (table->keys && table->mask + 1 >= COUNT_TABLE_MAX_SLOTS) {
+      count_table_flush(table, hist);
+    } else if (!count_table_grow(table)) {
+      return false;
+    }
+  }
+  count_table_insert(table, key, count);
+  return true;
+}
+
+const char *sample_pattern_name(sample_pattern pattern) {
+  switch (pattern) {
+  case SAMPLE_UNIFORM:
+    return "uniform";
+  case SAMPLE_STRATIFIED:
+    return "stratified";
+  case SAMPLE_BLUE_NOISE:
+    return "bluenoise";
+  }
+  return "unknown";
+}
+
+// tile of points on the unit torus as 24 bit fractions, built once with
+// Mitchell's best candidate so every prefix of the tile is well spread
+static uint32_t blue_noise_tile[BLUE_NOISE_POINTS][2];
+static bool blue_noise_ready = false;
+
+static void build_blue_noise_tile(void) {
+  const float scale = 1.0f / (1 << SAMPLE_FRACTION_BITS);
+  for (size_t n = 0; n < BLUE_NOISE_POINTS; n++) {
+    float best_distance = -1.0f;
+    for (size_t c = 0; c < BLUE_NOISE_CANDIDATES; c++) {
+      uint64_t bits = counter_rand(0xB1E, n * BLUE_NOISE_CANDIDATES + c);
+      uint32_t x = bits & ((1 << SAMPLE_FRACTION_BITS) - 1);
+      uint32_t y = (bits >> 32) & ((1 << SAMPLE_FRACTION_BITS) - 1);
+      float nearest = 2.0f;
+      for (size_t p = 0; p < n; p++) {
+        float dx = fabsf((float)x - blue_noise_tile[p][0]) * scale;
+        float dy = fabsf((float)y - blue_noise_tile[p][1]) * scale;
+        // distances wrap so the tile repeats without seams
+        dx = dx > 0.5f ? 1.0f - dx : dx;
+        dy = dy > 0.5f ? 1.0f - dy : dy;
+        float distance = dx * dx + dy * dy;
+        if (distance < nearest) {
+          nearest = distance;
+        }
+      }
+      if (nearest > best_distance) {
+        best_distance = nearest;
+        blue_noise_tile[n][0] = x;
+        blue_noise_tile[n][1] = y;
+      }
+    }
+  }
+  blue_noise_ready = true;
+}
+
+static uint32_t reverse_bits(uint32_t value, uint32_t bit_cnt) {
+  uint32_t reversed = 0;
+  for (uint32_t i = 0; i < bit_cnt; i++) {
+    reversed = (reversed << 1) | ((value >> i) & 1);
+  }
+  return reversed;
+}
+
+// every other bit of a morton code
+static uint32_t morton_compact(uint32_t code) {
+  code &= 0x55555555;
+  code = (code | (code >> 1)) & 0x33333333;
+  code = (code | (code >> 2)) & 0x0F0F0F0F;
+  code = (code | (code >> 4)) & 0x00FF00FF;
+  code = (code | (code >> 8)) & 0x0000FFFF;
+  return code;
+}
+
+// visiting cells in bit reversed morton order means every 4^n
+// consecutive samples land in a different cell of a 2^n grid, so an
+// early stop still leaves the image evenly covered
+static void progressive_cell(uint64_t i, uint32_t levels, uint32_t *cell_x,
+                             uint32_t *cell_y) {
+  uint32_t cell_bits = 2 * levels;
+  uint32_t code = reverse_bits(i & ((1ull << cell_bits) - 1), cell_bits);
+  *cell_x = morton_compact(code);
+  *cell_y = morton_compact(code >> 1);
+}
+
+// position inside a 2^levels grid plus a 24 bit fraction of a cell,
+// scaled to the pixel range without dividing
+static inline size_t cell_to_pixel(uint32_t cell, uint32_t fraction,
+                                   uint32_t levels, uint32_t size) {
+  uint64_t position = ((uint64_t)cell << SAMPLE_FRACTION_BITS) | fraction;
+  return (position * size) >> (SAMPLE_FRACTION_BITS + levels);
+}
+
+sample_sequence sample_sequence_init(const sample_options *options,
+                                     uint32_t width, uint32_t height) {
+  sample_sequence sequence = {.pattern = options->pattern,
+                              .seed = options->seed,
+                              .width = width,
+                              .height = height,
+                              .width_threshold = (0u - width) % width,
+                              .height_threshold = (0u - height) % height};
+  // enough cells that max_samples visits each about once, tiles are
+  // sized so the whole budget visits each tile point about once
+  size_t cells = options->max_samples;
+  if (options->pattern == SAMPLE_BLUE_NOISE) {
+    cells = (cells + BLUE_NOISE_POINTS - 1) / BLUE_NOISE_POINTS;
+    if (!blue_noise_ready) {
+      build_blue_noise_tile();
+    }
+  }
+  while (sequence.levels < SAMPLE_MAX_LEVELS &&
+         (1ull << (2 * sequence.levels)) < cells) {
+    sequence.levels++;
+  }
+  return sequence;
+}
+
+size_t sample_pixel_index(const sample_sequence *sequence, uint64_t i) {
+  const uint32_t fraction_mask = (1 << SAMPLE_FRACTION_BITS) - 1;
+  uint64_t bits = counter_rand(sequence->seed, i);
+  size_t x, y;
+  switch (sequence->pattern) {
+  case SAMPLE_STRATIFIED: {
+    uint32_t cell_x, cell_y;
+    progressive_cell(i, sequence->levels, &cell_x, &cell_y);
+    x = cell_to_pixel(cell_x, bits & fraction_mask, sequence->levels,
+                      sequence->width);
+    y = cell_to_pixel(cell_y, (bits >> 32) & fraction_mask, sequence->levels,
+                      sequence->height);
+  } break;
+  case SAMPLE_BLUE_NOISE: {
+    uint64_t tile_cnt = 1ull << (2 * sequence->levels);
+    uint64_t tile = i & (tile_cnt - 1);
+    uint64_t point = i >> (2 * sequence->levels);
+    uint32_t tile_x, tile_y;
+    progressive_cell(tile, sequence->levels, &tile_x, &tile_y);
+    // each tile (and each pass over the tile) gets its own toroidal
+    // shift so tiles don't line up into a regular pattern
+    uint64_t shift = counter_rand(sequence->seed,
+                                  tile + (point / BLUE_NOISE_POINTS) * tile_cnt);
+    const uint32_t *tile_point = blue_noise_tile[point % BLUE_NOISE_POINTS];
+    x = cell_to_pixel(tile_x, (tile_point[0] + shift) & fraction_mask,
+                      sequence->levels, sequence->width);
+    y = cell_to_pixel(tile_y, (tile_point[1] + (shift >> 32)) & fraction_mask,
+                      sequence->levels, sequence->height);
+  } break;
+  default:
+    x = bounded_rand(&bits, sequence->width, sequence->width_threshold);
+    y = bounded_rand(&bits, sequence->height, sequence->height_threshold);
+    break;
+  }
+  return y * sequence->width + x;
+}
+
+typedef struct {
+  Image image;
+  pixel_reader reader;
+  const sample_sequence *sequence;
+  size_t first;
+  size_t count;
+  Color *out;
+} read_samples_ctx;
+
+static void read_samples_task(void *arg, size_t task, size_t thread) {
+  read_samples_ctx *ctx = arg;
+  size_t start = task * SAMPLE_TASK_SIZE;
+  size_t end = start + SAMPLE_TASK_SIZE;
+  if (end > ctx->count) {
+    end = ctx->count;
+  }
+  for (size_t j = start; j < end; j++) {
+    size_t index = sample_pixel_index(ctx->sequence, ctx->first + j);
+    ctx->reader(&ctx->image, index, 1, &ctx->out[j]);
+  }
+}
+
+void read_samples(Image image, const sample_sequence *sequence, size_t first,
+                  size_t count, Color *out) {
+  read_samples_ctx ctx = {.image = image,
+                          .reader = get_pixel_reader(image.format),
+                          .sequence = sequence,
+                          .first = first,
+                          .count = count,
+                          .out = out};
+  parallel_for((count + SAMPLE_TASK_SIZE - 1) / SAMPLE_TASK_SIZE,
+               read_samples_task, &ctx);
+}
+
+void clear_color_bitmap(uint64_t *bitmap, const Color *color_list,
+                        size_t color_cnt) {
+  for (size_t i = 0; i < color_cnt; i++) {
+    bitmap[color_key(color_list[i]) >> 6] = 0;
+  }
+}
+
+// returns true for the one caller that turned the word from zero to
+// non zero, which lets each word be recorded exactly once
+static inline bool bitmap_mark_atomic(uint64_t *bitmap, uint32_t key) {
+  uint64_t *word = &bitmap[key >> 6];
+  uint64_t bit = 1ull << (key & 63);
+  // most pixels repeat a color that is already marked, a plain load
+  // keeps the cache line shared instead of bouncing it between cores
+  if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) {
+    return __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) == 0;
+  }
+  return false;
+}
+
+typedef struct {
+  uint32_t *words;
+  size_t cnt;
+  size_t cap;
+} word_list;
+
+// false if the list couldn't grow, it keeps the words it had
+static bool word_list_push(word_list *list, uint32_t word) {
+  if (list->cnt == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 256;
+    uint32_t *words = realloc(list->words, cap * sizeof(uint32_t));
+    if (!words) {
+      return false;
+    }
+    list->words = words;
+    list->cap = cap;
+  }
+  list->words[list->cnt++] = word;
+  return true;
+}
+
+static int word_index_compare(const void *a, const void *b) {
+  uint32_t word1 = *(const uint32_t *)a;
+  uint32_t word2 = *(const uint32_t *)b;
+  return (word1 > word2) - (word1 < word2);
+}
+
+typedef struct {
+  Image image;
+  pixel_reader reader;
+  key_kernel kernel;
+  uint64_t *bitmap;
+  count_table tables[PARALLEL_MAX_THREADS];
+  word_list touched[PARALLEL_MAX_THREADS];
+  uint32_t *hist;
+  bool failed; // a thread ran out of memory, the scan is abandoned
+} exact_scan_ctx;
+
+static void exact_scan_band(void *arg, size_t band, size_t thread) {
+  exact_scan_ctx *ctx = arg;
+  size_t width = ctx->image.width;
+  size_t first = band * EXACT_BAND_ROWS * width;
+  size_t last = first + EXACT_BAND_ROWS * width;
+  if (last > width * ctx->image.height) {
+    last = width * ctx->image.height;
+  }
+  count_table *table = &ctx->tables[thread];
+  word_list *touched = &ctx->touched[thread];
+  Color scratch[EXACT_CHUNK_PIXELS];
+  uint32_t keys[EXACT_CHUNK_PIXELS];
+  uint32_t starts[EXACT_CHUNK_PIXELS + 1];
+  for (size_t i = first;
+       i < last && !__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED);
+       i += EXACT_CHUNK_PIXELS) {
+    size_t count = last - i < EXACT_CHUNK_PIXELS ? last - i : EXACT_CHUNK_PIXELS;
+    const Color *pixels =
+        read_pixels(&ctx->image, ctx->reader, i, count, scratch);
+    size_t key_cnt = ctx->kernel(pixels, count, keys, starts);
+    starts[key_cnt] = count;
+    for (size_t j = 0; j < key_cnt; j++) {
+      if ((bitmap_mark_atomic(ctx->bitmap, keys[j]) &&
+           !word_list_push(touched, keys[j] >> 6)) ||
+          !count_table_add(table, ctx->hist, keys[j],
+                           starts[j + 1] - starts[j])) {
+        __atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+  }
+}
+
+// folds one thread's table into the shared histogram, different
+// threads rarely hit the same color at the same time so the atomic
+// adds don't contend
+static void exact_merge_table(void *arg, size_t table_index, size_t thread) {
+  exact_scan_ctx *ctx = arg;
+  count_table *table = &ctx->tables[table_index];
+  count_table_flush(table, ctx->hist);
+  free(table->keys);
+  free(table->counts);
+}
+
+typedef struct {
+  const uint64_t *bitmap;
+  size_t chunk_offsets[COMPACT_CHUNKS];
+  uint32_t *hist;
+  Color *out;
+  uint32_t *out_counts;
+} compact_ctx;
+
+static void compact_count_chunk(void *arg, size_t chunk, size_t thread) {
+  compact_ctx *ctx = arg;
+  const uint64_t *words = ctx->bitmap + chunk * COMPACT_CHUNK_WORDS;
+  size_t count = 0;
+  for (size_t i = 0; i < COMPACT_CHUNK_WORDS; i++) {
+    count += __builtin_popcountll(words[i]);
+  }
+  ctx->chunk_offsets[chunk] = count;
+}
+
+static size_t compact_word(uint64_t word, size_t word_index, uint32_t *hist,
+                           Color *out, uint32_t *out_counts) {
+  size_t written = 0;
+  while (word) {
+    uint32_t key = word_index * 64 + __builtin_ctzll(word);
+    out[written] = color_from_key(key);
+    // take the count and leave the entry zeroed for the next image
+    out_counts[written++] = hist[key];
+    hist[key] = 0;
+    word &= word - 1;
+  }
+  return written;
+}
+
+static void compact_write_chunk(void *arg, size_t chunk, size_t thread) {
+  compact_ctx *ctx = arg;
+  size_t first_word = chunk * COMPACT_CHUNK_WORDS;
+  size_t offset = ctx->chunk_offsets[chunk];
+  for (size_t i = first_word; i < first_word + COMPACT_CHUNK_WORDS; i++) {
+    offset += compact_word(ctx->bitmap[i], i, ctx->hist, ctx->out + offset,
+                           ctx->out_counts + offset);
+  }
+}
+
+// small images only touch a few words, sorting those keeps the
+// compaction cost proportional to the colors found instead of the
+// size of the bitmap
+static size_t compact_sparse(const uint64_t *bitmap, uint32_t *hist,
+                             uint32_t *words, size_t word_cnt,
+                             Color **color_list, uint32_t **color_counts,
+                             size_t *color_cap) {
+  qsort(words, word_cnt, sizeof(uint32_t), word_index_compare);
+  size_t color_cnt = 0;
+  for (size_t i = 0; i < word_cnt; i++) {
+    color_cnt += __builtin_popcountll(bitmap[words[i]]);
+  }
+  if (!grow_color_list(color_list, color_counts, color_cap, color_cnt)) {
+    return SIZE_MAX;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < word_cnt; i++) {
+    offset += compact_word(bitmap[words[i]], words[i], hist,
+                           *color_list + offset, *color_counts + offset);
+  }
+  return color_cnt;
+}
+
+size_t scan_unique_colors(Image image, uint64_t *bitmap, uint32_t *hist,
+                          Color **color_list, uint32_t **color_counts,
+                          size_t *color_cap) {
+  exact_scan_ctx *scan = calloc(1, sizeof(exact_scan_ctx));
+  if (!scan) {
+    printf("unable to allocate the scan\n");
+    return 0;
+  }
+  scan->image = image;
+  scan->reader = get_pixel_reader(image.format);
+  scan->kernel = get_key_kernel();
+  scan->bitmap = bitmap;
+  scan->hist = hist;
+  size_t bands = (image.height + EXACT_BAND_ROWS - 1) / EXACT_BAND_ROWS;
+  parallel_for(bands, exact_scan_band, scan);
+  parallel_for(PARALLEL_MAX_THREADS, exact_merge_table, scan);
+  bool failed = scan->failed;
+
+  // every word went from zero to non zero in exactly one thread
+  size_t touched_cnt = 0;
+  for (size_t i = 0; i < PARALLEL_MAX_THREADS; i++) {
+    touched_cnt += scan->touched[i].cnt;
+  }
+  uint32_t *touched = NULL;
+  if (!failed && touched_cnt <= SPARSE_COMPACT_WORDS) {
+    // without the list the dense compaction still finds every color
+    touched = malloc((touched_cnt + 1) * sizeof(uint32_t));
+    size_t offset = 0;
+    for (size_t i = 0; touched && i < PARALLEL_MAX_THREADS; i++) {
+      memcpy(touched + offset, scan->touched[i].words,
+             scan->touched[i].cnt * sizeof(uint32_t));
+      offset += scan->touched[i].cnt;
+    }
+  }
+  for (size_t i = 0; i < PARALLEL_MAX_THREADS; i++) {
+    free(scan->touched[i].words);
+  }
+  free(scan);
+
+  size_t color_cnt;
+  if (failed) {
+    color_cnt = SIZE_MAX;
+  } else if (touched) {
+    color_cnt = compact_sparse(bitmap, hist, touched, touched_cnt, color_list,
+                               color_counts, color_cap);
+    free(touched);
+  } else {
+    // count per chunk, then turn the counts into output offsets
+    compact_ctx compact = {.bitmap = bitmap, .hist = hist};
+    parallel_for(COMPACT_CHUNKS, compact_count_chunk, &compact);
+    color_cnt = 0;
+    for (size_t i = 0; i < COMPACT_CHUNKS; i++) {
+      size_t chunk_cnt = compact.chunk_offsets[i];
+      compact.chunk_offsets[i] = color_cnt;
+      color_cnt += chunk_cnt;
+    }
+    if (grow_color_list(color_list, color_counts, color_cap, color_cnt)) {
+      compact.out = *color_list;
+      compact.out_counts = *color_counts;
+      parallel_for(COMPACT_CHUNKS, compact_write_chunk, &compact);
+    } else {
+      color_cnt = SIZE_MAX;
+    }
+  }
+
+  if (color_cnt == SIZE_MAX) {
+    // nothing was returned so nothing could clear these later
+    printf("unable to %s\n", failed ? "count colors" : "grow color list");
+    memset(bitmap, 0, COLOR_BITMAP_BYTES);
+    memset(hist, 0, COLOR_HIST_ENTRIES * sizeof(uint32_t));
+    return 0;
+  }
+  return color_cnt;
+}
+
+typedef struct {
+  Image image;
+  pixel_reader reader;
+  size_t stride;
+  size_t pixels;
+  // HLL_GRIDS sketches for every thread, merged afterwards
+  uint8_t *registers;
+} hll_ctx;
+
+static uint8_t *hll_sketch(const hll_ctx *ctx, size_t thread, uint32_t bits) {
+  return ctx->registers +
+         (thread * HLL_GRIDS + bits - QUANT_MIN_BITS) * HLL_REGISTERS;
+}
+
+static void hll_task(void *arg, size_t task, size_t thread) {
+  hll_ctx *ctx = arg;
+  size_t first = task * HLL_TASK_PIXELS;
+  size_t last = first + HLL_TASK_PIXELS;
+  if (last > ctx->pixels) {
+    last = ctx->pixels;
+  }
+  uint32_t previous = UINT32_MAX;
+  for (size_t i = first; i < last; i++) {
+    Color color;
+    ctx->reader(&ctx->image, i * ctx->stride, 1, &color);
+    uint32_t key = color_key(color);
+    // repeats can't change a register, flat regions skip the hashing
+    if (key == previous) {
+      continue;
+    }
+    previous = key;
+    for (uint32_t bits = QUANT_MIN_BITS; bits <= QUANT_MAX_BITS; bits++) {
+      uint64_t hash = counter_rand(bits, quantized_key(color, bits));
+      uint32_t index = hash >> (64 - HLL_PRECISION);
+      // position of the first set bit in what is left of the hash
+      uint64_t rest = hash << HLL_PRECISION;
+      uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_PRECISION + 1;
+      uint8_t *reg = &hll_sketch(ctx, thread, bits)[index];
+      if (rank > *reg) {
+        *reg = rank;
+      }
+    }
+  }
+}
+
+static size_t gcd_size(size_t a, size_t b) {
+  while (b) {
+    size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+color_estimate estimate_unique_colors(Image image, size_t max_pixels) {
+  color_estimate result = {0};
+  size_t pixel_cnt = (size_t)image.width * image.height;
+  if (pixel_cnt == 0 || max_pixels == 0) {
+    return result;
+  }
+  size_t stride =
+      max_pixels >= pixel_cnt ? 1 : (pixel_cnt + max_pixels - 1) / max_pixels;
+  // a stride sharing a factor with the width keeps landing in the same
+  // columns, step up to one that walks across all of them
+  while (stride > 1 && gcd_size(stride, image.width) != 1) {
+    stride++;
+  }
+
+  size_t threads = parallel_thread_count();
+  hll_ctx ctx = {.image = image,
+                 .reader = get_pixel_reader(image.format),
+                 .stride = stride,
+                 .pixels = (pixel_cnt + stride - 1) / stride,
+                 .registers = calloc(threads * HLL_GRIDS, HLL_REGISTERS)};
+  if (!ctx.registers) {
+    printf("unable to allocate the color estimate\n");
+    return result;
+  }
+  parallel_for((ctx.pixels + HLL_TASK_PIXELS - 1) / HLL_TASK_PIXELS, hll_task,
+               &ctx);
+  result.pixels = ctx.pixels;
+
+  const double m = HLL_REGISTERS;
+  const double alpha = 0.7213 / (1 + 1.079 / m);
+  const double error = 1.04 / sqrt(m);
+  for (uint32_t bits = QUANT_MIN_BITS; bits <= QUANT_MAX_BITS; bits++) {
+    double sum = 0;
+    size_t zeros = 0;
+    for (size_t r = 0; r < HLL_REGISTERS; r++) {
+      uint8_t reg = 0;
+      for (size_t t = 0; t < threads; t++) {
+        const uint8_t *sketch = hll_sketch(&ctx, t, bits);
+        reg = sketch[r] > reg ? sketch[r] : reg;
+      }
+      sum += ldexp(1.0, -reg);
+      zeros += reg == 0;
+    }
+    double estimate = alpha * m * m / sum;
+    // linear counting is more accurate while many registers are empty
+    if (estimate <= 2.5 * m && zeros) {
+      estimate = m * log(m / zeros);
+    }
+    double voxels = ldexp(1.0, 3 * bits);
+    double high = estimate * (1 + 2 * error);
+    result.hashed[bits] = fmin(estimate, voxels);
+    result.hashed_low[bits] = estimate * (1 - 2 * error);
+    result.hashed_high[bits] = fmin(high, voxels);
+  }
+  free(ctx.registers);
+  return result;
+}
+
+extract_plan plan_extraction(extract_mode mode, uint32_t max_bits,
+                             const color_estimate *estimate,
+                             size_t pixel_cnt, size_t exact_pixels,
+                             size_t max_colors) {
+  extract_plan plan = {.mode = mode, .quant_bits = max_bits};
+  if (mode != EXTRACT_AUTO) {
+    return plan;
+  }
+  // a full scan of a small image costs about as much as sampling it
+  // and gets every count right
+  plan.mode = pixel_cnt <= exact_pixels ? EXTRACT_EXACT : EXTRACT_SAMPLED;
+  // the upper bound has to fit so the cloud isn't cut down to a
+  // strided subset, the coarsest grid is used if nothing fits. the
+  // bound only covers the hashed pixels and the image can hold more
+  // colors, but they are far more than max_colors so an image that
+  // overflows the cloud overflows it here too
+  while (plan.quant_bits > QUANT_MIN_BITS &&
+         estimate->hashed_high[plan.quant_bits] > max_colors) {
+    plan.quant_bits--;
+  }
+  return plan;
+}
+
+size_t quantize_color_list(Color *color_list, uint32_t *color_counts,
+                           size_t color_cnt, uint32_t bits, uint32_t *hist) {
+  if (bits >= 8) {
+    return color_cnt;
+  }
+  size_t voxel_cap = (size_t)1 << (3 * bits);
+  if (voxel_cap > color_cnt) {
+    voxel_cap = color_cnt;
+  }
+  uint64_t(*sums)[3] = malloc(voxel_cap * sizeof(*sums));
+  if (!sums) {
+    printf("unable to allocate voxel sums\n");
+    return color_cnt;
+  }
+  // hist maps a voxel to its output slot plus one. slots are handed
+  // out in order so slot <= i, entry i is read before it is overwritten
+  size_t voxel_cnt = 0;
+  for (size_t i = 0; i < color_cnt; i++) {
+    Color color = color_list[i];
+    uint32_t count = color_counts[i];
+    uint32_t key = quantized_key(color, bits);
+    uint32_t slot = hist[key];
+    if (!slot) {
+      slot = hist[key] = ++voxel_cnt;
+      sums[slot - 1][0] = sums[slot - 1][1] = sums[slot - 1][2] = 0;
+      color_counts[slot - 1] = 0;
+    }
+    sums[slot - 1][0] += (uint64_t)color.r * count;
+    sums[slot - 1][1] += (uint64_t)color.g * count;
+    sums[slot - 1][2] += (uint64_t)color.b * count;
+    color_counts[slot - 1] += count;
+  }
+  for (size_t i = 0; i < voxel_cnt; i++) {
+    uint64_t count = color_counts[i] ? color_counts[i] : 1;
+    // rounding can't leave the voxel, the mean sits between the
+    // smallest and largest channel values in it
+    Color mean = {(sums[i][0] + count / 2) / count,
+                  (sums[i][1] + count / 2) / count,
+                  (sums[i][2] + count / 2) / count, 255};
+    color_list[i] = mean;
+    hist[quantized_key(mean, bits)] = 0;
+  }
+  free(sums);
+  return voxel_cnt;
+}
+#endif
@@ -1,9 +1,23 @@
+#define BENCH_LIB_IMPLEMENTATION
 #define COLOR_LIB_IMPLEMENTATION
+#define COLORSPACE_LIB_IMPLEMENTATION
+#define EXTRACT_LIB_IMPLEMENTATION
+#define PARALLEL_LIB_IMPLEMENTATION
+#define PIXEL_LIB_IMPLEMENTATION
+#define REMAP_LIB_IMPLEMENTATION
+#define TIMER_LIB_IMPLEMENTATION
+#include "bench.h"
 #include "colors.h"
 #include "colorutil.h"
+#include "extract.h"
+#include "parallel.h"
+#include "pixels.h"
+#include "remap.h"
 #include "rlgl.h"
+#include "timer.h"
 #include <raylib.h>
 #include <raymath.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,25 +28,51 @@
 #include <emscripten.h>
 #endif
 
-#define MAX_SAMPLES 100000
+#define MAX_SAMPLES 1000000
+// adaptive sampling never stops before this many samples and
+// re-checks its stopping rules at this interval
+#define MIN_SAMPLES 1024
+#define SAMPLE_CHECK_INTERVAL 256
+// samples are read ahead in chunks that double up to this size, small
+// first chunks keep flat images from reading far past where they stop
+#define SAMPLE_CHUNK_MAX 65536
 #define MAX_COLORS 40000
+// progressive sampling reads for at most this long each frame and
+// polishes the preview palette with a few cheap k-means passes
+#define PROGRESSIVE_SLICE_MS 8
+#define DEFAULT_REFRESH_MS 100
+#define PROGRESSIVE_KMEANS_ITERATIONS 4
+#define PROGRESSIVE_KMEANS_TOLERANCE 0.5f
+// auto mode scans images up to this size exactly and samples bigger
+// ones, the estimate that sizes the grid hashes at most HLL_PIXELS
+#define AUTO_EXACT_PIXELS (2048 * 2048)
+#define HLL_PIXELS (1 << 18)
 #define CUBE_SIDE_LEN 0.05f
+// sphere scale range packed into an instance's alpha, the instancing
+// shaders map it back with the same bounds
+#define INSTANCE_MIN_SCALE 0.5f
+#define INSTANCE_MAX_SCALE 3.0f
 
 #define SCREEN_WIDTH 800
 #define SCREEN_HEIGHT 600
 
-#define PALETTE_SIZE 16
+#define DEFAULT_PALETTE_SIZE 16
+#define MAX_PALETTE_SIZE 256
+// narrowest palette swatch before the strip wraps into another row
+#define MIN_SWATCH_WIDTH 12
+// name dictionaries loaded with --dictionary, D cycles through them
+// and the built-in names
+#define MAX_DICTIONARIES 8
 
 Image target_image;
 Texture2D target_image_tex;
 struct image_info info = {0};
+ColorDictionary *dictionaries[MAX_DICTIONARIES];
+size_t dictionary_cnt;
+size_t active_dictionary_slot; // 0 is the built-in names
 
 void UpdateTexturesFromFilename(char *filename) {
   // TODO: add free command
-  for (int i = 0; i < 4; i++) {
-    free(info.transform_list[i]);
-  }
-  free(info.transform_list);
   UnloadTexture(target_image_tex);
   UnloadImage(target_image);
   Texture texture = LoadTexture(filename);
@@ -70,49 +110,152 @@ void Draw_Image_In_Region(Texture2D tex, Rectangle region) {
   DrawTexturePro(tex, src, dest, (Vector2){0, 0}, 0, WHITE);
 }
 
-bool color_in_list(Color cur_color, uint8_t *drawn_pixel_map) {
-  // use cur color to see what to check
-  unsigned int index = (cur_color.r / 255.0f) + (cur_color.g / 255.0f) * (256) +
-                       (cur_color.b / 255.0f) * (256 * 256);
-  unsigned int byte_index = index / (8);
-  unsigned int cur_bitfield = drawn_pixel_map[byte_index];
-  bool present = (cur_bitfield >> (index - (byte_index * 8))) & 0x1;
-  if (!present) {
-    // need to set in pixel map
-    drawn_pixel_map[byte_index] |= 1 << (index - (byte_index * 8));
-  }
-  return present;
+void sampler_start(color_sampler *sampler, Image image,
+                   const sample_options *options, uint32_t quant_bits) {
+  *sampler = (color_sampler){
+      .sequence = sample_sequence_init(options, image.width, image.height),
+      .sums = malloc(MAX_COLORS * sizeof(*sampler->sums)),
+      .chunk = malloc(SAMPLE_CHUNK_MAX * sizeof(Color)),
+      .chunk_size = MIN_SAMPLES,
+      .quant_bits = quant_bits,
+      .stop_reason = SAMPLE_STOP_MAX_SAMPLES};
+  if (!sampler->sums || !sampler->chunk) {
+    // done before the first sample, finishing yields no colors
+    printf("unable to allocate the sampler\n");
+    free(sampler->sums);
+    free(sampler->chunk);
+    sampler->sums = NULL;
+    sampler->chunk = NULL;
+    sampler->stop_reason = SAMPLE_STOP_NO_MEMORY;
+    sampler->done = true;
+  }
 }
 
-int populate_color_list(Image target_image, Color *color_list,
-                        uint8_t *drawn_pixel_map) {
-  int color_cnt = 0;
-  for (int i = 0; i < MAX_SAMPLES; i++) {
-    if (color_cnt > MAX_COLORS) {
+bool sampler_run(color_sampler *sampler, Image image, uint32_t *color_counts,
+                 uint32_t *color_hist, const sample_options *options,
+                 uint32_t slice_ms) {
+  uint64_t start_ms = get_current_ms();
+  uint64_t(*sums)[3] = sampler->sums;
+  for (; !sampler->done; sampler->samples++) {
+    size_t samples = sampler->samples;
+    if (samples >= options->max_samples) {
+      sampler->done = true;
+      break;
+    }
+    if (sampler->color_cnt >= MAX_COLORS) {
+      sampler->stop_reason = SAMPLE_STOP_MAX_COLORS;
+      sampler->done = true;
       break;
     }
-    Vector2 coord = {rand() % target_image.width, rand() % target_image.height};
-    Color color = GetImageColor(target_image, coord.x, coord.y);
-    if (!color_in_list(color, drawn_pixel_map)) {
-      color_list[color_cnt++] = color;
+    if (samples % SAMPLE_CHECK_INTERVAL == 0) {
+      uint64_t slice_elapsed = get_current_ms() - start_ms;
+      if (samples >= MIN_SAMPLES) {
+        // Good-Turing: the chance the next sample is a color we haven't
+        // seen is about the share of samples that were singletons, flat
+        // images run out of singletons quickly and stop early
+        if ((float)sampler->singletons / samples < options->missing_mass) {
+          sampler->stop_reason = SAMPLE_STOP_CONVERGED;
+          sampler->done = true;
+          break;
+        }
+        if (options->time_budget_ms &&
+            sampler->elapsed_ms + slice_elapsed >= options->time_budget_ms) {
+          sampler->stop_reason = SAMPLE_STOP_TIME_BUDGET;
+          sampler->done = true;
+          break;
+        }
+      }
+      if (slice_ms && slice_elapsed >= slice_ms) {
+        break;
+      }
+    }
+    if (samples == sampler->chunk_first + sampler->chunk_cnt) {
+      // the chunk is read in parallel but consumed in order, so the
+      // colors found are the same for any thread count
+      sampler->chunk_first = samples;
+      sampler->chunk_cnt = options->max_samples - samples;
+      if (sampler->chunk_cnt > sampler->chunk_size) {
+        sampler->chunk_cnt = sampler->chunk_size;
+      }
+      read_samples(image, &sampler->sequence, sampler->chunk_first,
+                   sampler->chunk_cnt, sampler->chunk);
+      if (sampler->chunk_size < SAMPLE_CHUNK_MAX) {
+        sampler->chunk_size *= 2;
+      }
     }
+    Color color = sampler->chunk[samples - sampler->chunk_first];
+    // the histogram maps each voxel to its slot in the list plus one
+    uint32_t key = quantized_key(color, sampler->quant_bits);
+    uint32_t slot = color_hist[key];
+    if (!slot) {
+      slot = color_hist[key] = ++sampler->color_cnt;
+      color_counts[slot - 1] = 0;
+      sums[slot - 1][0] = sums[slot - 1][1] = sums[slot - 1][2] = 0;
+    }
+    uint32_t seen = ++color_counts[slot - 1];
+    if (seen == 1) {
+      sampler->singletons++;
+    } else if (seen == 2) {
+      sampler->singletons--;
+    }
+    sums[slot - 1][0] += color.r;
+    sums[slot - 1][1] += color.g;
+    sums[slot - 1][2] += color.b;
   }
-  return color_cnt;
+  sampler->elapsed_ms += get_current_ms() - start_ms;
+  return sampler->done;
 }
 
-void load_transforms_from_color_list(Matrix *transform_list, Color *color_list,
-                                     int color_cnt, unsigned int quadrant) {
-  Vector3 quadrant_lookup[4] = {(Vector3){5, 5, 5}, (Vector3){-5, 5, -5},
-                                (Vector3){5, 5, -5}, (Vector3){-5, 5, 5}};
-  for (int i = 0; i < color_cnt; i++) {
-    Color cur_color = color_list[i];
-    Vector3 pos;
-    pos.x = ((double)cur_color.r / 255) * quadrant_lookup[quadrant].x;
-    pos.y = ((double)cur_color.g / 255) * quadrant_lookup[quadrant].y;
-    pos.z = ((double)cur_color.b / 255) * quadrant_lookup[quadrant].z;
+void sampler_snapshot(const color_sampler *sampler, Color *color_list,
+                      const uint32_t *color_counts) {
+  for (size_t i = 0; i < sampler->color_cnt; i++) {
+    uint32_t count = color_counts[i];
+    color_list[i] = (Color){(sampler->sums[i][0] + count / 2) / count,
+                            (sampler->sums[i][1] + count / 2) / count,
+                            (sampler->sums[i][2] + count / 2) / count, 255};
+  }
+}
 
-    transform_list[i] = MatrixTranslate(pos.x, pos.y, pos.z);
+size_t sampler_finish(color_sampler *sampler, Color *color_list,
+                      const uint32_t *color_counts, uint32_t *color_hist,
+                      sample_report *report) {
+  report->samples = sampler->samples;
+  report->missing_mass =
+      sampler->samples ? (float)sampler->singletons / sampler->samples : 1.0f;
+  report->stop_reason = sampler->stop_reason;
+  // each voxel is drawn at its mean color, which is still inside the
+  // voxel so its key clears the histogram for the next image
+  sampler_snapshot(sampler, color_list, color_counts);
+  for (size_t i = 0; i < sampler->color_cnt; i++) {
+    color_hist[quantized_key(color_list[i], sampler->quant_bits)] = 0;
   }
+  free(sampler->chunk);
+  free(sampler->sums);
+  sampler->chunk = NULL;
+  sampler->sums = NULL;
+  return sampler->color_cnt;
+}
+
+int populate_color_list(Image target_image, Color *color_list,
+                        uint32_t *color_counts, uint32_t *color_hist,
+                        uint32_t quant_bits, const sample_options *options,
+                        sample_report *report) {
+  color_sampler sampler;
+  sampler_start(&sampler, target_image, options, quant_bits);
+  sampler_run(&sampler, target_image, color_counts, color_hist, options, 0);
+  return sampler_finish(&sampler, color_list, color_counts, color_hist,
+                        report);
+}
+
+void pack_instance(Color *instance, Color color, uint32_t color_count,
+                   float mean_count) {
+  // sphere volume follows how common the color is compared to
+  // the average color, clamped so rare colors stay visible
+  float scale = cbrtf(color_count / mean_count);
+  scale = Clamp(scale, INSTANCE_MIN_SCALE, INSTANCE_MAX_SCALE);
+  *instance = color;
+  instance->a = roundf((scale - INSTANCE_MIN_SCALE) /
+                       (INSTANCE_MAX_SCALE - INSTANCE_MIN_SCALE) * 255);
 }
 
 void process_image(struct image_info *info, Image target_image) {
@@ -120,56 +263,320 @@ void process_image(struct image_info *info, Image target_image) {
   // struct image_info info = {0};
   //  info.drawn_pixel_map = calloc(1, (256 * 256 * 256) / (8 *
   //  sizeof(uint8_t)));
-  memset(info->drawn_pixel_map, 0, (256 * 256 * 256) / (8 * sizeof(uint8_t)));
-  memset(info->color_list, 0, sizeof(Color) * MAX_COLORS);
-  memset(info->palette, 0, sizeof(Color) * PALETTE_SIZE);
-  memset(info->palette_color_names, 0, sizeof(char *) * PALETTE_SIZE);
+  memset(info->palette, 0, sizeof(Color) * info->palette_size);
+  memset(info->palette_color_names, 0, sizeof(char *) * info->palette_size);
   info->num_pixels = target_image.width * target_image.height;
   // info.color_list = malloc(MAX_COLORS * sizeof(Color));
   // info.palette = malloc(PALETTE_SIZE * sizeof(Color));
 
-  info->color_cnt = populate_color_list(target_image, info->color_list,
-                                        info->drawn_pixel_map);
+  // the histogram is only needed once an image is processed, calloc
+  // hands back untouched zero pages so this stays cheap
+  if (!info->color_hist) {
+    info->color_hist = calloc(COLOR_HIST_ENTRIES, sizeof(uint32_t));
+  }
+  // a new image replaces one still being sampled, finishing the old
+  // sampler hands the histogram back clean
+  if (info->sampling_in_progress) {
+    sampler_finish(&info->sampler, info->color_list, info->color_counts,
+                   info->color_hist, &info->sample_stats);
+    info->sampling_in_progress = false;
+  }
+
+  uint64_t start_ms = get_current_ms();
+  info->estimate = estimate_unique_colors(target_image, HLL_PIXELS);
+  info->plan = plan_extraction(info->mode, info->quant_bits, &info->estimate,
+                               info->num_pixels, AUTO_EXACT_PIXELS, MAX_COLORS);
+  printf("estimated %.0f unique colors (%.0f to %.0f) among %zu hashed "
+         "pixels in %" PRIu64 "ms, using %s extraction on a %u bit grid\n",
+         info->estimate.hashed[QUANT_MAX_BITS],
+         info->estimate.hashed_low[QUANT_MAX_BITS],
+         info->estimate.hashed_high[QUANT_MAX_BITS], info->estimate.pixels,
+         get_current_ms() - start_ms,
+         info->plan.mode == EXTRACT_EXACT ? "exact" : "sampled",
+         info->plan.quant_bits);
+
+  start_ms = get_current_ms();
+  if (info->plan.mode == EXTRACT_EXACT) {
+    info->color_cnt = scan_unique_colors(
+        target_image, info->drawn_pixel_map, info->color_hist,
+        &info->color_list, &info->color_counts, &info->color_cap);
+    // only the words this scan set need zeroing, which is much
+    // cheaper than clearing all 2MB for small images. done before
+    // quantizing since that replaces the colors holding the bits
+    clear_color_bitmap(info->drawn_pixel_map, info->color_list,
+                       info->color_cnt);
+    info->color_cnt =
+        quantize_color_list(info->color_list, info->color_counts,
+                            info->color_cnt, info->plan.quant_bits,
+                            info->color_hist);
+    info->sample_stats = (sample_report){.samples = info->num_pixels,
+                                         .missing_mass = 0,
+                                         .stop_reason = SAMPLE_STOP_FULL_SCAN};
+  } else if (info->progressive) {
+    // the first slice runs now so the first frame already has a palette
+    sampler_start(&info->sampler, target_image, &info->sampling,
+                  info->plan.quant_bits);
+    info->sampling_in_progress = true;
+    info->palette_len = 0;
+    continue_processing(info, target_image);
+    return;
+  } else {
+    info->color_cnt = populate_color_list(
+        target_image, info->color_list, info->color_counts, info->color_hist,
+        info->plan.quant_bits, &info->sampling, &info->sample_stats);
+  }
+  finish_processing(info, target_image, get_current_ms() - start_ms);
+}
 
-  // generate the palette from the randomly sampled colors
-  info->palette_len = gen_median_palette_from_color_list(
-      (ColorStruct *)&info->palette[0], PALETTE_SIZE,
-      (ColorStruct *)&info->color_list[0], info->color_cnt);
-  for (int i = 0; i < info->palette_len; i++) {
-    info->palette_color_names[i] = find_closest_color(
-        info->palette[i].r, info->palette[i].g, info->palette[i].b);
+void continue_processing(struct image_info *info, Image target_image) {
+  if (!info->sampling_in_progress) {
+    return;
+  }
+  if (sampler_run(&info->sampler, target_image, info->color_counts,
+                  info->color_hist, &info->sampling, PROGRESSIVE_SLICE_MS)) {
+    info->sampling_in_progress = false;
+    info->color_cnt =
+        sampler_finish(&info->sampler, info->color_list, info->color_counts,
+                       info->color_hist, &info->sample_stats);
+    finish_processing(info, target_image, info->sampler.elapsed_ms);
+    return;
   }
 
-  printf("found %ld unique colors\n", info->color_cnt);
+  uint64_t now_ms = get_current_ms();
+  if (info->palette_len && now_ms - info->refresh_start_ms < info->refresh_ms) {
+    return;
+  }
+  info->refresh_start_ms = now_ms;
+  info->color_cnt = info->sampler.color_cnt;
+  sampler_snapshot(&info->sampler, info->color_list, info->color_counts);
+  info->sample_stats.samples = info->sampler.samples;
+  info->sample_stats.missing_mass =
+      info->sampler.samples
+          ? (float)info->sampler.singletons / info->sampler.samples
+          : 1.0f;
+
+  if (info->palette_len < info->palette_size &&
+      info->palette_len < info->color_cnt) {
+    // too few colors for a full palette last time, start over
+    info->palette_len = gen_weighted_median_palette(
+        (ColorStruct *)&info->palette[0], info->palette_size,
+        (ColorStruct *)&info->color_list[0], info->color_counts,
+        info->color_cnt);
+  } else {
+    refine_palette_in_space(
+        (ColorStruct *)info->palette, info->palette_len,
+        (ColorStruct *)info->color_list, info->color_counts, info->color_cnt,
+        PROGRESSIVE_KMEANS_ITERATIONS, PROGRESSIVE_KMEANS_TOLERANCE);
+    sort_palette_by_luminance((ColorStruct *)info->palette, info->palette_len);
+  }
+  find_closest_colors((ColorStruct *)info->palette, info->palette_len,
+                      info->palette_color_names);
+  build_instances(info);
+}
+
+void finish_processing(struct image_info *info, Image target_image,
+                       uint64_t extraction_ms) {
+  printf("color extraction took %" PRIu64 "ms on %zu threads\n",
+         extraction_ms, parallel_thread_count());
+  printf("read %zu samples, stopped on %s with estimated missing mass %.4f\n",
+         info->sample_stats.samples,
+         sample_stop_reason_name(info->sample_stats.stop_reason),
+         info->sample_stats.missing_mass);
+
+  info->counted_pixels = 0;
+  size_t most_common = 0;
+  for (size_t i = 0; i < info->color_cnt; i++) {
+    info->counted_pixels += info->color_counts[i];
+    if (info->color_counts[i] > info->color_counts[most_common]) {
+      most_common = i;
+    }
+  }
+  if (info->color_cnt > 0) {
+    Color common = info->color_list[most_common];
+    printf("most common color (%d,%d,%d) covers %.1f%%\n", common.r, common.g,
+           common.b,
+           100.0 * info->color_counts[most_common] / info->counted_pixels);
+  }
+
+  // generate the palette weighted by how often each color was seen
+  info->palette_len = gen_weighted_median_palette(
+      (ColorStruct *)&info->palette[0], info->palette_size,
+      (ColorStruct *)&info->color_list[0], info->color_counts,
+      info->color_cnt);
+  kmeans_report kmeans = get_last_kmeans_report();
+  if (kmeans.iterations) {
+    printf("k-means ran %u iterations in %.2fms, last move %.2f\n",
+           kmeans.iterations, kmeans.elapsed_ms, kmeans.last_shift);
+  }
+  for (size_t i = 0; i < info->palette_len; i++) {
+    printf("Palette color %zu is (%d,%d,%d)\n", i, info->palette[i].r,
+           info->palette[i].g, info->palette[i].b);
+  }
+  find_closest_colors((ColorStruct *)info->palette, info->palette_len,
+                      info->palette_color_names);
+
+  if (info->plan.quant_bits < 8) {
+    printf("found %ld occupied voxels on a %u bit grid\n", info->color_cnt,
+           info->plan.quant_bits);
+  } else {
+    printf("found %ld unique colors\n", info->color_cnt);
+  }
   printf("Got a palette length %ld\n", info->palette_len);
+  info->has_metrics = false;
+  if (info->measure_quality) {
+    remap_to_palette(info, target_image, NULL);
+  }
+  build_instances(info);
+}
+
+void build_instances(struct image_info *info) {
+  info->counted_pixels = 0;
+  for (size_t i = 0; i < info->color_cnt; i++) {
+    info->counted_pixels += info->color_counts[i];
+  }
+  float mean_count =
+      info->color_cnt ? (float)info->counted_pixels / info->color_cnt : 1;
+
+  // exact mode can find millions of colors, only draw an evenly
+  // strided subset of them so the instance buffer stays bounded
+  info->draw_cnt = info->color_cnt < MAX_COLORS ? info->color_cnt : MAX_COLORS;
+  for (size_t i = 0; i < info->draw_cnt; i++) {
+    size_t index = i * info->color_cnt / info->draw_cnt;
+    pack_instance(&info->instances[i], info->color_list[index],
+                  info->color_counts[index], mean_count);
+  }
+  info->instances_changed = true;
+}
+
+void draw_color_instances(struct image_info *info, Mesh mesh, Shader shader,
+                          int instance_loc, int quadrant_loc) {
+  if (info->draw_cnt == 0) {
+    return;
+  }
+  if (info->instances_changed) {
+    // the buffer only grows, smaller updates reuse it
+    int bytes = info->draw_cnt * sizeof(Color);
+    if (info->draw_cnt > info->instance_buffer_cnt) {
+      if (info->instance_buffer) {
+        rlUnloadVertexBuffer(info->instance_buffer);
+      }
+      info->instance_buffer = rlLoadVertexBuffer(info->instances, bytes, true);
+      info->instance_buffer_cnt = info->draw_cnt;
+    } else {
+      rlUpdateVertexBuffer(info->instance_buffer, info->instances, bytes, 0);
+    }
+    info->instances_changed = false;
+  }
 
-  info->transform_list = malloc(4 * sizeof(Matrix));
+  rlEnableShader(shader.id);
+  Matrix mvp = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+  rlSetUniformMatrix(shader.locs[SHADER_LOC_MATRIX_MVP], mvp);
+
+  // without vertex array objects the mesh's positions are bound by hand
+  if (!rlEnableVertexArray(mesh.vaoId)) {
+    rlEnableVertexBuffer(mesh.vboId[0]);
+    rlSetVertexAttribute(shader.locs[SHADER_LOC_VERTEX_POSITION], 3, RL_FLOAT,
+                         false, 0, 0);
+    rlEnableVertexAttribute(shader.locs[SHADER_LOC_VERTEX_POSITION]);
+    if (mesh.indices) {
+      rlEnableVertexBufferElement(mesh.vboId[6]);
+    }
+  }
+  rlEnableVertexBuffer(info->instance_buffer);
+  rlSetVertexAttribute(instance_loc, 4, RL_UNSIGNED_BYTE, true, 0, 0);
+  rlEnableVertexAttribute(instance_loc);
+  rlSetVertexAttributeDivisor(instance_loc, 1);
+
+  // the same instances drawn in all quadrants, mirrored by the shader
+  Vector3 quadrant_lookup[4] = {(Vector3){5, 5, 5}, (Vector3){-5, 5, -5},
+                                (Vector3){5, 5, -5}, (Vector3){-5, 5, 5}};
+  for (int quadrant = 0; quadrant < 4; quadrant++) {
+    rlSetUniform(quadrant_loc, &quadrant_lookup[quadrant],
+                 RL_SHADER_UNIFORM_VEC3, 1);
+    if (mesh.indices) {
+      rlDrawVertexArrayElementsInstanced(0, mesh.triangleCount * 3, 0,
+                                         info->draw_cnt);
+    } else {
+      rlDrawVertexArrayInstanced(0, mesh.vertexCount, info->draw_cnt);
+    }
+  }
 
-  for (int i = 0; i < 4; i++) {
-    info->transform_list[i] = malloc(sizeof(Matrix) * info->color_cnt);
-    load_transforms_from_color_list(info->transform_list[i], info->color_list,
-                                    info->color_cnt, i);
+  rlDisableVertexArray();
+  rlDisableVertexBuffer();
+  rlDisableVertexBufferElement();
+  rlDisableShader();
+}
+
+bool remap_to_palette(struct image_info *info, Image image,
+                      const char *export_path) {
+  info->has_metrics = false;
+  if (info->palette_len == 0) {
+    printf("no palette to remap to\n");
+    return false;
+  }
+  Image rgba = image;
+  if (image.format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+    rgba = ImageCopy(image);
+    ImageFormat(&rgba, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  }
+  size_t pixel_cnt = (size_t)rgba.width * rgba.height;
+  uint8_t *indices = malloc(pixel_cnt);
+  uint64_t start_ms = get_current_ms();
+  bool ok = indices && remap_image(rgba.data, rgba.width, rgba.height,
+                                   (ColorStruct *)info->palette,
+                                   info->palette_len, info->dither, indices);
+  if (ok) {
+    info->metrics =
+        measure_remap(rgba.data, pixel_cnt, indices,
+                      (ColorStruct *)info->palette, info->palette_len);
+    info->has_metrics = true;
+    printf("remapped %zu pixels to %zu colors with %s dithering in %" PRIu64
+           "ms, mse %.2f psnr %.2fdB delta e mean %.2f max %.2f, %.1f%% "
+           "noticeable\n",
+           pixel_cnt, info->palette_len, dither_method_name(info->dither),
+           get_current_ms() - start_ms, info->metrics.mse, info->metrics.psnr,
+           info->metrics.mean_delta_e, info->metrics.max_delta_e,
+           100 * info->metrics.noticeable);
+  }
+  if (ok && export_path) {
+    start_ms = get_current_ms();
+    ok = export_indexed_png(export_path, indices, rgba.width, rgba.height,
+                            (ColorStruct *)info->palette, info->palette_len);
+    if (ok) {
+      printf("wrote %s in %" PRIu64 "ms\n", export_path,
+             get_current_ms() - start_ms);
+    }
+  }
+  if (!ok) {
+    printf("failed to remap%s%s\n", export_path ? " and export " : "",
+           export_path ? export_path : "");
+  }
+  free(indices);
+  if (rgba.data != image.data) {
+    UnloadImage(rgba);
   }
+  return ok;
 }
 
 void init_info(struct image_info *info) {
-  info->drawn_pixel_map = calloc(1, (256 * 256 * 256) / (8 * sizeof(uint8_t)));
+  info->drawn_pixel_map = calloc(1, COLOR_BITMAP_BYTES);
   info->color_list = malloc(MAX_COLORS * sizeof(Color));
-  info->palette = malloc(PALETTE_SIZE * sizeof(Color));
-  info->palette_color_names = malloc(PALETTE_SIZE * sizeof(char *));
+  info->color_counts = malloc(MAX_COLORS * sizeof(uint32_t));
+  info->color_cap = MAX_COLORS;
+  info->instances = malloc(MAX_COLORS * sizeof(Color));
+  info->mode = EXTRACT_AUTO;
+  info->quant_bits = QUANT_MAX_BITS;
+  info->sampling = (sample_options){.missing_mass = 0.005f,
+                                    .time_budget_ms = 50,
+                                    .max_samples = MAX_SAMPLES,
+                                    .seed = 1};
+  info->palette_size = DEFAULT_PALETTE_SIZE;
+  info->refresh_ms = DEFAULT_REFRESH_MS;
+  info->palette = malloc(MAX_PALETTE_SIZE * sizeof(Color));
+  info->palette_color_names = malloc(MAX_PALETTE_SIZE * sizeof(char *));
 }
 
-uint64_t get_current_ms() {
-
-#ifdef __EMSCRIPTEN__
-  uint64_t ms_timestamp = emscripten_get_now();
-#else
-  struct timespec time;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &time);
-  uint64_t ms_timestamp = (time.tv_sec) * 1000 + (time.tv_nsec) / 1000000;
-#endif
-  return ms_timestamp;
-}
+uint64_t get_current_ms() { return timer_now_ms(); }
 
 void Draw_And_Render_Copy_Particles(particle *particles) {
   // iterate through the particles draw and update locations
@@ -284,16 +691,188 @@ HSV rgb_to_hsv(unsigned char r, unsigned char g, unsigned char b) {
   return hsv;
 }
 
+// options taking one of a fixed set of names stop on anything else
+// instead of quietly keeping the default
+void exit_on_bad_choice(const char *option, const char *value,
+                        const char *choices) {
+  printf("unknown %s %s, expected %s\n", option, value, choices);
+  exit(1);
+}
+
+// names the palette again from the next dictionary, they carry their
+// own index so switching doesn't build anything
+void cycle_color_dictionary(struct image_info *info) {
+  active_dictionary_slot = (active_dictionary_slot + 1) % (dictionary_cnt + 1);
+  set_color_dictionary(active_dictionary_slot
+                           ? dictionaries[active_dictionary_slot - 1]
+                           : NULL);
+  find_closest_colors((ColorStruct *)info->palette, info->palette_len,
+                      info->palette_color_names);
+  ColorDictionary *dict = get_color_dictionary();
+  printf("naming colors from %s, %zu names\n", dict->label, dict->count);
+}
+
 int main(int argc, char *argv[]) {
   // goal is to load image
   // and graph the color of each pixel
   // on 3d graph
   const int scr_width = SCREEN_WIDTH;
   const int scr_height = SCREEN_HEIGHT;
-  srand(1);
+  init_info(&info);
+
+  const char *filename = NULL;
+  const char *export_path = NULL;
+  bool bench = false;
+  bool selftest = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--exact") == 0) {
+      // scan every pixel instead of sampling
+      info.mode = EXTRACT_EXACT;
+    } else if (strcmp(argv[i], "--sampled") == 0) {
+      info.mode = EXTRACT_SAMPLED;
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      bench = true;
+    } else if (strcmp(argv[i], "--selftest") == 0) {
+      selftest = true;
+    } else if (strcmp(argv[i], "--missing-mass") == 0 && i + 1 < argc) {
+      info.sampling.missing_mass = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--time-budget") == 0 && i + 1 < argc) {
+      info.sampling.time_budget_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      info.sampling.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--pattern") == 0 && i + 1 < argc) {
+      const char *pattern = argv[++i];
+      int p = SAMPLE_UNIFORM;
+      while (p <= SAMPLE_BLUE_NOISE &&
+             strcmp(pattern, sample_pattern_name(p)) != 0) {
+        p++;
+      }
+      if (p > SAMPLE_BLUE_NOISE) {
+        exit_on_bad_choice("--pattern", pattern,
+                           "uniform, stratified or bluenoise");
+      }
+      info.sampling.pattern = p;
+    } else if (strcmp(argv[i], "--bits") == 0 && i + 1 < argc) {
+      info.quant_bits = Clamp(atoi(argv[++i]), QUANT_MIN_BITS, QUANT_MAX_BITS);
+    } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+      const char *backend = argv[++i];
+      int b = 0;
+      while (b < PALETTE_BACKEND_COUNT &&
+             strcmp(backend, palette_backend_name(b)) != 0) {
+        b++;
+      }
+      if (b == PALETTE_BACKEND_COUNT) {
+        exit_on_bad_choice("--palette", backend,
+                           "median, histogram, wu or octree");
+      }
+      set_palette_backend(b);
+    } else if (strcmp(argv[i], "--space") == 0 && i + 1 < argc) {
+      const char *space = argv[++i];
+      int s = 0;
+      while (s < COLOR_SPACE_COUNT && strcmp(space, color_space_name(s)) != 0) {
+        s++;
+      }
+      if (s == COLOR_SPACE_COUNT) {
+        exit_on_bad_choice("--space", space, "srgb, oklab or cielab");
+      }
+      set_palette_space(s);
+    } else if (strcmp(argv[i], "--hist-bits") == 0 && i + 1 < argc) {
+      set_histogram_bits(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) {
+      info.palette_size = Clamp(atoi(argv[++i]), 1, MAX_PALETTE_SIZE);
+    } else if (strcmp(argv[i], "--split") == 0 && i + 1 < argc) {
+      const char *priority = argv[++i];
+      if (strcmp(priority, "range") == 0) {
+        set_split_priority(SPLIT_BY_RANGE);
+      } else if (strcmp(priority, "variance") == 0) {
+        set_split_priority(SPLIT_BY_VARIANCE);
+      } else {
+        exit_on_bad_choice("--split", priority, "range or variance");
+      }
+    } else if (strcmp(argv[i], "--kmeans") == 0 && i + 1 < argc) {
+      set_kmeans_iterations(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--octree-depth") == 0 && i + 1 < argc) {
+      set_octree_depth(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+      export_path = argv[++i];
+    } else if (strcmp(argv[i], "--metrics") == 0) {
+      info.measure_quality = true;
+    } else if (strcmp(argv[i], "--dither") == 0 && i + 1 < argc) {
+      const char *method = argv[++i];
+      int d = 0;
+      while (d < DITHER_METHOD_COUNT &&
+             strcmp(method, dither_method_name(d)) != 0) {
+        d++;
+      }
+      if (d == DITHER_METHOD_COUNT) {
+        exit_on_bad_choice("--dither", method, "none, fs or bayer");
+      }
+      info.dither = d;
+    } else if (strcmp(argv[i], "--names") == 0 && i + 1 < argc) {
+      const char *search = argv[++i];
+      int n = 0;
+      while (n < NAME_SEARCH_COUNT &&
+             strcmp(search, name_search_name(n)) != 0) {
+        n++;
+      }
+      if (n == NAME_SEARCH_COUNT) {
+        exit_on_bad_choice("--names", search, "linear, grid or kdtree");
+      }
+      set_name_search(n);
+    } else if (strcmp(argv[i], "--name-metric") == 0 && i + 1 < argc) {
+      const char *metric = argv[++i];
+      int m = 0;
+      while (m < NAME_METRIC_COUNT &&
+             strcmp(metric, name_metric_name(m)) != 0) {
+        m++;
+      }
+      if (m == NAME_METRIC_COUNT) {
+        exit_on_bad_choice("--name-metric", metric, "rgb, de2000 or oklab");
+      }
+      set_name_metric(m);
+    } else if (strcmp(argv[i], "--progressive") == 0) {
+      info.progressive = true;
+    } else if (strcmp(argv[i], "--refresh") == 0 && i + 1 < argc) {
+      info.refresh_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      parallel_set_thread_count(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--dictionary") == 0 && i + 1 < argc) {
+      const char *path = argv[++i];
+      ColorDictionary *dict = load_color_dictionary(path);
+      if (!dict) {
+        printf("%s is not a color dictionary\n", path);
+        exit(1);
+      }
+      if (dictionary_cnt == MAX_DICTIONARIES) {
+        printf("at most %d dictionaries, skipping %s\n", MAX_DICTIONARIES,
+               path);
+        unload_color_dictionary(dict);
+        continue;
+      }
+      dictionaries[dictionary_cnt++] = dict;
+      // the last one given names the colors
+      active_dictionary_slot = dictionary_cnt;
+      set_color_dictionary(dict);
+    } else {
+      filename = argv[i];
+    }
+  }
 
-  if (argc > 1) {
-    const char *filename = argv[1];
+  if (bench) {
+    run_benchmarks();
+    return EXIT_SUCCESS;
+  }
+  if (selftest) {
+    return run_self_tests() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // built up front so naming palette colors never waits on it
+  ColorDictionary *dict = get_color_dictionary();
+  printf("naming colors from %s, %zu names %s in %.2fms using %.1fKB\n",
+         dict->label, dict->count, dict->mapped ? "mapped" : "built",
+         dict->load_ms, dict->block_bytes / 1024.0);
+
+  if (filename) {
     if (!FileExists(filename)) {
       printf("file %s does not exist\n", filename);
       exit(1);
@@ -304,13 +883,22 @@ int main(int argc, char *argv[]) {
     target_image = LoadImage("resources/oceansmall.png");
   }
 
+  if (export_path) {
+    // headless, build the palette, write the remapped image and quit.
+    // the export measures the remap itself
+    info.measure_quality = false;
+    info.progressive = false;
+    process_image(&info, target_image);
+    return remap_to_palette(&info, target_image, export_path) ? EXIT_SUCCESS
+                                                              : EXIT_FAILURE;
+  }
+
   Image color_wheel = LoadImage("resources/color_wheel.png");
 
   InitWindow(scr_width, scr_height, "image color grapher");
   SetTargetFPS(120);
 
   Texture color_wheel_texture = LoadTextureFromImage(color_wheel);
-  init_info(&info);
   target_image_tex = LoadTextureFromImage(target_image);
 
   Camera camera = {0};
@@ -334,16 +922,14 @@ int main(int argc, char *argv[]) {
   // Get shader locations
   shader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(shader, "mvp");
   shader.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(shader, "viewPos");
-  shader.locs[SHADER_LOC_MATRIX_MODEL] =
-      GetShaderLocationAttrib(shader, "instanceTransform");
+  int instance_loc = GetShaderLocationAttrib(shader, "instanceColor");
+  int quadrant_loc = GetShaderLocation(shader, "quadrant");
 
   // Set shader value: ambient light level
   int ambientLoc = GetShaderLocation(shader, "ambient");
   SetShaderValue(shader, ambientLoc, (float[4]){0.2f, 0.2f, 0.2f, 1.0f},
                  SHADER_UNIFORM_VEC4);
 
-  Material matInstances = LoadMaterialDefault();
-  matInstances.shader = shader;
   printf("making color list\n");
 
   process_image(&info, target_image);
@@ -359,6 +945,10 @@ int main(int argc, char *argv[]) {
     // Update
     //----------------------------------------------------------------------------------
     UpdateCamera(&camera, CAMERA_ORBITAL);
+    continue_processing(&info, target_image);
+    if (IsKeyPressed(KEY_D)) {
+      cycle_color_dictionary(&info);
+    }
 
     float cameraPos[3] = {camera.position.x, camera.position.y,
                           camera.position.z};
@@ -381,42 +971,75 @@ int main(int argc, char *argv[]) {
     DrawCylinderEx((Vector3){0, 0, -5}, (Vector3){0, 0, 5}, .1, .1, 12, BLUE);
 
     // draw all quadrants
-    DrawMeshInstanced(my_small_sphere, matInstances, info.transform_list[0],
-                      info.color_cnt);
-    DrawMeshInstanced(my_small_sphere, matInstances, info.transform_list[1],
-                      info.color_cnt);
-    DrawMeshInstanced(my_small_sphere, matInstances, info.transform_list[2],
-                      info.color_cnt);
-    DrawMeshInstanced(my_small_sphere, matInstances, info.transform_list[3],
-                      info.color_cnt);
+    draw_color_instances(&info, my_small_sphere, shader, instance_loc,
+                         quadrant_loc);
 
     EndMode3D();
 
     DrawFPS(10, 10);
 
+    char stats_text[128];
+    snprintf(stats_text, sizeof(stats_text),
+             "%zu %s from %zu samples (%s)", info.color_cnt,
+             info.plan.quant_bits < 8 ? "voxels" : "colors",
+             info.sample_stats.samples,
+             info.sampling_in_progress
+                 ? "sampling"
+                 : sample_stop_reason_name(info.sample_stats.stop_reason));
+    DrawText(stats_text, 10, 30, 20, WHITE);
+    snprintf(stats_text, sizeof(stats_text),
+             "about %.0f colors in %zu hashed pixels (%.0f to %.0f)",
+             info.estimate.hashed[QUANT_MAX_BITS], info.estimate.pixels,
+             info.estimate.hashed_low[QUANT_MAX_BITS],
+             info.estimate.hashed_high[QUANT_MAX_BITS]);
+    DrawText(stats_text, 10, 50, 20, WHITE);
+    if (info.has_metrics) {
+      snprintf(stats_text, sizeof(stats_text),
+               "psnr %.1fdB, delta e %.2f mean %.1f max",
+               info.metrics.psnr, info.metrics.mean_delta_e,
+               info.metrics.max_delta_e);
+      DrawText(stats_text, 10, 70, 20, WHITE);
+    }
+
     Draw_Image_In_Region(target_image_tex,
                          (Rectangle){SCREEN_WIDTH - 200, 0, 200, 200});
     DrawText("Drag and Drop Image Or Upload in Top Left", 0, SCREEN_HEIGHT - 20,
              20, WHITE);
 
     // draw the palette
-    // in the middle of the screen
+    // in the middle of the screen, swatches shrink to fit the strip and
+    // wrap into rows growing upwards once they hit the minimum width
     uint16_t pallete_color_width = 40;
     uint16_t padding = 2;
+    uint16_t max_strip_width = SCREEN_WIDTH - 40;
+    size_t per_row = info.palette_len ? info.palette_len : 1;
+    if (per_row * (pallete_color_width + padding) + padding >
+        max_strip_width) {
+      pallete_color_width = (max_strip_width - padding) / per_row - padding;
+      if (pallete_color_width < MIN_SWATCH_WIDTH) {
+        pallete_color_width = MIN_SWATCH_WIDTH;
+        per_row = (max_strip_width - padding) / (MIN_SWATCH_WIDTH + padding);
+      }
+    }
+    size_t rows = (info.palette_len + per_row - 1) / per_row;
+    size_t columns = info.palette_len < per_row ? info.palette_len : per_row;
 
     uint16_t start_x =
         SCREEN_WIDTH / 2 -
-        ((padding + pallete_color_width) * info.palette_len + padding) / 2;
-    uint16_t color_y = SCREEN_HEIGHT - 80;
+        ((padding + pallete_color_width) * columns + padding) / 2;
+    uint16_t color_y = SCREEN_HEIGHT - 80 -
+                       (rows ? rows - 1 : 0) * (pallete_color_width + padding);
     DrawRectangle(start_x, color_y - padding,
-                  padding * info.palette_len +
-                      pallete_color_width * info.palette_len + padding,
-                  pallete_color_width + padding + padding, DARKGRAY);
+                  padding * columns + pallete_color_width * columns + padding,
+                  (pallete_color_width + padding) * rows + padding, DARKGRAY);
     start_x += padding;
     for (int i = 0; i < info.palette_len; i++) {
-      uint32_t cur_x = start_x + padding * i;
+      uint32_t cur_x =
+          start_x + (padding + pallete_color_width) * (i % per_row);
+      uint32_t cur_y =
+          color_y + (padding + pallete_color_width) * (i / per_row);
       Rectangle color_rect =
-          (Rectangle){cur_x, color_y, pallete_color_width, pallete_color_width};
+          (Rectangle){cur_x, cur_y, pallete_color_width, pallete_color_width};
       DrawRectangleRec(color_rect, info.palette[i]);
       if (CheckCollisionPointRec(GetMousePosition(), color_rect)) {
         //        printf("Got mouse inside of rect with color (%d,%d,%d)\n",
@@ -430,10 +1053,11 @@ int main(int argc, char *argv[]) {
                                      .a = info.palette[i].a};
         Color tooltip_background =
             calculate_luminance(tooltip_color) > 127 ? DARKGRAY : LIGHTGRAY;
-        DrawRectangle(cur_x - padding, color_y - 100, 100 + padding * 2, 100,
-                      tooltip_background);
-
-        uint16_t x_location_with_padding = start_x + padding * i;
+        // the tooltip is wider than small swatches, keep it on screen
+        uint16_t x_location_with_padding =
+            cur_x < SCREEN_WIDTH - 104 ? cur_x : SCREEN_WIDTH - 104;
+        DrawRectangle(x_location_with_padding - padding, color_y - 100,
+                      100 + padding * 2, 100, tooltip_background);
 
         DrawRectangle(x_location_with_padding, color_y - 60 - padding, 60, 60,
                       info.palette[i]);
@@ -491,8 +1115,6 @@ int main(int argc, char *argv[]) {
 
         // h hue in degrees v will be
       }
-
-      start_x += pallete_color_width;
     }
 
     uint16_t cursor_size = 10;
@@ -531,10 +1153,6 @@ int main(int argc, char *argv[]) {
           printf("Error unable to load %s\n", files.paths[i]);
           break;
         }
-        for (int i = 0; i < 4; i++) {
-          free(info.transform_list[i]);
-        }
-        free(info.transform_list);
         UnloadImage(target_image);
         UnloadTexture(target_image_tex);
         target_image = test_load;
@@ -0,0 +1,170 @@
+#pragma once
+#include <stddef.h>
+
+// upper bound on worker threads, lets callers keep per-thread
+// scratch in fixed size arrays
+#define PARALLEL_MAX_THREADS 64
+
+// called once per task, thread is in [0, parallel_thread_count())
+// and is stable for the duration of the task
+typedef void (*parallel_task_fn)(void *ctx, size_t task, size_t thread);
+
+size_t parallel_thread_count(void);
+void parallel_set_thread_count(size_t thread_count);
+
+// runs fn for every task in [0, task_count) across a pool of worker
+// threads kept between calls and returns once all of them are done.
+// the calling thread works too, and calls made from inside a task run
+// their tasks inline
+void parallel_for(size_t task_count, parallel_task_fn fn, void *ctx);
+
+#ifdef PARALLEL_LIB_IMPLEMENTATION
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define PARALLEL_HAVE_THREADS 1
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#endif
+
+static size_t parallel_threads = 0;
+
+size_t parallel_thread_count(void) {
+  if (parallel_threads == 0) {
+#ifdef PARALLEL_HAVE_THREADS
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    parallel_threads = online > 0 ? (size_t)online : 1;
+#else
+    parallel_threads = 1;
+#endif
+    if (parallel_threads > PARALLEL_MAX_THREADS) {
+      parallel_threads = PARALLEL_MAX_THREADS;
+    }
+  }
+  return parallel_threads;
+}
+
+void parallel_set_thread_count(size_t thread_count) {
+  if (thread_count > PARALLEL_MAX_THREADS) {
+    thread_count = PARALLEL_MAX_THREADS;
+  }
+  // 0 goes back to the number of online cores
+  parallel_threads = thread_count;
+}
+
+typedef struct {
+  parallel_task_fn fn;
+  void *ctx;
+  size_t task_count;
+  size_t next_task; // shared, handed out with atomic increments
+} parallel_job;
+
+static void parallel_run_tasks(parallel_job *job, size_t thread) {
+  for (;;) {
+    size_t task = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+    if (task >= job->task_count) {
+      break;
+    }
+    job->fn(job->ctx, task, thread);
+  }
+}
+
+#ifdef PARALLEL_HAVE_THREADS
+// workers are started by the first call that needs them and then park
+// on wake between calls, so a call costs a wake up rather than creating
+// and joining threads. pool worker i runs as thread i + 1, the caller
+// is thread 0
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  size_t started;
+  uint64_t generation; // bumped for every job handed out
+  uint64_t seen[PARALLEL_MAX_THREADS]; // last generation each worker saw
+  parallel_job *job;
+  size_t helpers; // workers taking part in the current job
+  size_t busy;    // of those, the ones still running tasks
+} parallel_pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                   .wake = PTHREAD_COND_INITIALIZER,
+                   .done = PTHREAD_COND_INITIALIZER};
+// one job at a time, tasks that call parallel_for run it inline
+static pthread_mutex_t parallel_call_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local bool parallel_in_task;
+
+static void *parallel_pool_main(void *arg) {
+  size_t index = (size_t)(uintptr_t)arg;
+  parallel_in_task = true;
+  pthread_mutex_lock(&parallel_pool.lock);
+  for (;;) {
+    while (parallel_pool.generation == parallel_pool.seen[index]) {
+      pthread_cond_wait(&parallel_pool.wake, &parallel_pool.lock);
+    }
+    parallel_pool.seen[index] = parallel_pool.generation;
+    if (index >= parallel_pool.helpers) {
+      continue;
+    }
+    parallel_job *job = parallel_pool.job;
+    pthread_mutex_unlock(&parallel_pool.lock);
+    parallel_run_tasks(job, index + 1);
+    pthread_mutex_lock(&parallel_pool.lock);
+    if (--parallel_pool.busy == 0) {
+      pthread_cond_signal(&parallel_pool.done);
+    }
+  }
+  return NULL;
+}
+
+// starts workers until there are wanted of them, called with the pool
+// locked. returns how many are running, fewer if threads ran out
+static size_t parallel_pool_grow(size_t wanted) {
+  while (parallel_pool.started < wanted) {
+    size_t index = parallel_pool.started;
+    parallel_pool.seen[index] = parallel_pool.generation;
+    pthread_t handle;
+    if (pthread_create(&handle, NULL, parallel_pool_main,
+                       (void *)(uintptr_t)index) != 0) {
+      break;
+    }
+    pthread_detach(handle);
+    parallel_pool.started++;
+  }
+  return parallel_pool.started < wanted ? parallel_pool.started : wanted;
+}
+#endif
+
+void parallel_for(size_t task_count, parallel_task_fn fn, void *ctx) {
+  parallel_job job = {.fn = fn, .ctx = ctx, .task_count = task_count};
+  size_t thread_count = parallel_thread_count();
+  if (thread_count > task_count) {
+    thread_count = task_count;
+  }
+
+#ifdef PARALLEL_HAVE_THREADS
+  if (thread_count > 1 && !parallel_in_task) {
+    pthread_mutex_lock(&parallel_call_lock);
+    pthread_mutex_lock(&parallel_pool.lock);
+    // if we cant get more threads the ones we have drain the queue
+    size_t helpers = parallel_pool_grow(thread_count - 1);
+    parallel_pool.job = &job;
+    parallel_pool.helpers = helpers;
+    parallel_pool.busy = helpers;
+    parallel_pool.generation++;
+    pthread_cond_broadcast(&parallel_pool.wake);
+    pthread_mutex_unlock(&parallel_pool.lock);
+
+    parallel_in_task = true;
+    parallel_run_tasks(&job, 0);
+    parallel_in_task = false;
+
+    pthread_mutex_lock(&parallel_pool.lock);
+    while (parallel_pool.busy > 0) {
+      pthread_cond_wait(&parallel_pool.done, &parallel_pool.lock);
+    }
+    pthread_mutex_unlock(&parallel_pool.lock);
+    pthread_mutex_unlock(&parallel_call_lock);
+    return;
+  }
+#endif
+  // single threaded, or called from inside a task
+  parallel_run_tasks(&job, 0);
+}
+#endif
@@ -0,0 +1,411 @@
+#pragma once
+#include <raylib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// converts count pixels starting at linear pixel index first into
+// out, giving the same colors GetImageColor would but without
+// switching on the format for every pixel
+typedef void (*pixel_reader)(const Image *image, size_t first, size_t count,
+                             Color *out);
+
+// picks the reader for the image format once, compressed formats
+// fall back to GetImageColor
+pixel_reader get_pixel_reader(int format);
+
+// returns count pixels starting at first, pointing straight into the
+// image data for R8G8B8A8 and converting into scratch otherwise
+const Color *read_pixels(const Image *image, pixel_reader reader,
+                         size_t first, size_t count, Color *scratch);
+
+// writes the r | g << 8 | b << 16 key of each pixel to keys, skipping
+// pixels equal to the one before them since they can't add a new color
+// to the bitmap. starts gets the index each run of equal keys begins
+// at so callers can recover run lengths. returns the number of keys
+typedef size_t (*key_kernel)(const Color *pixels, size_t count,
+                             uint32_t *keys, uint32_t *starts);
+
+typedef struct {
+  const char *name;
+  key_kernel kernel;
+} key_kernel_entry;
+
+// fastest kernel the cpu supports, detected on the first call
+key_kernel get_key_kernel(void);
+
+// every kernel the cpu supports, fastest first, used by the benchmarks
+size_t get_key_kernels(key_kernel_entry *out, size_t max);
+
+#ifdef PIXEL_LIB_IMPLEMENTATION
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+static void read_grayscale(const Image *image, size_t first, size_t count,
+                           Color *out) {
+  const uint8_t *src = (const uint8_t *)image->data + first;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){src[i], src[i], src[i], 255};
+  }
+}
+
+static void read_gray_alpha(const Image *image, size_t first, size_t count,
+                            Color *out) {
+  const uint8_t *src = (const uint8_t *)image->data + first * 2;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){src[2 * i], src[2 * i], src[2 * i], src[2 * i + 1]};
+  }
+}
+
+// raylib scales 5 and 6 bit channels with integer 255 / 31 and
+// 255 / 63, keep that so colors match GetImageColor exactly
+static void read_r5g6b5(const Image *image, size_t first, size_t count,
+                        Color *out) {
+  const uint16_t *src = (const uint16_t *)image->data + first;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t p = src[i];
+    out[i] = (Color){((p >> 11) & 0x1F) * (255 / 31),
+                     ((p >> 5) & 0x3F) * (255 / 63), (p & 0x1F) * (255 / 31),
+                     255};
+  }
+}
+
+static void read_r5g5b5a1(const Image *image, size_t first, size_t count,
+                          Color *out) {
+  const uint16_t *src = (const uint16_t *)image->data + first;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t p = src[i];
+    out[i] = (Color){((p >> 11) & 0x1F) * (255 / 31),
+                     ((p >> 6) & 0x1F) * (255 / 31),
+                     ((p >> 1) & 0x1F) * (255 / 31), (p & 0x1) * 255};
+  }
+}
+
+static void read_r4g4b4a4(const Image *image, size_t first, size_t count,
+                          Color *out) {
+  const uint16_t *src = (const uint16_t *)image->data + first;
+  for (size_t i = 0; i < count; i++) {
+    uint16_t p = src[i];
+    out[i] = (Color){((p >> 12) & 0xF) * 17, ((p >> 8) & 0xF) * 17,
+                     ((p >> 4) & 0xF) * 17, (p & 0xF) * 17};
+  }
+}
+
+static void read_r8g8b8(const Image *image, size_t first, size_t count,
+                        Color *out) {
+  const uint8_t *src = (const uint8_t *)image->data + first * 3;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){src[3 * i], src[3 * i + 1], src[3 * i + 2], 255};
+  }
+}
+
+static void read_r8g8b8a8(const Image *image, size_t first, size_t count,
+                          Color *out) {
+  // Color has the same byte layout as the pixels
+  memcpy(out, (const Color *)image->data + first, count * sizeof(Color));
+}
+
+static inline uint8_t unit_float_to_u8(float f) {
+  // clamp so out of range hdr values don't overflow the cast
+  if (!(f > 0.0f)) {
+    return 0;
+  }
+  if (f >= 1.0f) {
+    return 255;
+  }
+  return (uint8_t)(f * 255.0f);
+}
+
+static void read_r32(const Image *image, size_t first, size_t count,
+                     Color *out) {
+  const float *src = (const float *)image->data + first;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){unit_float_to_u8(src[i]), 0, 0, 255};
+  }
+}
+
+static void read_r32g32b32(const Image *image, size_t first, size_t count,
+                           Color *out) {
+  const float *src = (const float *)image->data + first * 3;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){unit_float_to_u8(src[3 * i]),
+                     unit_float_to_u8(src[3 * i + 1]),
+                     unit_float_to_u8(src[3 * i + 2]), 255};
+  }
+}
+
+static void read_r32g32b32a32(const Image *image, size_t first, size_t count,
+                              Color *out) {
+  const float *src = (const float *)image->data + first * 4;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){
+        unit_float_to_u8(src[4 * i]), unit_float_to_u8(src[4 * i + 1]),
+        unit_float_to_u8(src[4 * i + 2]), unit_float_to_u8(src[4 * i + 3])};
+  }
+}
+
+#if RAYLIB_VERSION_MAJOR >= 5
+static float half_to_float(uint16_t half) {
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1F;
+  uint32_t mantissa = half & 0x3FF;
+  uint32_t bits;
+  if (exponent == 0x1F) {
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa != 0) {
+    // subnormal half, renormalize for the float exponent
+    exponent = 113;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      exponent--;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+  } else {
+    bits = sign;
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static void read_r16(const Image *image, size_t first, size_t count,
+                     Color *out) {
+  const uint16_t *src = (const uint16_t *)image->data + first;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){unit_float_to_u8(half_to_float(src[i])), 0, 0, 255};
+  }
+}
+
+static void read_r16g16b16(const Image *image, size_t first, size_t count,
+                           Color *out) {
+  const uint16_t *src = (const uint16_t *)image->data + first * 3;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){unit_float_to_u8(half_to_float(src[3 * i])),
+                     unit_float_to_u8(half_to_float(src[3 * i + 1])),
+                     unit_float_to_u8(half_to_float(src[3 * i + 2])), 255};
+  }
+}
+
+static void read_r16g16b16a16(const Image *image, size_t first, size_t count,
+                              Color *out) {
+  const uint16_t *src = (const uint16_t *)image->data + first * 4;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (Color){unit_float_to_u8(half_to_float(src[4 * i])),
+                     unit_float_to_u8(half_to_float(src[4 * i + 1])),
+                     unit_float_to_u8(half_to_float(src[4 * i + 2])),
+                     unit_float_to_u8(half_to_float(src[4 * i + 3]))};
+  }
+}
+#endif
+
+static void read_generic(const Image *image, size_t first, size_t count,
+                         Color *out) {
+  for (size_t i = 0; i < count; i++) {
+    size_t index = first + i;
+    out[i] = GetImageColor(*image, index % image->width, index / image->width);
+  }
+}
+
+pixel_reader get_pixel_reader(int format) {
+  switch (format) {
+  case PIXELFORMAT_UNCOMPRESSED_GRAYSCALE:
+    return read_grayscale;
+  case PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA:
+    return read_gray_alpha;
+  case PIXELFORMAT_UNCOMPRESSED_R5G6B5:
+    return read_r5g6b5;
+  case PIXELFORMAT_UNCOMPRESSED_R8G8B8:
+    return read_r8g8b8;
+  case PIXELFORMAT_UNCOMPRESSED_R5G5B5A1:
+    return read_r5g5b5a1;
+  case PIXELFORMAT_UNCOMPRESSED_R4G4B4A4:
+    return read_r4g4b4a4;
+  case PIXELFORMAT_UNCOMPRESSED_R8G8B8A8:
+    return read_r8g8b8a8;
+  case PIXELFORMAT_UNCOMPRESSED_R32:
+    return read_r32;
+  case PIXELFORMAT_UNCOMPRESSED_R32G32B32:
+    return read_r32g32b32;
+  case PIXELFORMAT_UNCOMPRESSED_R32G32B32A32:
+    return read_r32g32b32a32;
+#if RAYLIB_VERSION_MAJOR >= 5
+  case PIXELFORMAT_UNCOMPRESSED_R16:
+    return read_r16;
+  case PIXELFORMAT_UNCOMPRESSED_R16G16B16:
+    return read_r16g16b16;
+  case PIXELFORMAT_UNCOMPRESSED_R16G16B16A16:
+    return read_r16g16b16a16;
+#endif
+  default:
+    return read_generic;
+  }
+}
+
+const Color *read_pixels(const Image *image, pixel_reader reader,
+                         size_t first, size_t count, Color *scratch) {
+  if (reader == read_r8g8b8a8) {
+    return (const Color *)image->data + first;
+  }
+  reader(image, first, count, scratch);
+  return scratch;
+}
+
+static inline size_t key_kernel_tail(const Color *pixels, size_t start,
+                                     size_t count, size_t key_cnt,
+                                     uint32_t *keys, uint32_t *starts) {
+  uint32_t prev = UINT32_MAX; // never a valid 24 bit key
+  if (start > 0) {
+    Color c = pixels[start - 1];
+    prev = c.r | (c.g << 8) | (c.b << 16);
+  }
+  for (size_t i = start; i < count; i++) {
+    Color c = pixels[i];
+    uint32_t key = c.r | (c.g << 8) | (c.b << 16);
+    if (key != prev) {
+      starts[key_cnt] = i;
+      keys[key_cnt++] = key;
+    }
+    prev = key;
+  }
+  return key_cnt;
+}
+
+static size_t keys_scalar(const Color *pixels, size_t count, uint32_t *keys,
+                          uint32_t *starts) {
+  return key_kernel_tail(pixels, 0, count, 0, keys, starts);
+}
+
+// the simd kernels rely on Color loading as a little endian uint32, so
+// masking off alpha leaves the key. each lane is compared with the lane
+// before it (the last lane of the previous vector for lane 0) and only
+// the lanes that differ are written out
+#ifdef PIXEL_HAVE_X86_SIMD
+__attribute__((target("sse4.1"))) static size_t
+keys_sse41(const Color *pixels, size_t count, uint32_t *keys,
+           uint32_t *starts) {
+  const __m128i mask = _mm_set1_epi32(0x00FFFFFF);
+  __m128i prev = _mm_set1_epi32(-1);
+  size_t key_cnt = 0;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i cur =
+        _mm_and_si128(_mm_loadu_si128((const __m128i *)(pixels + i)), mask);
+    __m128i before = _mm_alignr_epi8(cur, prev, 12);
+    uint32_t changed =
+        ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(cur, before))) & 0xF;
+    if (changed) {
+      uint32_t lanes[4];
+      _mm_storeu_si128((__m128i *)lanes, cur);
+      while (changed) {
+        uint32_t lane = __builtin_ctz(changed);
+        starts[key_cnt] = i + lane;
+        keys[key_cnt++] = lanes[lane];
+        changed &= changed - 1;
+      }
+    }
+    prev = cur;
+  }
+  return key_kernel_tail(pixels, i, count, key_cnt, keys, starts);
+}
+
+__attribute__((target("avx2"))) static size_t
+keys_avx2(const Color *pixels, size_t count, uint32_t *keys,
+          uint32_t *starts) {
+  const __m256i mask = _mm256_set1_epi32(0x00FFFFFF);
+  const __m256i shift_up = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+  __m256i prev = _mm256_set1_epi32(-1);
+  size_t key_cnt = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i cur = _mm256_and_si256(
+        _mm256_loadu_si256((const __m256i *)(pixels + i)), mask);
+    // rotate lanes up by one then pull lane 7 of prev into lane 0
+    __m256i before =
+        _mm256_blend_epi32(_mm256_permutevar8x32_epi32(cur, shift_up),
+                           _mm256_permutevar8x32_epi32(prev, shift_up), 1);
+    uint32_t changed = ~_mm256_movemask_ps(_mm256_castsi256_ps(
+                           _mm256_cmpeq_epi32(cur, before))) &
+                       0xFF;
+    if (changed) {
+      uint32_t lanes[8];
+      _mm256_storeu_si256((__m256i *)lanes, cur);
+      while (changed) {
+        uint32_t lane = __builtin_ctz(changed);
+        starts[key_cnt] = i + lane;
+        keys[key_cnt++] = lanes[lane];
+        changed &= changed - 1;
+      }
+    }
+    prev = cur;
+  }
+  return key_kernel_tail(pixels, i, count, key_cnt, keys, starts);
+}
+#endif
+
+#ifdef __wasm_simd128__
+static size_t keys_simd128(const Color *pixels, size_t count,
+                           uint32_t *keys, uint32_t *starts) {
+  const v128_t mask = wasm_i32x4_splat(0x00FFFFFF);
+  v128_t prev = wasm_i32x4_splat(-1);
+  size_t key_cnt = 0;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    v128_t cur = wasm_v128_and(wasm_v128_load(pixels + i), mask);
+    v128_t before = wasm_i32x4_shuffle(prev, cur, 3, 4, 5, 6);
+    uint32_t changed = ~wasm_i32x4_bitmask(wasm_i32x4_eq(cur, before)) & 0xF;
+    if (changed) {
+      uint32_t lanes[4];
+      wasm_v128_store(lanes, cur);
+      while (changed) {
+        uint32_t lane = __builtin_ctz(changed);
+        starts[key_cnt] = i + lane;
+        keys[key_cnt++] = lanes[lane];
+        changed &= changed - 1;
+      }
+    }
+    prev = cur;
+  }
+  return key_kernel_tail(pixels, i, count, key_cnt, keys, starts);
+}
+#endif
+
+size_t get_key_kernels(key_kernel_entry *out, size_t max) {
+  size_t count = 0;
+#ifdef PIXEL_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (count < max && __builtin_cpu_supports("avx2")) {
+    out[count++] = (key_kernel_entry){"avx2", keys_avx2};
+  }
+  if (count < max && __builtin_cpu_supports("sse4.1")) {
+    out[count++] = (key_kernel_entry){"sse4.1", keys_sse41};
+  }
+#endif
+#ifdef __wasm_simd128__
+  if (count < max) {
+    out[count++] = (key_kernel_entry){"simd128", keys_simd128};
+  }
+#endif
+  if (count < max) {
+    out[count++] = (key_kernel_entry){"scalar", keys_scalar};
+  }
+  return count;
+}
+
+key_kernel get_key_kernel(void) {
+  static key_kernel best = NULL;
+  if (!best) {
+    key_kernel_entry entry;
+    get_key_kernels(&entry, 1);
+    best = entry.kernel;
+  }
+  return best;
+}
+#endif
@@ -0,0 +1,580 @@
+#pragma once
+#include "colors.h"
+#include "colorspace.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// how pixels between palette colors are rendered when remapping
+typedef enum {
+  DITHER_NONE,            // nearest palette color
+  DITHER_FLOYD_STEINBERG, // error diffusion to the right and next row
+  DITHER_BAYER            // 8x8 ordered threshold pattern
+} dither_method;
+
+#define DITHER_METHOD_COUNT (DITHER_BAYER + 1)
+
+const char *dither_method_name(dither_method method);
+
+// the inverse palette maps a color with this many bits per channel to
+// the palette entry nearest the middle of its cell, so remapping costs
+// one lookup per pixel no matter how large the palette is
+#define INVERSE_PALETTE_BITS 6
+#define INVERSE_PALETTE_ENTRIES (1 << (3 * INVERSE_PALETTE_BITS))
+
+// builds the table across the thread pool, free() it when done
+uint8_t *build_inverse_palette(const ColorStruct *palette, size_t palette_len);
+
+// writes the palette index of every pixel to indices. palettes hold at
+// most 256 colors so an index is a byte. error diffusion runs rows as
+// a wavefront, each row starts once the row above is a few pixels
+// ahead, and gives the same result on any number of threads
+bool remap_image(const ColorStruct *pixels, size_t width, size_t height,
+                 const ColorStruct *palette, size_t palette_len,
+                 dither_method method, uint8_t *indices);
+
+// how far a remapped image is from the original. mse is per channel so
+// psnr follows the usual 8 bit definition, delta e is CIE76, the
+// distance in CIELAB, where about 2.3 is just noticeable
+typedef struct {
+  double mse;
+  double psnr; // dB, infinite when the images match
+  double mean_delta_e;
+  double max_delta_e;
+  double noticeable; // share of pixels with delta e above 2.3
+} remap_metrics;
+
+// one pass over the pixels across the thread pool, the lab conversion
+// runs on the vector kernels
+remap_metrics measure_remap(const ColorStruct *pixels, size_t count,
+                            const uint8_t *indices,
+                            const ColorStruct *palette, size_t palette_len);
+
+// palette PNG with the smallest bit depth that holds palette_len colors
+bool export_indexed_png(const char *path, const uint8_t *indices,
+                        size_t width, size_t height,
+                        const ColorStruct *palette, size_t palette_len);
+
+#ifdef REMAP_LIB_IMPLEMENTATION
+#include "parallel.h"
+#include <math.h>
+#include <raylib.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// rows per task for the maps without a dependency between rows
+#define REMAP_TASK_ROWS 16
+// pixels a diffusing row finishes before telling the row below
+#define DIFFUSE_CHUNK 64
+
+const char *dither_method_name(dither_method method) {
+  switch (method) {
+  case DITHER_NONE:
+    return "none";
+  case DITHER_FLOYD_STEINBERG:
+    return "fs";
+  case DITHER_BAYER:
+    return "bayer";
+  }
+  return "unknown";
+}
+
+static inline uint32_t inverse_palette_key(int r, int g, int b) {
+  const int shift = 8 - INVERSE_PALETTE_BITS;
+  return (uint32_t)(r >> shift) << (2 * INVERSE_PALETTE_BITS) |
+         (uint32_t)(g >> shift) << INVERSE_PALETTE_BITS | (uint32_t)b >> shift;
+}
+
+typedef struct {
+  ColorStruct color;
+  uint8_t index;
+} SortedEntry;
+
+typedef struct {
+  SortedEntry *sorted; // palette ordered by red
+  size_t palette_len;
+  uint8_t *table;
+} inverse_palette_ctx;
+
+static int sorted_entry_red(const void *a, const void *b) {
+  const SortedEntry *x = a, *y = b;
+  if (x->color.r != y->color.r)
+    return x->color.r - y->color.r;
+  return x->index - y->index;
+}
+
+// one task per red plane of the table. the search walks out from the
+// palette colors closest in red and stops once red alone is further
+// than the best match, ties go to the lower palette index
+static void inverse_palette_task(void *arg, size_t task, size_t thread) {
+  inverse_palette_ctx *ctx = arg;
+  const SortedEntry *sorted = ctx->sorted;
+  const int len = ctx->palette_len;
+  const int side = 1 << INVERSE_PALETTE_BITS;
+  const int cell = 256 / side;
+  int r = task * cell + cell / 2;
+  int start = 0;
+  while (start < len - 1 && sorted[start].color.r < r)
+    start++;
+  for (int gi = 0; gi < side; gi++) {
+    int g = gi * cell + cell / 2;
+    for (int bi = 0; bi < side; bi++) {
+      int b = bi * cell + cell / 2;
+      int best_dist = INT32_MAX;
+      int best = 0;
+      for (int up = start, down = start - 1; up < len || down >= 0;) {
+        if (up < len) {
+          const ColorStruct c = sorted[up].color;
+          int dr = c.r - r;
+          if (dr * dr > best_dist) {
+            up = len;
+          } else {
+            int dg = c.g - g, db = c.b - b;
+            int dist = dr * dr + dg * dg + db * db;
+            if (dist < best_dist ||
+                (dist == best_dist && sorted[up].index < best)) {
+              best_dist = dist;
+              best = sorted[up].index;
+            }
+            up++;
+          }
+        }
+        if (down >= 0) {
+          const ColorStruct c = sorted[down].color;
+          int dr = r - c.r;
+          if (dr * dr > best_dist) {
+            down = -1;
+          } else {
+            int dg = c.g - g, db = c.b - b;
+            int dist = dr * dr + dg * dg + db * db;
+            if (dist < best_dist ||
+                (dist == best_dist && sorted[down].index < best)) {
+              best_dist = dist;
+              best = sorted[down].index;
+            }
+            down--;
+          }
+        }
+      }
+      ctx->table[((size_t)task * side + gi) * side + bi] = best;
+    }
+  }
+}
+
+uint8_t *build_inverse_palette(const ColorStruct *palette,
+                               size_t palette_len) {
+  if (palette_len == 0 || palette_len > 256)
+    return NULL;
+  uint8_t *table = malloc(INVERSE_PALETTE_ENTRIES);
+  SortedEntry sorted[256];
+  if (!table)
+    return NULL;
+  for (size_t i = 0; i < palette_len; i++) {
+    sorted[i] = (SortedEntry){palette[i], i};
+  }
+  qsort(sorted, palette_len, sizeof(SortedEntry), sorted_entry_red);
+  inverse_palette_ctx ctx = {sorted, palette_len, table};
+  parallel_for(1 << INVERSE_PALETTE_BITS, inverse_palette_task, &ctx);
+  return table;
+}
+
+// thresholds 0 to 63 laid out so neighbors are far apart
+static const uint8_t bayer_matrix[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+
+static inline int clamp_channel(int value) {
+  return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+typedef struct {
+  const ColorStruct *pixels;
+  size_t width, height;
+  const ColorStruct *palette;
+  const uint8_t *table;
+  uint8_t *indices;
+  int bayer_offset[8][8]; // threshold scaled to the palette spacing
+
+  // error diffusion state
+  int32_t *errors;    // ring of rows in 16ths, 3 per pixel plus a
+                      // pixel of padding on both ends
+  size_t error_rows;  // rows in the ring
+  uint32_t *progress; // pixels of each row already diffused
+  size_t next_row;    // shared, handed out with atomic increments
+} remap_ctx;
+
+static void remap_rows_task(void *arg, size_t task, size_t thread) {
+  remap_ctx *ctx = arg;
+  size_t first = task * REMAP_TASK_ROWS;
+  size_t last = first + REMAP_TASK_ROWS;
+  if (last > ctx->height)
+    last = ctx->height;
+  for (size_t y = first; y < last; y++) {
+    const ColorStruct *row = ctx->pixels + y * ctx->width;
+    uint8_t *out = ctx->indices + y * ctx->width;
+    for (size_t x = 0; x < ctx->width; x++) {
+      out[x] = ctx->table[inverse_palette_key(row[x].r, row[x].g, row[x].b)];
+    }
+  }
+}
+
+static void bayer_rows_task(void *arg, size_t task, size_t thread) {
+  remap_ctx *ctx = arg;
+  size_t first = task * REMAP_TASK_ROWS;
+  size_t last = first + REMAP_TASK_ROWS;
+  if (last > ctx->height)
+    last = ctx->height;
+  for (size_t y = first; y < last; y++) {
+    const ColorStruct *row = ctx->pixels + y * ctx->width;
+    uint8_t *out = ctx->indices + y * ctx->width;
+    const int *offsets = ctx->bayer_offset[y & 7];
+    for (size_t x = 0; x < ctx->width; x++) {
+      int offset = offsets[x & 7];
+      int r = clamp_channel(row[x].r + offset);
+      int g = clamp_channel(row[x].g + offset);
+      int b = clamp_channel(row[x].b + offset);
+      out[x] = ctx->table[inverse_palette_key(r, g, b)];
+    }
+  }
+}
+
+// waits until the row above has diffused at least count pixels
+static void wait_for_row(const uint32_t *progress, uint32_t count) {
+  while (__atomic_load_n(progress, __ATOMIC_ACQUIRE) < count) {
+    sched_yield();
+  }
+}
+
+// every worker claims the next row in order, so the rows in flight are
+// always the newest ones and no row waits on a row nobody holds.
+// pixel (x, y) pushes error to x - 1, x and x + 1 on row y + 1, so a
+// row may work up to the pixel before the one the row above is on
+static void diffuse_rows_task(void *arg, size_t task, size_t thread) {
+  remap_ctx *ctx = arg;
+  const size_t width = ctx->width;
+  const size_t stride = (width + 2) * 3;
+  for (;;) {
+    size_t y = __atomic_fetch_add(&ctx->next_row, 1, __ATOMIC_RELAXED);
+    if (y >= ctx->height)
+      break;
+    // rows more than a thread count back are finished, so the ring
+    // entries this row touches are free
+    int32_t *cur = ctx->errors + (y % ctx->error_rows) * stride + 3;
+    int32_t *next = ctx->errors + ((y + 1) % ctx->error_rows) * stride + 3;
+    memset(next - 3, 0, stride * sizeof(int32_t));
+    const ColorStruct *row = ctx->pixels + y * width;
+    uint8_t *out = ctx->indices + y * width;
+    int32_t carry[3] = {0};
+
+    for (size_t x0 = 0; x0 < width; x0 += DIFFUSE_CHUNK) {
+      size_t x1 = x0 + DIFFUSE_CHUNK < width ? x0 + DIFFUSE_CHUNK : width;
+      if (y > 0)
+        wait_for_row(&ctx->progress[y - 1], x1 + 1 < width ? x1 + 1 : width);
+      for (size_t x = x0; x < x1; x++) {
+        int value[3] = {row[x].r, row[x].g, row[x].b};
+        for (int c = 0; c < 3; c++) {
+          value[c] =
+              clamp_channel(value[c] + ((cur[x * 3 + c] + carry[c] + 8) >> 4));
+        }
+        uint8_t index =
+            ctx->table[inverse_palette_key(value[0], value[1], value[2])];
+        out[x] = index;
+        const ColorStruct p = ctx->palette[index];
+        int32_t error[3] = {value[0] - p.r, value[1] - p.g, value[2] - p.b};
+        for (int c = 0; c < 3; c++) {
+          carry[c] = error[c] * 7;
+          next[(x - 1) * 3 + c] += error[c] * 3;
+          next[x * 3 + c] += error[c] * 5;
+          next[(x + 1) * 3 + c] += error[c];
+        }
+      }
+      __atomic_store_n(&ctx->progress[y], (uint32_t)x1, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+bool remap_image(const ColorStruct *pixels, size_t width, size_t height,
+                 const ColorStruct *palette, size_t palette_len,
+                 dither_method method, uint8_t *indices) {
+  if (width == 0 || height == 0)
+    return true;
+  uint8_t *table = build_inverse_palette(palette, palette_len);
+  if (!table)
+    return false;
+  remap_ctx ctx = {.pixels = pixels,
+                   .width = width,
+                   .height = height,
+                   .palette = palette,
+                   .table = table,
+                   .indices = indices};
+  size_t row_tasks = (height + REMAP_TASK_ROWS - 1) / REMAP_TASK_ROWS;
+  bool ok = true;
+
+  switch (method) {
+  case DITHER_BAYER: {
+    // thresholds span about the distance between palette colors if they
+    // were spread evenly over the cube
+    float spread = 256.0f / cbrtf(palette_len);
+    for (int y = 0; y < 8; y++) {
+      for (int x = 0; x < 8; x++) {
+        ctx.bayer_offset[y][x] =
+            lroundf(((bayer_matrix[y][x] + 0.5f) / 64 - 0.5f) * spread);
+      }
+    }
+    parallel_for(row_tasks, bayer_rows_task, &ctx);
+    break;
+  }
+  case DITHER_FLOYD_STEINBERG: {
+    size_t threads = parallel_thread_count();
+    ctx.error_rows = threads + 2;
+    ctx.errors = malloc(ctx.error_rows * (width + 2) * 3 * sizeof(int32_t));
+    ctx.progress = calloc(height, sizeof(uint32_t));
+    if (!ctx.errors || !ctx.progress) {
+      ok = false;
+    } else {
+      // the first row reads the entry no row above wrote
+      memset(ctx.errors, 0, (width + 2) * 3 * sizeof(int32_t));
+      parallel_for(threads, diffuse_rows_task, &ctx);
+    }
+    free(ctx.errors);
+    free(ctx.progress);
+    break;
+  }
+  default:
+    parallel_for(row_tasks, remap_rows_task, &ctx);
+    break;
+  }
+  free(table);
+  return ok;
+}
+
+// pixels per metrics task, and per lab conversion inside a task
+#define METRICS_TASK_PIXELS 65536
+#define METRICS_BLOCK_PIXELS 256
+#define NOTICEABLE_DELTA_E 2.3f
+
+// per thread sums, each on its own cache line so threads don't share
+#define METRICS_LINE_BYTES 64
+typedef struct {
+  _Alignas(METRICS_LINE_BYTES) uint64_t squared_error;
+  uint64_t noticeable;
+  double delta_e;
+  float max_delta_e;
+} metrics_sums;
+
+typedef struct {
+  const ColorStruct *pixels;
+  size_t count;
+  const uint8_t *indices;
+  const ColorStruct *palette;
+  LabColor palette_lab[256];
+  lab_kernel kernel;
+  metrics_sums sums[PARALLEL_MAX_THREADS];
+} metrics_ctx;
+
+static void metrics_task(void *arg, size_t task, size_t thread) {
+  metrics_ctx *ctx = arg;
+  size_t first = task * METRICS_TASK_PIXELS;
+  size_t last = first + METRICS_TASK_PIXELS;
+  if (last > ctx->count)
+    last = ctx->count;
+  metrics_sums *sums = &ctx->sums[thread];
+  LabColor lab[METRICS_BLOCK_PIXELS];
+  for (size_t i = first; i < last; i += METRICS_BLOCK_PIXELS) {
+    size_t block = last - i < METRICS_BLOCK_PIXELS ? last - i
+                                                   : METRICS_BLOCK_PIXELS;
+    const ColorStruct *pixels = ctx->pixels + i;
+    const uint8_t *indices = ctx->indices + i;
+    ctx->kernel(pixels, block, COLOR_SPACE_CIELAB, lab);
+    uint32_t squared_error = 0;
+    uint32_t noticeable = 0;
+    float delta_e = 0, max_delta_e = sums->max_delta_e;
+    for (size_t j = 0; j < block; j++) {
+      const ColorStruct p = ctx->palette[indices[j]];
+      int dr = pixels[j].r - p.r;
+      int dg = pixels[j].g - p.g;
+      int db = pixels[j].b - p.b;
+      squared_error += dr * dr + dg * dg + db * db;
+
+      const LabColor q = ctx->palette_lab[indices[j]];
+      float dl = lab[j].l - q.l, da = lab[j].a - q.a, dbl = lab[j].b - q.b;
+      float distance = sqrtf(dl * dl + da * da + dbl * dbl);
+      delta_e += distance;
+      noticeable += distance > NOTICEABLE_DELTA_E;
+      max_delta_e = distance > max_delta_e ? distance : max_delta_e;
+    }
+    // a block of 256 can't overflow 32 bits, the totals need 64
+    sums->squared_error += squared_error;
+    sums->noticeable += noticeable;
+    sums->delta_e += delta_e;
+    sums->max_delta_e = max_delta_e;
+  }
+}
+
+remap_metrics measure_remap(const ColorStruct *pixels, size_t count,
+                            const uint8_t *indices,
+                            const ColorStruct *palette, size_t palette_len) {
+  remap_metrics metrics = {0};
+  if (count == 0 || palette_len == 0 || palette_len > 256)
+    return metrics;
+  // the sums only land on their own lines if the context is aligned,
+  // and the aligned sums make sizeof a multiple of the line
+  metrics_ctx *ctx = aligned_alloc(METRICS_LINE_BYTES, sizeof(metrics_ctx));
+  if (!ctx)
+    return metrics;
+  memset(ctx, 0, sizeof(metrics_ctx));
+  ctx->pixels = pixels;
+  ctx->count = count;
+  ctx->indices = indices;
+  ctx->palette = palette;
+  ctx->kernel = get_lab_kernel();
+  ctx->kernel(palette, palette_len, COLOR_SPACE_CIELAB, ctx->palette_lab);
+  parallel_for((count + METRICS_TASK_PIXELS - 1) / METRICS_TASK_PIXELS,
+               metrics_task, ctx);
+
+  uint64_t squared_error = 0, noticeable = 0;
+  double delta_e = 0;
+  for (size_t t = 0; t < PARALLEL_MAX_THREADS; t++) {
+    squared_error += ctx->sums[t].squared_error;
+    noticeable += ctx->sums[t].noticeable;
+    delta_e += ctx->sums[t].delta_e;
+    if (ctx->sums[t].max_delta_e > metrics.max_delta_e)
+      metrics.max_delta_e = ctx->sums[t].max_delta_e;
+  }
+  metrics.mse = (double)squared_error / (3.0 * count);
+  metrics.psnr =
+      metrics.mse > 0 ? 10 * log10(255.0 * 255.0 / metrics.mse) : INFINITY;
+  metrics.mean_delta_e = delta_e / count;
+  metrics.noticeable = (double)noticeable / count;
+  free(ctx);
+  return metrics;
+}
+
+static uint32_t png_crc_table[256];
+
+static uint32_t png_crc(uint32_t crc, const uint8_t *data, size_t len) {
+  if (!png_crc_table[1]) {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      png_crc_table[n] = c;
+    }
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = png_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t len) {
+  uint32_t a = 1, b = 0;
+  while (len) {
+    // largest run before b can overflow
+    size_t run = len < 5552 ? len : 5552;
+    len -= run;
+    while (run--) {
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
+
+static void put_be32(uint8_t *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static bool write_png_chunk(FILE *file, const char *type, const uint8_t *data,
+                            size_t len) {
+  uint8_t header[8];
+  put_be32(header, len);
+  memcpy(header + 4, type, 4);
+  uint8_t footer[4];
+  put_be32(footer, png_crc(png_crc(0, header + 4, 4), data, len));
+  return fwrite(header, 1, 8, file) == 8 &&
+         (len == 0 || fwrite(data, 1, len, file) == len) &&
+         fwrite(footer, 1, 4, file) == 4;
+}
+
+bool export_indexed_png(const char *path, const uint8_t *indices,
+                        size_t width, size_t height,
+                        const ColorStruct *palette, size_t palette_len) {
+  if (palette_len == 0 || palette_len > 256 || width == 0 || height == 0)
+    return false;
+  int depth = palette_len <= 2    ? 1
+              : palette_len <= 4  ? 2
+              : palette_len <= 16 ? 4
+                                  : 8;
+  int per_byte = 8 / depth;
+  size_t row_bytes = (width + per_byte - 1) / per_byte;
+
+  // every row starts with filter type 0, indexed images compress best
+  // without prediction
+  size_t raw_len = (row_bytes + 1) * height;
+  if (raw_len > INT32_MAX)
+    return false;
+  uint8_t *raw = calloc(raw_len, 1);
+  if (!raw)
+    return false;
+  for (size_t y = 0; y < height; y++) {
+    uint8_t *out = raw + y * (row_bytes + 1) + 1;
+    const uint8_t *row = indices + y * width;
+    for (size_t x = 0; x < width; x++) {
+      int shift = 8 - depth * (int)(x % per_byte + 1);
+      out[x / per_byte] |= row[x] << shift;
+    }
+  }
+
+  // raylib deflates, PNG wants it wrapped in a zlib stream
+  int deflated_len = 0;
+  uint8_t *deflated = CompressData(raw, raw_len, &deflated_len);
+  uint8_t *zlib = deflated ? malloc(deflated_len + 6) : NULL;
+  bool ok = zlib != NULL;
+  FILE *file = ok ? fopen(path, "wb") : NULL;
+  if (file) {
+    zlib[0] = 0x78;
+    zlib[1] = 0x9C;
+    memcpy(zlib + 2, deflated, deflated_len);
+    put_be32(zlib + 2 + deflated_len, adler32(raw, raw_len));
+
+    uint8_t header[13];
+    put_be32(header, width);
+    put_be32(header + 4, height);
+    header[8] = depth;
+    header[9] = 3; // indexed color
+    header[10] = header[11] = header[12] = 0;
+    uint8_t plte[256 * 3];
+    for (size_t i = 0; i < palette_len; i++) {
+      plte[i * 3] = palette[i].r;
+      plte[i * 3 + 1] = palette[i].g;
+      plte[i * 3 + 2] = palette[i].b;
+    }
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G',
+                                         '\r', '\n', 0x1A, '\n'};
+    ok = fwrite(signature, 1, 8, file) == 8 &&
+         write_png_chunk(file, "IHDR", header, 13) &&
+         write_png_chunk(file, "PLTE", plte, palette_len * 3) &&
+         write_png_chunk(file, "IDAT", zlib, deflated_len + 6) &&
+         write_png_chunk(file, "IEND", NULL, 0);
+    ok = fclose(file) == 0 && ok;
+  } else {
+    ok = false;
+  }
+  free(zlib);
+  MemFree(deflated);
+  free(raw);
+  return ok;
+}
+#endif
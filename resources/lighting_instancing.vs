@@ -6,30 +6,29 @@ in vec2 vertexTexCoord;
 in vec3 vertexNormal;
 in vec4 vertexColor;      // Not required
 
-in mat4 instanceTransform;
+// rgb places the sphere in the color cube, a is its scale
+in vec4 instanceColor;
 
 // Input uniform values
 uniform mat4 mvp;
-uniform mat4 matNormal;
-uniform mat4 matModel;
+// size and mirroring of the quadrant being drawn
+uniform vec3 quadrant;
 
 // Output vertex attributes (to fragment shader)
 out vec4 fragColor;
 
-// NOTE: Add here your custom variables
+// must match INSTANCE_MIN_SCALE and INSTANCE_MAX_SCALE in main.c
+const float minScale = 0.5;
+const float maxScale = 3.0;
 
 void main()
 {
-    // Compute MVP for current instance
-    mat4 mvpi = mvp*instanceTransform;
-
-
+    float scale = mix(minScale, maxScale, instanceColor.a);
+    vec3 fragWorldPosition = vertexPosition*scale + instanceColor.rgb*quadrant;
 
     // Calculate final vertex position
-    gl_Position = mvpi*vec4(vertexPosition, 1.0);
+    gl_Position = mvp*vec4(fragWorldPosition, 1.0);
 
-    mat4 matModeli = matModel * instanceTransform;
-    vec4 fragWorldPosition = instanceTransform * vec4(vertexPosition,1.0);
-    vec3 colorFactor = clamp(abs(fragWorldPosition.xyz) / vec3(5.0, 5.0, 5.0), 0.0, 1.0);
+    vec3 colorFactor = clamp(abs(fragWorldPosition) / vec3(5.0, 5.0, 5.0), 0.0, 1.0);
     fragColor = vec4(colorFactor,1.0);
 }
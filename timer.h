@@ -0,0 +1,23 @@
+#pragma once
+
+// monotonic milliseconds with sub millisecond precision, the one clock
+// everything that times itself reads
+double timer_now_ms(void);
+
+#ifdef TIMER_LIB_IMPLEMENTATION
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#else
+#include <time.h>
+#endif
+
+double timer_now_ms(void) {
+#ifdef __EMSCRIPTEN__
+  return emscripten_get_now();
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1e6;
+#endif
+}
+#endif